@@ -1,9 +1,14 @@
 #include "ast.h"
+#include "mem.h"
+
+#include <ctype.h> // isspace
+#include <stdio.h>
 
 extern scope_t *ast_new_scope(scope_t *outer)
 {
     scope_t s = {.outer=outer};
     da_init_s(&s.list);
+    MEM_COUNT(MEM_SCOPES, sizeof(s));
     return copy(&s);
 }
 
@@ -19,3 +24,350 @@ extern int scope_lookup(scope_t *s, const char *ident)
     }
     return 0;
 }
+
+/* Whether a function is visible outside its file: main, or a capitalized
+ * name as in Go. */
+extern int ast_is_exported(const char *name)
+{
+    return !strcmp(name, "main") || ('A' <= *name && *name <= 'Z');
+}
+
+/* The definition of the function called name, or its first declaration if
+ * it's defined elsewhere, or NULL. */
+extern node_t *ast_find_func(const file_t *f, const char *name)
+{
+    node_t *first = NULL;
+
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t != DECL_FUNC
+                || strcmp((*decls)->decl.func.name->expr.ident.name, name))
+            continue;
+        if ((*decls)->decl.func.body)
+            return *decls;
+        if (!first)
+            first = *decls;
+    }
+    return first;
+}
+
+/* The binary operator a compound assignment token applies, like token_ADD
+ * for token_ADD_ASSIGN, or 0 for anything else. */
+extern int ast_assign_op(int tok)
+{
+    switch (tok) {
+    case token_ADD_ASSIGN:
+        return token_ADD;
+    case token_SUB_ASSIGN:
+        return token_SUB;
+    case token_MUL_ASSIGN:
+        return token_MUL;
+    case token_QUO_ASSIGN:
+        return token_QUO;
+    case token_REM_ASSIGN:
+        return token_REM;
+    case token_AND_ASSIGN:
+        return token_AND;
+    case token_OR_ASSIGN:
+        return token_OR;
+    case token_XOR_ASSIGN:
+        return token_XOR;
+    case token_SHL_ASSIGN:
+        return token_SHL;
+    case token_SHR_ASSIGN:
+        return token_SHR;
+    case token_AND_NOT_ASSIGN:
+        return token_AND_NOT;
+    default:
+        return 0;
+    }
+}
+
+/* Whether n is a literal, possibly parenthesized and negated, and its
+ * value in *v if so, wrapped to an int like the compiled code. */
+extern int ast_const_value(const node_t *n, int *v)
+{
+    int neg = 0;
+
+    for (;;) {
+        switch (n->t) {
+        case EXPR_BASIC:
+            *v = n->expr.basic.value;
+            if (neg)
+                *v = -(unsigned)*v;
+            return 1;
+        case EXPR_PAREN:
+            n = n->expr.paren.x;
+            break;
+        case EXPR_UNARY:
+            if (n->expr.unary.op != token_SUB)
+                return 0;
+            neg = !neg;
+            n = n->expr.unary.expr;
+            break;
+        default:
+            return 0;
+        }
+    }
+}
+
+/* The value assignment n stores: its right-hand side, or for a compound
+ * assignment the binary expression it stands for, built in tmp. */
+extern const node_t *ast_assign_value(const node_t *n, node_t *tmp)
+{
+    int op = ast_assign_op(n->stmt.assign.tok);
+
+    if (!op)
+        return n->stmt.assign.rhs;
+    *tmp = (node_t){
+        .t = EXPR_BINARY,
+        .pos = n->pos,
+        .expr.binary = {
+            .op = op,
+            .x = n->stmt.assign.lhs,
+            .y = n->stmt.assign.rhs,
+        },
+    };
+    return tmp;
+}
+
+/* Whether a case clause ends in fallthrough, going on into the next one. */
+extern int ast_falls_through(const node_t *clause)
+{
+    node_t **stmts = clause->stmt.case_.stmts;
+    int n = 0;
+
+    while (stmts[n])
+        n++;
+    return n && stmts[n - 1]->t == STMT_BRANCH
+        && stmts[n - 1]->stmt.branch.tok == token_FALLTHROUGH;
+}
+
+extern void ast_stack_init(ast_stack_t *s, int size)
+{
+    *s = (ast_stack_t){.size = size};
+}
+
+extern void ast_stack_deinit(ast_stack_t *s)
+{
+    free(s->items);
+}
+
+/* A new zeroed item on top of s. */
+extern void *ast_stack_push(ast_stack_t *s)
+{
+    if (s->len == s->cap) {
+        s->cap = s->cap ? 2 * s->cap : 64;
+        s->items = realloc(s->items, s->cap * s->size);
+    }
+    return memset(s->items + s->len++ * s->size, 0, s->size);
+}
+
+/* Take the top item off s and return it, or NULL if s is empty. */
+extern void *ast_stack_pop(ast_stack_t *s)
+{
+    return s->len ? s->items + --s->len * s->size : NULL;
+}
+
+extern void *ast_stack_top(ast_stack_t *s)
+{
+    return s->len ? s->items + (s->len - 1) * s->size : NULL;
+}
+
+static void push_node(ast_stack_t *s, const node_t *n)
+{
+    if (n)
+        *(const node_t **)ast_stack_push(s) = n;
+}
+
+static void push_list(ast_stack_t *s, node_t **list)
+{
+    int len = 0;
+
+    while (list && list[len])
+        len++;
+    while (len--)
+        push_node(s, list[len]);
+}
+
+/* Push the children of n that are there onto a stack of node pointers,
+ * last first so they pop in source order. */
+extern void ast_push_children(ast_stack_t *s, const node_t *n)
+{
+    switch (n->t) {
+    case EXPR_BINARY:
+        push_node(s, n->expr.binary.y);
+        push_node(s, n->expr.binary.x);
+        break;
+    case EXPR_CALL:
+        push_list(s, n->expr.call.args);
+        push_node(s, n->expr.call.func);
+        break;
+    case EXPR_FIELD:
+        push_node(s, n->expr.field.type);
+        push_node(s, n->expr.field.name);
+        break;
+    case EXPR_PAREN:
+        push_node(s, n->expr.paren.x);
+        break;
+    case EXPR_SELECTOR:
+        push_node(s, n->expr.selector.sel);
+        push_node(s, n->expr.selector.x);
+        break;
+    case EXPR_STRUCT:
+        push_list(s, n->expr.struct_.fields);
+        break;
+    case EXPR_UNARY:
+        push_node(s, n->expr.unary.expr);
+        break;
+    case STMT_ASSIGN:
+        push_node(s, n->stmt.assign.rhs);
+        push_node(s, n->stmt.assign.lhs);
+        break;
+    case STMT_BLOCK:
+        push_list(s, n->stmt.block.stmts);
+        break;
+    case STMT_CASE:
+        push_list(s, n->stmt.case_.stmts);
+        push_list(s, n->stmt.case_.exprs);
+        break;
+    case STMT_DECL:
+        push_node(s, n->stmt.decl.decl);
+        break;
+    case STMT_EXPR:
+        push_node(s, n->stmt.expr.x);
+        break;
+    case STMT_FOR:
+        push_node(s, n->stmt.for_.body);
+        push_node(s, n->stmt.for_.post);
+        push_node(s, n->stmt.for_.cond);
+        push_node(s, n->stmt.for_.init);
+        break;
+    case STMT_IF:
+        push_node(s, n->stmt.if_.else_);
+        push_node(s, n->stmt.if_.body);
+        push_node(s, n->stmt.if_.cond);
+        break;
+    case STMT_RETURN:
+        push_node(s, n->stmt.return_.expr);
+        break;
+    case STMT_SWITCH:
+        push_list(s, n->stmt.switch_.clauses);
+        push_node(s, n->stmt.switch_.tag);
+        break;
+    case DECL_FUNC:
+        push_node(s, n->decl.func.body);
+        push_node(s, n->decl.func.type);
+        push_list(s, n->decl.func.params);
+        push_node(s, n->decl.func.name);
+        push_node(s, n->decl.func.recv);
+        break;
+    case DECL_TYPE:
+        push_node(s, n->decl.type.type);
+        push_node(s, n->decl.type.name);
+        break;
+    case DECL_VAR:
+        push_node(s, n->decl.var.value);
+        push_node(s, n->decl.var.type);
+        push_node(s, n->decl.var.name);
+        break;
+    default:
+        break;
+    }
+}
+
+/* The number of nodes on the longest path down from n. A NULL on the stack
+ * marks where a node's children end. */
+extern int ast_depth(const node_t *n)
+{
+    ast_stack_t s;
+    const node_t **top;
+    int depth = 0;
+    int max = 0;
+
+    ast_stack_init(&s, sizeof(n));
+    *(const node_t **)ast_stack_push(&s) = n;
+    while ((top = ast_stack_pop(&s))) {
+        if (!(n = *top)) {
+            depth--;
+            continue;
+        }
+        if (++depth > max)
+            max = depth;
+        ast_stack_push(&s);
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+    return max;
+}
+
+static int is_int(const node_t *type)
+{
+    return type->t == EXPR_IDENT && !strcmp(type->expr.ident.name, "int");
+}
+
+/* The first thing in f's functions that needs a struct: a method, a local,
+ * parameter or result of a struct type, a selector or a struct literal.
+ * NULL if they only use ints. */
+extern const node_t *ast_find_struct_use(const file_t *f)
+{
+    ast_stack_t s;
+    const node_t **top;
+    const node_t *found = NULL;
+
+    ast_stack_init(&s, sizeof(*top));
+    for (node_t **decls = f->decls; decls && *decls && !found; ++decls) {
+        if ((*decls)->t == DECL_FUNC)
+            push_node(&s, *decls);
+        while (!found && (top = ast_stack_pop(&s))) {
+            const node_t *n = *top;
+            switch (n->t) {
+            case DECL_FUNC:
+                if (n->decl.func.recv)
+                    found = n->decl.func.recv;
+                for (node_t **params = n->decl.func.params; !found && params && *params; ++params) {
+                    if (!is_int((*params)->expr.field.type))
+                        found = (*params)->expr.field.type;
+                }
+                if (!found && !is_int(n->decl.func.type))
+                    found = n->decl.func.type;
+                break;
+            case DECL_VAR:
+                if (!is_int(n->decl.var.type))
+                    found = n->decl.var.type;
+                break;
+            case EXPR_SELECTOR:
+            case EXPR_STRUCT:
+                found = n;
+                break;
+            default:
+                break;
+            }
+            ast_push_children(&s, n);
+        }
+    }
+    ast_stack_deinit(&s);
+    return found;
+}
+
+/* Report msg at n as file:line:column, the way the parser reports syntax
+ * errors, and exit. Nodes record where the scanner was after the token
+ * before theirs, so the whitespace in between is skipped. */
+extern void ast_error(const file_t *f, const node_t *n, const char *msg)
+{
+    int pos = n->pos > 0 ? n->pos - 1 : 0;
+    int line = 1;
+    int column = 1;
+
+    while (pos < f->src_len && isspace((unsigned char)f->src[pos]))
+        ++pos;
+    for (int i = 0; i < pos; ++i) {
+        if (f->src[i] == '\n') {
+            line++;
+            column = 1;
+        } else {
+            column++;
+        }
+    }
+    fprintf(stderr, "%s:%d:%d: %s\n", f->filename, line, column, msg);
+    exit(1);
+}
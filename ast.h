@@ -5,6 +5,7 @@
 #include <da/da.h>
 #include <da/da_str.h>
 
+#include <stdint.h> // int64_t
 #include <stdlib.h> // malloc
 #include <string.h> // memcpy
 
@@ -24,18 +25,21 @@ typedef enum {
     EXPR_FIELD,
     EXPR_IDENT,
     EXPR_PAREN,
+    EXPR_SELECTOR,
     EXPR_STRUCT,
     EXPR_UNARY,
 
     STMT_ASSIGN,
     STMT_BLOCK,
     STMT_BRANCH,
+    STMT_CASE,
     STMT_DECL,
     STMT_EMPTY,
     STMT_EXPR,
     STMT_FOR,
     STMT_IF,
     STMT_RETURN,
+    STMT_SWITCH,
 
     DECL_FUNC,
     DECL_TYPE,
@@ -53,7 +57,7 @@ struct _node {
 
             struct {
                 int kind; // token
-                char *value; // buf
+                int64_t value;
             } basic;
 
             struct {
@@ -80,6 +84,11 @@ struct _node {
                 node_t *x;
             } paren;
 
+            struct {
+                node_t *x;
+                node_t *sel;
+            } selector;
+
             struct {
                 node_t **fields;
             } struct_;
@@ -107,6 +116,11 @@ struct _node {
                 token_t tok;
             } branch;
 
+            struct {
+                node_t **exprs; // int literals, or NULL for default
+                node_t **stmts;
+            } case_;
+
             struct {
                 node_t *decl;
             } decl;
@@ -132,6 +146,11 @@ struct _node {
                 node_t *expr;
             } return_;
 
+            struct {
+                node_t *tag;
+                node_t **clauses;
+            } switch_;
+
         } stmt;
 
         union { // decl
@@ -142,6 +161,9 @@ struct _node {
                 node_t **params;
                 node_t *type;
                 node_t *body;
+                node_t *inline_body; // an imported function's, for opt_eval
+                int flags; // FUNC_*, found by opt_callgraph
+                int scc; // its component's number, callees' first
             } func;
 
             struct {
@@ -163,7 +185,19 @@ struct _node {
     };
 };
 
+/* What opt_callgraph found out about a function. */
+enum {
+    FUNC_REACHABLE = 1 << 0, // from main or an exported function
+    FUNC_RECURSIVE = 1 << 1, // calls itself, directly or not
+    FUNC_PURE = 1 << 2, // only computes its result from its arguments
+};
+
 struct _file {
+    const char *filename;
+    const char *src; // for mapping node positions to lines
+    int src_len;
+    node_t *package; // its name, or NULL without a package clause
+    node_t **imports; // package names
     node_t **decls;
 };
 
@@ -172,5 +206,32 @@ typedef struct _scope {
     da_t list;
 } scope_t;
 
+/* A stack of items of one size, for walking trees too deep to recurse on.
+ * Pointers into it last until the next push. */
+typedef struct {
+    char *items;
+    int len;
+    int cap;
+    int size;
+} ast_stack_t;
+
+extern void ast_stack_init(ast_stack_t *s, int size);
+extern void ast_stack_deinit(ast_stack_t *s);
+extern void *ast_stack_push(ast_stack_t *s);
+extern void *ast_stack_pop(ast_stack_t *s);
+extern void *ast_stack_top(ast_stack_t *s);
+
+extern void ast_push_children(ast_stack_t *s, const node_t *n);
+extern int ast_depth(const node_t *n);
+
 extern scope_t *ast_new_scope(scope_t *outer);
 extern int scope_lookup(scope_t *s, const char *ident);
+
+extern int ast_is_exported(const char *name);
+extern node_t *ast_find_func(const file_t *f, const char *name);
+extern int ast_assign_op(int tok);
+extern int ast_const_value(const node_t *n, int *v);
+extern const node_t *ast_assign_value(const node_t *n, node_t *tmp);
+extern int ast_falls_through(const node_t *clause);
+extern const node_t *ast_find_struct_use(const file_t *f);
+extern void ast_error(const file_t *f, const node_t *n, const char *msg);
@@ -0,0 +1,110 @@
+#include "bc.h"
+
+#include <stdlib.h> // realloc
+#include <string.h> // strcmp, strlen
+
+const bc_info_t bc_ops[NUM_BC_OPS] = {
+    [BC_MOVI] = {"movi", "rk"},
+    [BC_MOV] = {"mov", "rr"},
+    [BC_ADD] = {"add", "rrr"},
+    [BC_SUB] = {"sub", "rrr"},
+    [BC_MUL] = {"mul", "rrr"},
+    [BC_DIV] = {"div", "rrr"},
+    [BC_REM] = {"rem", "rrr"},
+    [BC_AND] = {"and", "rrr"},
+    [BC_OR] = {"or", "rrr"},
+    [BC_XOR] = {"xor", "rrr"},
+    [BC_SHL] = {"shl", "rrr"},
+    [BC_SHR] = {"shr", "rrr"},
+    [BC_EQ] = {"eq", "rrr"},
+    [BC_NE] = {"ne", "rrr"},
+    [BC_LT] = {"lt", "rrr"},
+    [BC_LE] = {"le", "rrr"},
+    [BC_GT] = {"gt", "rrr"},
+    [BC_GE] = {"ge", "rrr"},
+    [BC_LAND] = {"land", "rrr"},
+    [BC_LOR] = {"lor", "rrr"},
+    [BC_NEG] = {"neg", "rr"},
+    [BC_NOT] = {"not", "rr"},
+    [BC_LNOT] = {"lnot", "rr"},
+    [BC_JMP] = {"jmp", "t"},
+    [BC_JZ] = {"jz", "rt"},
+    [BC_JNZ] = {"jnz", "rt"},
+    [BC_CALL] = {"call", "rfrn"},
+    [BC_CALLX] = {"callx", "rxrn"},
+    [BC_RET] = {"ret", "r"},
+    [BC_ADDI] = {"addi", "rrk"},
+    [BC_MULI] = {"muli", "rrk"},
+    [BC_JEQ] = {"jeq", "rrt"},
+    [BC_JNE] = {"jne", "rrt"},
+    [BC_JLT] = {"jlt", "rrt"},
+    [BC_JLE] = {"jle", "rrt"},
+    [BC_JGT] = {"jgt", "rrt"},
+    [BC_JGE] = {"jge", "rrt"},
+    [BC_JEQI] = {"jeqi", "rkt"},
+    [BC_JNEI] = {"jnei", "rkt"},
+    [BC_JLTI] = {"jlti", "rkt"},
+    [BC_JLEI] = {"jlei", "rkt"},
+    [BC_JGTI] = {"jgti", "rkt"},
+    [BC_JGEI] = {"jgei", "rkt"},
+};
+
+static void *grow(void *p, int *cap, int n, size_t size)
+{
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 64;
+    return realloc(p, *cap * size);
+}
+
+extern void bc_init(bc_t *p)
+{
+    *p = (bc_t){};
+}
+
+extern void bc_deinit(bc_t *p)
+{
+    free(p->code);
+    free(p->funcs);
+    free(p->externs);
+}
+
+/* Number of words taken by an instruction, opcode included. */
+extern int bc_length(int op)
+{
+    return 1 + strlen(bc_ops[op].operands);
+}
+
+extern void bc_put(bc_t *p, int word)
+{
+    p->code = grow(p->code, &p->cap, p->len, sizeof(*p->code));
+    p->code[p->len++] = word;
+}
+
+extern int bc_func(bc_t *p, const char *name)
+{
+    p->funcs = grow(p->funcs, &p->cap_funcs, p->num_funcs, sizeof(*p->funcs));
+    p->funcs[p->num_funcs] = (bc_func_t){.name = name, .entry = -1};
+    return p->num_funcs++;
+}
+
+extern int bc_find_func(const bc_t *p, const char *name)
+{
+    for (int i = 0; i < p->num_funcs; ++i) {
+        if (!strcmp(p->funcs[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+extern int bc_extern(bc_t *p, const char *name)
+{
+    for (int i = 0; i < p->num_externs; ++i) {
+        if (!strcmp(p->externs[i], name))
+            return i;
+    }
+    p->externs = grow(p->externs, &p->cap_externs, p->num_externs,
+            sizeof(*p->externs));
+    p->externs[p->num_externs] = name;
+    return p->num_externs++;
+}
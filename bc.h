@@ -0,0 +1,99 @@
+#pragma once
+
+/*
+ * Register-based bytecode. Every function has a window of integer registers:
+ * its parameters come first, then locals and temporaries. An instruction is
+ * an opcode word followed by its operands, as described by bc_ops.
+ */
+
+typedef enum {
+    BC_MOVI,    // a = k
+    BC_MOV,     // a = b
+
+    BC_ADD,     // a = b + c
+    BC_SUB,     // a = b - c
+    BC_MUL,     // a = b * c
+    BC_DIV,     // a = b / c
+    BC_REM,     // a = b % c
+    BC_AND,     // a = b & c
+    BC_OR,      // a = b | c
+    BC_XOR,     // a = b ^ c
+    BC_SHL,     // a = b << c
+    BC_SHR,     // a = b >> c
+    BC_EQ,      // a = b == c
+    BC_NE,      // a = b != c
+    BC_LT,      // a = b < c
+    BC_LE,      // a = b <= c
+    BC_GT,      // a = b > c
+    BC_GE,      // a = b >= c
+    BC_LAND,    // a = b && c
+    BC_LOR,     // a = b || c
+
+    BC_NEG,     // a = -b
+    BC_NOT,     // a = ~b
+    BC_LNOT,    // a = !b
+
+    BC_JMP,     // goto t
+    BC_JZ,      // if !a goto t
+    BC_JNZ,     // if a goto t
+
+    BC_CALL,    // a = funcs[f](b, ..., b + n - 1)
+    BC_CALLX,   // a = externs[x](b, ..., b + n - 1)
+    BC_RET,     // return a
+
+    // superinstructions
+    BC_ADDI,    // a = b + k
+    BC_MULI,    // a = b * k
+    BC_JEQ,     // if a == b goto t
+    BC_JNE,     // if a != b goto t
+    BC_JLT,     // if a < b goto t
+    BC_JLE,     // if a <= b goto t
+    BC_JGT,     // if a > b goto t
+    BC_JGE,     // if a >= b goto t
+    BC_JEQI,    // if a == k goto t
+    BC_JNEI,    // if a != k goto t
+    BC_JLTI,    // if a < k goto t
+    BC_JLEI,    // if a <= k goto t
+    BC_JGTI,    // if a > k goto t
+    BC_JGEI,    // if a >= k goto t
+
+    NUM_BC_OPS,
+} bc_op_t;
+
+typedef struct {
+    const char *name;
+    const char *operands; // one letter per operand word: r, k, t, f, x or n
+} bc_info_t;
+
+typedef struct {
+    const char *name;
+    int num_params;
+    int num_regs;
+    int entry;
+} bc_func_t;
+
+typedef struct {
+    int *code;
+    int len;
+    int cap;
+
+    bc_func_t *funcs;
+    int num_funcs;
+    int cap_funcs;
+
+    const char **externs;
+    int num_externs;
+    int cap_externs;
+} bc_t;
+
+extern const bc_info_t bc_ops[NUM_BC_OPS];
+
+extern void bc_init(bc_t *p);
+extern void bc_deinit(bc_t *p);
+extern int bc_length(int op);
+extern void bc_put(bc_t *p, int word);
+extern int bc_func(bc_t *p, const char *name);
+extern int bc_extern(bc_t *p, const char *name);
+extern int bc_find_func(const bc_t *p, const char *name);
+
+extern int vm_run(const bc_t *p, int argc);
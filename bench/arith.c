@@ -0,0 +1,30 @@
+int collatz(int n) {
+    int steps = 0;
+    for (; n != 1; steps++) {
+        if (n % 2 == 0) {
+            n /= 2;
+        } else {
+            n = 3 * n + 1;
+        }
+    }
+    return steps;
+}
+
+int gcd(int a, int b) {
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int main(int argc, char **argv) {
+    int total = 0;
+    for (int i = 1; i < 99999 + argc; i++) {
+        total += collatz(i);
+        total += gcd(i, 360360);
+        total &= 16777215;
+    }
+    return total % 256;
+}
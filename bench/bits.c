@@ -0,0 +1,23 @@
+int popcount(int x) {
+    int n = 0;
+    for (; x != 0; n++) {
+        x &= x - 1;
+    }
+    return n;
+}
+
+int mix(int n) {
+    int x = 88172645;
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        x ^= (int)((unsigned)x << 13);
+        x ^= x >> 17 & 32767;
+        x ^= (int)((unsigned)x << 5);
+        total += popcount(x & ~i & 16777215);
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    return mix(4999999 + argc) % 256;
+}
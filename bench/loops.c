@@ -0,0 +1,16 @@
+int sum(int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++) {
+                total += (i * j + k) & 1023;
+            }
+            total &= 16777215;
+        }
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    return sum(399 + argc) % 256;
+}
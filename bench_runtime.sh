@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Compare the programs under bench/ built by the given compiler against their
+# C twins built by gcc -O0 and -O2: median wall time over several runs,
+# static instruction count of the program's own functions and size of the
+# linked binary. A CSV report goes to the given file for tracking over
+# releases. The kernels derive their input from argc, so that no compiler
+# can fold them away at compile time.
+
+tmpdir='./tmp.bench'
+runs=5
+
+if [ "$1" == "" ]; then
+    echo "USAGE: ./bench_runtime.sh /path/to/compiler [report.csv]"
+    exit 1
+fi
+
+cmp=$1
+report=${2:-bench_runtime.csv}
+
+# milliseconds since the epoch
+now () {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# median wall time in ms of running $1 $runs times
+wall_time () {
+    for i in `seq 1 $runs`; do
+        start=$(now)
+        $1 >/dev/null
+        echo $(( $(now) - start ))
+    done | sort -n | sed -n "$(( (runs + 1) / 2 ))p"
+}
+
+# instructions in the functions that $2 defines, disassembled from binary $1
+insn_count () {
+    funcs=$(sed -n 's/^func \([A-Za-z_0-9]*\).*{$/\1/p' $2 | tr '\n' ' ')
+    objdump -d --no-show-raw-insn $1 | awk -v funcs=" $funcs" '
+        /^[0-9a-f]+ <.*>:$/ {
+            name = substr($2, 2, length($2) - 3)
+            counting = index(funcs, " " name " ") > 0
+        }
+        counting && /^ +[0-9a-f]+:\t/ { n++ }
+        END { print n + 0 }'
+}
+
+mkdir -p $tmpdir
+echo "kernel,compiler,exit_code,wall_ms,insns,binary_bytes" > $report
+printf "%-10s %-8s %10s %10s %10s\n" kernel compiler wall_ms insns bytes
+for prog in `ls bench/*.kc`; do
+    kernel=$(basename ${prog%.kc})
+    base="${tmpdir}/${kernel}"
+    $cmp $prog ${base}.kc.out >/dev/null || exit 1
+    gcc -w -O0 -o ${base}.O0.out ${prog%.kc}.c || exit 1
+    gcc -w -O2 -o ${base}.O2.out ${prog%.kc}.c || exit 1
+    ${base}.O0.out >/dev/null
+    expected_exit_code=$?
+    for compiler in kc O0 O2; do
+        bin="${base}.${compiler}.out"
+        $bin >/dev/null
+        exit_code=$?
+        if [ "$exit_code" -ne "$expected_exit_code" ]; then
+            echo "$kernel: $compiler exited with $exit_code, expected $expected_exit_code"
+            exit 1
+        fi
+        ms=$(wall_time $bin)
+        insns=$(insn_count $bin $prog)
+        bytes=$(stat -c %s $bin)
+        echo "$kernel,$compiler,$exit_code,$ms,$insns,$bytes" >> $report
+        printf "%-10s %-8s %10d %10d %10d\n" $kernel $compiler $ms $insns $bytes
+    done
+done
+rm -r $tmpdir
@@ -0,0 +1,243 @@
+#include "elf.h"
+
+#include <stdint.h>
+#include <stdlib.h> // realloc
+#include <string.h> // strlen
+
+/*
+ * A relocatable ELF64 object holding .text and .data. Function definitions
+ * become global symbols and calls the assembler couldn't resolve become
+ * undefined symbols with PLT32 relocations for the linker to fill in.
+ * References to .data are PC32 relocations against its section symbol.
+ */
+
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_DATA,
+    SEC_RELA,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    SEC_NOTE,
+    NUM_SECS,
+};
+
+#define EHDR_SIZE 64
+#define SHDR_SIZE 64
+#define SYM_SIZE 24
+#define RELA_SIZE 24
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+
+#define SHF_WRITE 0x1
+#define SHF_ALLOC 0x2
+#define SHF_EXECINSTR 0x4
+#define SHF_INFO_LINK 0x40
+
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+#define STT_NOTYPE 0
+#define STT_FUNC 2
+#define STT_SECTION 3
+
+typedef struct {
+    unsigned char *data;
+    int len;
+    int cap;
+} buf_t;
+
+static void put(buf_t *b, const void *p, int n)
+{
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 256;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_le(buf_t *b, uint64_t v, int n)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < n; ++i)
+        bytes[i] = v >> (8 * i);
+    put(b, bytes, n);
+}
+
+static void align(buf_t *b, int n)
+{
+    while (b->len % n)
+        put_le(b, 0, 1);
+}
+
+static int add_string(buf_t *strtab, const char *s)
+{
+    int offset = strtab->len;
+    put(strtab, s, strlen(s) + 1);
+    return offset;
+}
+
+static void add_symbol(buf_t *symtab, int name, int bind, int type, int shndx,
+        uint64_t value, uint64_t size)
+{
+    put_le(symtab, name, 4);
+    put_le(symtab, bind << 4 | type, 1);
+    put_le(symtab, 0, 1); // st_other
+    put_le(symtab, shndx, 2);
+    put_le(symtab, value, 8);
+    put_le(symtab, size, 8);
+}
+
+static void add_section(buf_t *shdrs, int name, int type, uint64_t flags,
+        uint64_t offset, uint64_t size, int link, int info, int align,
+        int entsize)
+{
+    put_le(shdrs, name, 4);
+    put_le(shdrs, type, 4);
+    put_le(shdrs, flags, 8);
+    put_le(shdrs, 0, 8); // sh_addr
+    put_le(shdrs, offset, 8);
+    put_le(shdrs, size, 8);
+    put_le(shdrs, link, 4);
+    put_le(shdrs, info, 4);
+    put_le(shdrs, align, 8);
+    put_le(shdrs, entsize, 8);
+}
+
+/* Index of the symbol for the i-th fixup's callee if an earlier fixup
+ * already added it, -1 otherwise. */
+static int find_symbol(const x64_t *a, int i, const int *syms)
+{
+    for (int j = 0; j < i; ++j) {
+        if (a->fixups[j].section == X64_TEXT
+                && !strcmp(a->fixups[j].label.name, a->fixups[i].label.name))
+            return syms[j];
+    }
+    return -1;
+}
+
+extern void elf_write(FILE *fp, const x64_t *a)
+{
+    buf_t out = {};
+    buf_t symtab = {};
+    buf_t strtab = {};
+    buf_t shstrtab = {};
+    buf_t rela = {};
+    buf_t shdrs = {};
+    int names[NUM_SECS] = {};
+    int syms[a->num_fixups + 1];
+    int num_syms = 3 + a->num_funcs;
+    int num_locals = 3;
+
+    put_le(&strtab, 0, 1);
+    put_le(&shstrtab, 0, 1);
+    names[SEC_TEXT] = add_string(&shstrtab, ".text");
+    names[SEC_DATA] = add_string(&shstrtab, ".data");
+    names[SEC_RELA] = add_string(&shstrtab, ".rela.text");
+    names[SEC_SYMTAB] = add_string(&shstrtab, ".symtab");
+    names[SEC_STRTAB] = add_string(&shstrtab, ".strtab");
+    names[SEC_SHSTRTAB] = add_string(&shstrtab, ".shstrtab");
+    names[SEC_NOTE] = add_string(&shstrtab, ".note.GNU-stack");
+
+    // locals come first: the null symbol, the sections and local functions
+    add_symbol(&symtab, 0, STB_LOCAL, STT_NOTYPE, 0, 0, 0);
+    add_symbol(&symtab, 0, STB_LOCAL, STT_SECTION, SEC_TEXT, 0, 0);
+    add_symbol(&symtab, 0, STB_LOCAL, STT_SECTION, SEC_DATA, 0, 0);
+    for (int local = 1; local >= 0; --local) {
+        for (int i = 0; i < a->num_funcs; ++i) {
+            int end = i + 1 < a->num_funcs ? a->funcs[i + 1].offset : a->len;
+            if (a->funcs[i].local != local)
+                continue;
+            if (local)
+                num_locals++;
+            add_symbol(&symtab, add_string(&strtab, a->funcs[i].label.name),
+                    local ? STB_LOCAL : STB_GLOBAL, STT_FUNC, SEC_TEXT,
+                    a->funcs[i].offset, end - a->funcs[i].offset);
+        }
+    }
+    for (int i = 0; i < a->num_fixups; ++i) {
+        if (a->fixups[i].section == X64_DATA) {
+            put_le(&rela, a->fixups[i].offset, 8);
+            put_le(&rela, (uint64_t)2 << 32 | R_X86_64_PC32, 8);
+            put_le(&rela, a->fixups[i].addend, 8);
+            syms[i] = 2;
+            continue;
+        }
+        if ((syms[i] = find_symbol(a, i, syms)) < 0) {
+            add_symbol(&symtab, add_string(&strtab, a->fixups[i].label.name),
+                    STB_GLOBAL, STT_NOTYPE, 0, 0, 0);
+            syms[i] = num_syms++;
+        }
+        put_le(&rela, a->fixups[i].offset, 8);
+        put_le(&rela, (uint64_t)syms[i] << 32 | R_X86_64_PLT32, 8);
+        put_le(&rela, a->fixups[i].addend, 8);
+    }
+
+    // the file header is filled in once the layout is known
+    for (int i = 0; i < EHDR_SIZE; ++i)
+        put_le(&out, 0, 1);
+
+    add_section(&shdrs, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    align(&out, 16);
+    add_section(&shdrs, names[SEC_TEXT], SHT_PROGBITS,
+            SHF_ALLOC | SHF_EXECINSTR, out.len, a->len, 0, 0, 16, 0);
+    put(&out, a->code, a->len);
+    align(&out, 8);
+    add_section(&shdrs, names[SEC_DATA], SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+            out.len, a->data_len, 0, 0, 8, 0);
+    put(&out, a->data, a->data_len);
+    align(&out, 8);
+    add_section(&shdrs, names[SEC_RELA], SHT_RELA, SHF_INFO_LINK, out.len,
+            rela.len, SEC_SYMTAB, SEC_TEXT, 8, RELA_SIZE);
+    put(&out, rela.data, rela.len);
+    add_section(&shdrs, names[SEC_SYMTAB], SHT_SYMTAB, 0, out.len,
+            symtab.len, SEC_STRTAB, num_locals, 8, SYM_SIZE);
+    put(&out, symtab.data, symtab.len);
+    add_section(&shdrs, names[SEC_STRTAB], SHT_STRTAB, 0, out.len,
+            strtab.len, 0, 0, 1, 0);
+    put(&out, strtab.data, strtab.len);
+    add_section(&shdrs, names[SEC_SHSTRTAB], SHT_STRTAB, 0, out.len,
+            shstrtab.len, 0, 0, 1, 0);
+    put(&out, shstrtab.data, shstrtab.len);
+    add_section(&shdrs, names[SEC_NOTE], SHT_PROGBITS, 0, out.len, 0, 0, 0,
+            1, 0);
+    align(&out, 8);
+    int shoff = out.len;
+    put(&out, shdrs.data, shdrs.len);
+
+    buf_t ehdr = {};
+    put(&ehdr, "\x7f" "ELF", 4);
+    put_le(&ehdr, 2, 1); // ELFCLASS64
+    put_le(&ehdr, 1, 1); // ELFDATA2LSB
+    put_le(&ehdr, 1, 1); // EV_CURRENT
+    for (int i = 0; i < 9; ++i)
+        put_le(&ehdr, 0, 1);
+    put_le(&ehdr, 1, 2); // ET_REL
+    put_le(&ehdr, 62, 2); // EM_X86_64
+    put_le(&ehdr, 1, 4);
+    put_le(&ehdr, 0, 8); // e_entry
+    put_le(&ehdr, 0, 8); // e_phoff
+    put_le(&ehdr, shoff, 8);
+    put_le(&ehdr, 0, 4); // e_flags
+    put_le(&ehdr, EHDR_SIZE, 2);
+    put_le(&ehdr, 0, 2); // e_phentsize
+    put_le(&ehdr, 0, 2); // e_phnum
+    put_le(&ehdr, SHDR_SIZE, 2);
+    put_le(&ehdr, NUM_SECS, 2);
+    put_le(&ehdr, SEC_SHSTRTAB, 2);
+    memcpy(out.data, ehdr.data, EHDR_SIZE);
+
+    fwrite(out.data, 1, out.len, fp);
+
+    free(ehdr.data);
+    free(out.data);
+    free(symtab.data);
+    free(strtab.data);
+    free(shstrtab.data);
+    free(rela.data);
+    free(shdrs.data);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "x64.h"
+
+#define R_X86_64_PC32 2
+#define R_X86_64_PLT32 4
+
+extern void elf_write(FILE *fp, const x64_t *a);
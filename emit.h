@@ -1,11 +1,19 @@
 #pragma once
 
 #include "ast.h"
+#include "profile.h"
 
 typedef struct {
     void *fp;
+    const char *profile_generate; // where instrumented programs write counts
+    const profile_t *profile;     // its sites, with counts for --profile-use
 } crawler_t;
 
+extern void emit_bc(crawler_t *c, const file_t *f);
+extern int emit_bc_run(const file_t *f, int argc);
 extern void emit_c(crawler_t *c, const file_t *f);
 extern void emit_tabs(crawler_t *c, int n);
+extern void emit_llvm(crawler_t *c, const file_t *f);
 extern void emit_x64(crawler_t *c, const file_t *f);
+extern void emit_x64_obj(crawler_t *c, const file_t *f);
+extern int emit_x64_run(crawler_t *c, const file_t *f, int argc, char **argv);
@@ -0,0 +1,669 @@
+#include "bc.h"
+#include "emit.h"
+#include "log.h"
+#include "token.h"
+#include "trace.h"
+
+#include <assert.h>
+
+#define countof(a) ((int)(sizeof(a) / sizeof(*(a))))
+
+/*
+ * Compiles the AST into register bytecode. Locals get a register each for
+ * the extent of their block and temporaries are allocated above them like a
+ * stack, so call arguments land in consecutive registers and the callee's
+ * window can start at the first one.
+ *
+ * Forward jumps are chained through their unpatched target words until the
+ * target is known.
+ */
+
+typedef struct _binding {
+    const char *name;
+    int reg;
+    struct _binding *next;
+} binding_t;
+
+typedef struct {
+    int post; // chain of continue jumps
+    int end;  // chain of break jumps and the exit
+} loop_t;
+
+typedef struct {
+    bc_t *p;
+    binding_t *bindings;
+    loop_t *loop;
+    int top;
+    int max;
+} compiler_t;
+
+static void bind(compiler_t *c, const char *name, int reg)
+{
+    binding_t b = {.name = name, .reg = reg, .next = c->bindings};
+    c->bindings = copy(&b);
+}
+
+static void unbind(compiler_t *c, binding_t *mark)
+{
+    while (c->bindings != mark) {
+        binding_t *b = c->bindings;
+        c->bindings = b->next;
+        free(b);
+    }
+}
+
+static int lookup(compiler_t *c, const char *ident)
+{
+    for (binding_t *b = c->bindings; b; b = b->next) {
+        if (!strcmp(b->name, ident))
+            return b->reg;
+    }
+    PANIC("undeclared identifier: `%s`", ident);
+    return 0;
+}
+
+static int alloc(compiler_t *c)
+{
+    int reg = c->top++;
+    if (c->max < c->top)
+        c->max = c->top;
+    return reg;
+}
+
+/* The register to put a result in: dst, or a new temporary if dst < 0. */
+static int target(compiler_t *c, int dst)
+{
+    return dst < 0 ? alloc(c) : dst;
+}
+
+/* Emit an instruction with up to three operands; calls append their count
+ * themselves. */
+static void ins(compiler_t *c, bc_op_t op, int a, int b, int k)
+{
+    int n = bc_length(op) - 1;
+    int args[] = {a, b, k};
+    bc_put(c->p, op);
+    for (int i = 0; i < n && i < countof(args); ++i)
+        bc_put(c->p, args[i]);
+}
+
+/* Emit a jump whose target is added to chain, returning the new chain. */
+static int jump(compiler_t *c, bc_op_t op, int a, int b, int chain)
+{
+    int n = bc_length(op) - 1;
+    int args[] = {a, b};
+    bc_put(c->p, op);
+    for (int i = 0; i < n - 1; ++i)
+        bc_put(c->p, args[i]);
+    bc_put(c->p, chain);
+    return c->p->len - 1;
+}
+
+static void patch(compiler_t *c, int chain, int target)
+{
+    while (chain >= 0) {
+        int next = c->p->code[chain];
+        c->p->code[chain] = target;
+        chain = next;
+    }
+}
+
+static char *ident_string(node_t *n)
+{
+    return n->expr.ident.name;
+}
+
+static int is_simple(const node_t *n)
+{
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    return n->t == EXPR_BASIC || n->t == EXPR_IDENT;
+}
+
+static const bc_op_t binary_ops[] = {
+    [token_ADD] = BC_ADD,
+    [token_SUB] = BC_SUB,
+    [token_MUL] = BC_MUL,
+    [token_QUO] = BC_DIV,
+    [token_REM] = BC_REM,
+    [token_AND] = BC_AND,
+    [token_AND_NOT] = BC_AND, // of the complement
+    [token_OR] = BC_OR,
+    [token_XOR] = BC_XOR,
+    [token_SHL] = BC_SHL,
+    [token_SHR] = BC_SHR,
+    [token_EQL] = BC_EQ,
+    [token_NEQ] = BC_NE,
+    [token_LSS] = BC_LT,
+    [token_LEQ] = BC_LE,
+    [token_GTR] = BC_GT,
+    [token_GEQ] = BC_GE,
+    [token_LAND] = BC_LAND,
+    [token_LOR] = BC_LOR,
+};
+
+/* Jumps taken when a comparison is false, register and immediate forms. */
+static const bc_op_t false_jumps[][2] = {
+    [token_EQL] = {BC_JNE, BC_JNEI},
+    [token_NEQ] = {BC_JEQ, BC_JEQI},
+    [token_LSS] = {BC_JGE, BC_JGEI},
+    [token_LEQ] = {BC_JGT, BC_JGTI},
+    [token_GTR] = {BC_JLE, BC_JLEI},
+    [token_GEQ] = {BC_JLT, BC_JLTI},
+};
+
+static int is_comparison(int tok)
+{
+    switch (tok) {
+    case token_EQL:
+    case token_NEQ:
+    case token_LSS:
+    case token_LEQ:
+    case token_GTR:
+    case token_GEQ:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* An expression being compiled, and how far along it is. The state says
+ * which operand the task is waiting for. */
+typedef struct {
+    const node_t *n;
+    enum {
+        EXPR_START,
+        EXPR_CONST_Y, // x, with the constant right operand k
+        EXPR_CONST_X, // y, with the constant left operand k
+        EXPR_X_FIRST, // x, then y
+        EXPR_Y_FIRST, // y, then x
+        EXPR_X, // x, with y done
+        EXPR_Y, // y, with x done
+        EXPR_ARGS, // the argument before arg, which went in x
+    } state;
+    int dst;
+    int top; // c->top when it started
+    int x, y, k;
+    int arg;
+    int not_const; // under a negation that wasn't a constant
+} task_t;
+
+static void push_task(compiler_t *c, ast_stack_t *s, const node_t *n, int dst)
+{
+    *(task_t *)ast_stack_push(s) = (task_t){.n = n, .dst = dst, .top = c->top};
+}
+
+/* Start binary node t: operands in the same order as emit_x64, a complex
+ * right operand first, and constants folded into immediate forms. */
+static void start_binary(compiler_t *c, ast_stack_t *s, task_t *t)
+{
+    const node_t *n = t->n;
+    int op = n->expr.binary.op;
+
+    if (op >= countof(binary_ops) || !binary_ops[op])
+        PANIC("unknown binary op: `%s`", token_string(op));
+    if ((op == token_ADD || op == token_SUB || op == token_MUL)
+            && ast_const_value(n->expr.binary.y, &t->k)) {
+        t->state = EXPR_CONST_Y;
+        push_task(c, s, n->expr.binary.x, -1);
+    } else if ((op == token_ADD || op == token_MUL)
+            && ast_const_value(n->expr.binary.x, &t->k)) {
+        t->state = EXPR_CONST_X;
+        push_task(c, s, n->expr.binary.y, -1);
+    } else if (is_simple(n->expr.binary.y)) {
+        t->state = EXPR_X_FIRST;
+        push_task(c, s, n->expr.binary.x, -1);
+    } else {
+        t->state = EXPR_Y_FIRST;
+        push_task(c, s, n->expr.binary.y, -1);
+    }
+}
+
+/* Give binary node t the operand it was waiting for, in reg. Return the
+ * register of its result, or -1 if it needs the other operand first. */
+static int step_binary(compiler_t *c, ast_stack_t *s, task_t *t, int reg)
+{
+    int op = t->n->expr.binary.op;
+    int dst;
+
+    switch (t->state) {
+    case EXPR_CONST_Y:
+        c->top = t->top;
+        dst = target(c, t->dst);
+        if (op == token_MUL)
+            ins(c, BC_MULI, dst, reg, t->k);
+        else
+            ins(c, BC_ADDI, dst, reg, op == token_SUB ? -(unsigned)t->k : t->k);
+        return dst;
+    case EXPR_CONST_X:
+        c->top = t->top;
+        dst = target(c, t->dst);
+        ins(c, op == token_MUL ? BC_MULI : BC_ADDI, dst, reg, t->k);
+        return dst;
+    case EXPR_X_FIRST:
+        t->x = reg;
+        t->state = EXPR_Y;
+        push_task(c, s, t->n->expr.binary.y, -1);
+        return -1;
+    case EXPR_Y_FIRST:
+        t->y = reg;
+        t->state = EXPR_X;
+        push_task(c, s, t->n->expr.binary.x, -1);
+        return -1;
+    default:
+        if (t->state == EXPR_X)
+            t->x = reg;
+        else
+            t->y = reg;
+        if (op == token_AND_NOT) {
+            int k = alloc(c);
+            ins(c, BC_NOT, k, t->y, 0);
+            t->y = k;
+        }
+        c->top = t->top;
+        dst = target(c, t->dst);
+        ins(c, binary_ops[op], dst, t->x, t->y);
+        return dst;
+    }
+}
+
+static void unary(compiler_t *c, int op, int dst, int x)
+{
+    switch (op) {
+    case token_SUB:
+        ins(c, BC_NEG, dst, x, 0);
+        break;
+    case token_BITWISE_NOT:
+        ins(c, BC_NOT, dst, x, 0);
+        break;
+    case token_NOT:
+        ins(c, BC_LNOT, dst, x, 0);
+        break;
+    default:
+        PANIC("unknown unary op: `%s`", token_string(op));
+        break;
+    }
+}
+
+static void call(compiler_t *c, const node_t *n, int dst, int base, int num_args)
+{
+    const char *name = ident_string(n->expr.call.func);
+    int f;
+
+    if ((f = bc_find_func(c->p, name)) >= 0) {
+        ins(c, BC_CALL, dst, f, base);
+    } else {
+        ins(c, BC_CALLX, dst, bc_extern(c->p, name), base);
+    }
+    bc_put(c->p, num_args);
+}
+
+/* Evaluate n into dst, or anywhere if dst < 0, and return the register.
+ * Operands and arguments are evaluated from a stack of tasks rather than
+ * by recursing, so nesting costs heap instead of C stack. */
+static int expr(compiler_t *c, const node_t *n, int dst)
+{
+    ast_stack_t s;
+    task_t *t;
+    int reg = -1; // the result of the last task done
+
+    ast_stack_init(&s, sizeof(task_t));
+    push_task(c, &s, n, dst);
+    while ((t = ast_stack_top(&s))) {
+        n = t->n;
+        switch (n->t) {
+        case EXPR_BASIC:
+            ast_const_value(n, &t->k);
+            reg = target(c, t->dst);
+            ins(c, BC_MOVI, reg, t->k, 0);
+            break;
+        case EXPR_BINARY:
+            if (t->state == EXPR_START) {
+                start_binary(c, &s, t);
+                continue;
+            }
+            if ((reg = step_binary(c, &s, t, reg)) < 0)
+                continue;
+            break;
+        case EXPR_CALL:
+            if (t->state == EXPR_START)
+                t->state = EXPR_ARGS;
+            else
+                c->top = t->x + 1;
+            if (n->expr.call.args && n->expr.call.args[t->arg]) {
+                // arguments go in consecutive registers from t->top
+                t->x = alloc(c);
+                push_task(c, &s, n->expr.call.args[t->arg++], t->x);
+                continue;
+            }
+            c->top = t->top;
+            reg = target(c, t->dst);
+            call(c, n, reg, t->top, t->arg);
+            break;
+        case EXPR_IDENT:
+            reg = lookup(c, n->expr.ident.name);
+            if (t->dst >= 0 && t->dst != reg)
+                ins(c, BC_MOV, t->dst, reg, 0);
+            if (t->dst >= 0)
+                reg = t->dst;
+            break;
+        case EXPR_PAREN:
+            t->n = n->expr.paren.x;
+            continue;
+        case EXPR_UNARY:
+            if (t->state == EXPR_START && !t->not_const && ast_const_value(n, &t->k)) {
+                reg = target(c, t->dst);
+                ins(c, BC_MOVI, reg, t->k, 0);
+            } else if (t->state == EXPR_START) {
+                t->state = EXPR_X;
+                push_task(c, &s, n->expr.unary.expr, -1);
+                // the rest of a chain of negations can't be either, and
+                // checking each again would be quadratic
+                ((task_t *)ast_stack_top(&s))->not_const = n->expr.unary.op == token_SUB;
+                continue;
+            } else {
+                c->top = t->top;
+                dst = target(c, t->dst);
+                unary(c, n->expr.unary.op, dst, reg);
+                reg = dst;
+            }
+            break;
+        default:
+            PANIC("illegal expression");
+            break;
+        }
+        ast_stack_pop(&s);
+    }
+    ast_stack_deinit(&s);
+    return reg;
+}
+
+/* Evaluate both operands of a binary node in the same order as emit_x64:
+ * a complex right operand goes first. */
+static void operands(compiler_t *c, const node_t *n, int *x, int *y)
+{
+    if (is_simple(n->expr.binary.y)) {
+        *x = expr(c, n->expr.binary.x, -1);
+        *y = expr(c, n->expr.binary.y, -1);
+    } else {
+        *y = expr(c, n->expr.binary.y, -1);
+        *x = expr(c, n->expr.binary.x, -1);
+    }
+}
+
+/* Jump to chain when n is false and return the new chain. */
+static int cond_jump(compiler_t *c, const node_t *n, int chain)
+{
+    int top = c->top;
+    int x, y, k;
+
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    if (n->t == EXPR_BINARY && is_comparison(n->expr.binary.op)) {
+        if (ast_const_value(n->expr.binary.y, &k)) {
+            x = expr(c, n->expr.binary.x, -1);
+            chain = jump(c, false_jumps[n->expr.binary.op][1], x, k, chain);
+        } else {
+            operands(c, n, &x, &y);
+            chain = jump(c, false_jumps[n->expr.binary.op][0], x, y, chain);
+        }
+    } else if (n->t == EXPR_UNARY && n->expr.unary.op == token_NOT) {
+        x = expr(c, n->expr.unary.expr, -1);
+        chain = jump(c, BC_JNZ, x, 0, chain);
+    } else {
+        x = expr(c, n, -1);
+        chain = jump(c, BC_JZ, x, 0, chain);
+    }
+    c->top = top;
+    return chain;
+}
+
+static void stmt(compiler_t *c, const node_t *n)
+{
+    int top = c->top;
+    binding_t *mark = c->bindings;
+    int reg, chain;
+
+    switch (n->t) {
+    case STMT_ASSIGN:
+        do {
+            node_t tmp;
+            expr(c, ast_assign_value(n, &tmp), lookup(c, ident_string(n->stmt.assign.lhs)));
+        } while (0);
+        break;
+
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            stmt(c, *stmts);
+        unbind(c, mark);
+        c->top = top;
+        break;
+
+    case STMT_BRANCH:
+        assert(c->loop);
+        if (n->stmt.branch.tok == token_BREAK)
+            c->loop->end = jump(c, BC_JMP, 0, 0, c->loop->end);
+        else if (n->stmt.branch.tok == token_CONTINUE)
+            c->loop->post = jump(c, BC_JMP, 0, 0, c->loop->post);
+        break;
+
+    case STMT_DECL:
+        n = n->stmt.decl.decl;
+        if (n->t != DECL_VAR)
+            PANIC("only var decls are supported in functions");
+        reg = alloc(c);
+        if (n->decl.var.value)
+            expr(c, n->decl.var.value, reg);
+        c->top = reg + 1;
+        bind(c, ident_string(n->decl.var.name), reg);
+        break;
+
+    case STMT_EMPTY:
+        break;
+
+    case STMT_EXPR:
+        expr(c, n->stmt.expr.x, -1);
+        c->top = top;
+        break;
+
+    case STMT_FOR:
+        do {
+            loop_t loop = {.post = -1, .end = -1};
+            loop_t *outer = c->loop;
+            int start;
+            if (n->stmt.for_.init)
+                stmt(c, n->stmt.for_.init);
+            start = c->p->len;
+            if (n->stmt.for_.cond)
+                loop.end = cond_jump(c, n->stmt.for_.cond, loop.end);
+            c->loop = &loop;
+            stmt(c, n->stmt.for_.body);
+            c->loop = outer;
+            patch(c, loop.post, c->p->len);
+            if (n->stmt.for_.post)
+                stmt(c, n->stmt.for_.post);
+            jump(c, BC_JMP, 0, 0, -1);
+            patch(c, c->p->len - 1, start);
+            patch(c, loop.end, c->p->len);
+            unbind(c, mark);
+            c->top = top;
+        } while (0);
+        break;
+
+    case STMT_IF:
+        chain = cond_jump(c, n->stmt.if_.cond, -1);
+        stmt(c, n->stmt.if_.body);
+        if (n->stmt.if_.else_) {
+            int end = jump(c, BC_JMP, 0, 0, -1);
+            patch(c, chain, c->p->len);
+            stmt(c, n->stmt.if_.else_);
+            chain = end;
+        }
+        patch(c, chain, c->p->len);
+        break;
+
+    case STMT_SWITCH:
+        do {
+            node_t **clauses = n->stmt.switch_.clauses;
+            loop_t sw = {.post = c->loop ? c->loop->post : -1, .end = -1};
+            loop_t *outer = c->loop;
+            int num = 0, def = -1;
+            int *entries;
+            while (clauses[num])
+                num++;
+            entries = malloc(num * sizeof(*entries));
+            // compare the tag with every value, then take the default
+            reg = expr(c, n->stmt.switch_.tag, -1);
+            for (int i = 0; i < num; ++i) {
+                node_t **exprs = clauses[i]->stmt.case_.exprs;
+                entries[i] = -1;
+                if (!exprs)
+                    def = i;
+                for (; exprs && *exprs; ++exprs)
+                    entries[i] = jump(c, BC_JEQI, reg, (*exprs)->expr.basic.value, entries[i]);
+            }
+            if (def >= 0)
+                entries[def] = jump(c, BC_JMP, 0, 0, entries[def]);
+            else
+                sw.end = jump(c, BC_JMP, 0, 0, sw.end);
+            c->top = top;
+            // bodies in order, so fallthrough is just not jumping out
+            c->loop = &sw;
+            for (int i = 0; i < num; ++i) {
+                patch(c, entries[i], c->p->len);
+                for (node_t **stmts = clauses[i]->stmt.case_.stmts; *stmts; ++stmts)
+                    stmt(c, *stmts);
+                unbind(c, mark);
+                c->top = top;
+                if (i < num - 1 && !ast_falls_through(clauses[i]))
+                    sw.end = jump(c, BC_JMP, 0, 0, sw.end);
+            }
+            c->loop = outer;
+            if (outer)
+                outer->post = sw.post;
+            patch(c, sw.end, c->p->len);
+            free(entries);
+        } while (0);
+        break;
+
+    case STMT_RETURN:
+        if (n->stmt.return_.expr) {
+            reg = expr(c, n->stmt.return_.expr, -1);
+        } else {
+            reg = alloc(c);
+            ins(c, BC_MOVI, reg, 0, 0);
+        }
+        ins(c, BC_RET, reg, 0, 0);
+        c->top = top;
+        break;
+
+    default:
+        PANIC("illegal statement");
+        break;
+    }
+}
+
+static void func(compiler_t *c, const node_t *n)
+{
+    bc_func_t *f = &c->p->funcs[bc_find_func(c->p, ident_string(n->decl.func.name))];
+    node_t **params = n->decl.func.params;
+    int reg;
+
+    f->entry = c->p->len;
+    c->top = c->max = 0;
+    for (int i = 0; params && params[i]; ++i)
+        bind(c, ident_string(params[i]->expr.field.name), alloc(c));
+    f->num_params = c->top;
+    stmt(c, n->decl.func.body);
+    // falling off the end returns 0
+    reg = alloc(c);
+    ins(c, BC_MOVI, reg, 0, 0);
+    ins(c, BC_RET, reg, 0, 0);
+    f->num_regs = c->max;
+    unbind(c, NULL);
+}
+
+static void compile(bc_t *p, const file_t *f)
+{
+    compiler_t c = {.p = p};
+    const node_t *n = ast_find_struct_use(f);
+
+    if (n)
+        ast_error(f, n, "structs aren't supported by the bytecode backend");
+    bc_init(p);
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_TYPE)
+            continue;
+        if ((*decls)->t != DECL_FUNC)
+            PANIC("only func and type decls are supported at the top level");
+        if ((*decls)->decl.func.body)
+            bc_func(p, ident_string((*decls)->decl.func.name));
+    }
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body) {
+            TRACE_BEGIN(TRACE_EMIT, ident_string((*decls)->decl.func.name));
+            func(&c, *decls);
+            TRACE_END();
+        }
+    }
+}
+
+static void print(crawler_t *c, const bc_t *p, int pc)
+{
+    int op = p->code[pc];
+    const char *operands = bc_ops[op].operands;
+
+    fprintf(c->fp, "\t%d:\t%s", pc, bc_ops[op].name);
+    for (int i = 0; operands[i]; ++i) {
+        int v = p->code[pc + 1 + i];
+        fprintf(c->fp, i ? ", " : " ");
+        switch (operands[i]) {
+        case 'r':
+            fprintf(c->fp, "r%d", v);
+            break;
+        case 'f':
+            fprintf(c->fp, "%s", p->funcs[v].name);
+            break;
+        case 'x':
+            fprintf(c->fp, "%s", p->externs[v]);
+            break;
+        default:
+            fprintf(c->fp, "%d", v);
+            break;
+        }
+    }
+    fprintf(c->fp, "\n");
+}
+
+/* Print a listing of the bytecode for f. */
+extern void emit_bc(crawler_t *c, const file_t *f)
+{
+    bc_t p;
+
+    compile(&p, f);
+    for (int i = 0; i < p.num_externs; ++i)
+        fprintf(c->fp, "extern %s\n", p.externs[i]);
+    for (int i = 0; i < p.num_funcs; ++i) {
+        const bc_func_t *fn = &p.funcs[i];
+        int end = i + 1 < p.num_funcs ? p.funcs[i + 1].entry : p.len;
+        fprintf(c->fp, "func %s params %d regs %d\n", fn->name,
+                fn->num_params, fn->num_regs);
+        for (int pc = fn->entry; pc < end; pc += bc_length(p.code[pc]))
+            print(c, &p, pc);
+    }
+    bc_deinit(&p);
+}
+
+/* Compile f to bytecode and interpret its main with argc. */
+extern int emit_bc_run(const file_t *f, int argc)
+{
+    bc_t p;
+    int ret;
+
+    compile(&p, f);
+    TRACE_BEGIN(TRACE_RUN, "main");
+    ret = vm_run(&p, argc);
+    TRACE_END();
+    bc_deinit(&p);
+    return ret;
+}
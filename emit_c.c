@@ -1,20 +1,336 @@
 #include "emit.h"
 #include "token.h"
 #include "log.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <ctype.h> // isspace
+#include <inttypes.h> // PRId64
 #include <stdio.h>
 
+/*
+ * C99 for an optimizing C compiler to finish. Every function is declared
+ * before any is defined, only exported functions have external linkage and
+ * #line directives point the C compiler, and so debuggers and profilers, at
+ * the .kc source.
+ */
+
+static const file_t *file;
+static int indent;
+static int out_line; // the source line the C compiler is on, or 0
+static int src_offset; // line_of's cursor into the source
+static int src_line;
+
+static void emit(crawler_t *c, const node_t *n);
+
 extern void emit_tabs(crawler_t *c, int n)
 {
     for (int i = 0; i < n; ++i)
         fputc('\t', c->fp);
 }
 
-static void emit(crawler_t *c, const node_t *n)
+static void newline(crawler_t *c)
+{
+    fputc('\n', c->fp);
+    if (out_line)
+        ++out_line;
+}
+
+/* The line of the first token of n. Nodes record where the scanner was
+ * after the token before theirs, so skip the whitespace in between. */
+static int line_of(const node_t *n)
+{
+    int pos = n->pos > 0 ? n->pos - 1 : 0;
+
+    while (pos < file->src_len && isspace((unsigned char)file->src[pos]))
+        ++pos;
+    if (pos < src_offset) {
+        src_offset = 0;
+        src_line = 1;
+    }
+    for (; src_offset < pos; ++src_offset) {
+        if (file->src[src_offset] == '\n')
+            ++src_line;
+    }
+    return src_line;
+}
+
+/* Start an output line for n, telling the C compiler where n came from
+ * unless it already knows. */
+static void begin_line(crawler_t *c, const node_t *n)
+{
+    int line = line_of(n);
+
+    if (line != out_line) {
+        fprintf(c->fp, "#line %d \"", line);
+        for (const char *s = file->filename; *s; ++s) {
+            if (*s == '"' || *s == '\\')
+                fputc('\\', c->fp);
+            fputc(*s, c->fp);
+        }
+        fputc('"', c->fp);
+        newline(c);
+        out_line = line;
+    }
+    emit_tabs(c, indent);
+}
+
+static int c_precedence(int op)
+{
+    switch (op) {
+    case token_MUL:
+    case token_QUO:
+    case token_REM:
+        return 10;
+    case token_ADD:
+    case token_SUB:
+        return 9;
+    case token_SHL:
+    case token_SHR:
+        return 8;
+    case token_LSS:
+    case token_LEQ:
+    case token_GTR:
+    case token_GEQ:
+        return 7;
+    case token_EQL:
+    case token_NEQ:
+        return 6;
+    case token_AND:
+    case token_AND_NOT:
+        return 5;
+    case token_XOR:
+        return 4;
+    case token_OR:
+        return 3;
+    case token_LAND:
+        return 2;
+    case token_LOR:
+        return 1;
+    default:
+        PANIC("unknown binary op: `%s`", token_string(op));
+        return 0;
+    }
+}
+
+/* Whether an operand using op needs parentheses under parent, either to
+ * keep the tree's shape in C's precedence or because -Wparentheses asks for
+ * them: comparisons chained, arithmetic in shifts and bitwise operators,
+ * and && inside ||. */
+static int needs_parens(int parent, int op, int right)
+{
+    int p = c_precedence(parent);
+    int q = c_precedence(op);
+
+    if (q < p || (q == p && right))
+        return 1;
+    if (q == p)
+        return p == 6 || p == 7;
+    return p == 8 || (p >= 3 && p <= 5) || (p == 6 && q == 7)
+        || (parent == token_LOR && op == token_LAND);
+}
+
+static const node_t *strip_parens(const node_t *n)
+{
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    return n;
+}
+
+/* Expressions are written from a stack of what's left of them, nodes and
+ * the text between them, so they can nest deeper than the C stack. */
+typedef struct {
+    const node_t *n;
+    const char *text;
+} piece_t;
+
+static void push_text(ast_stack_t *s, const char *text)
+{
+    ((piece_t *)ast_stack_push(s))->text = text;
+}
+
+static void push_wrapped(ast_stack_t *s, const node_t *n, int wrap)
 {
-    static int indent = 0;
+    if (wrap)
+        push_text(s, ")");
+    ((piece_t *)ast_stack_push(s))->n = n;
+    if (wrap)
+        push_text(s, "(");
+}
+
+/* Binary operands are wrapped as needs_parens says, and ! operands of
+ * comparisons and bitwise operators as -Wlogical-not-parentheses asks. */
+static void push_operand(ast_stack_t *s, const node_t *n, int parent, int right)
+{
+    int p = c_precedence(parent);
+
+    n = strip_parens(n);
+    if (n->t == EXPR_BINARY)
+        push_wrapped(s, n, needs_parens(parent, n->expr.binary.op, right));
+    else
+        push_wrapped(s, n, n->t == EXPR_UNARY && n->expr.unary.op == token_NOT
+                && p >= 3 && p <= 7);
+}
+
+/* Operands of unary operators are wrapped if they have operators of their
+ * own, so - -x doesn't come out as --x. */
+static void push_unary_operand(ast_stack_t *s, const node_t *n)
+{
+    n = strip_parens(n);
+    push_wrapped(s, n, n->t == EXPR_BINARY || n->t == EXPR_UNARY);
+}
+
+static int count_args(const node_t *call)
+{
+    int n = 0;
+
+    while (call->expr.call.args && call->expr.call.args[n])
+        n++;
+    return n;
+}
+
+/* Write the pieces on s until it's empty. Other than expressions, nodes
+ * are left to emit. */
+static void emit_pieces(crawler_t *c, ast_stack_t *s)
+{
+    piece_t *piece;
+    const node_t *n;
+
+    while ((piece = ast_stack_pop(s))) {
+        if (piece->text) {
+            fprintf(c->fp, "%s", piece->text);
+            continue;
+        }
+        n = piece->n;
+        switch (n->t) {
+        case EXPR_BASIC:
+            fprintf(c->fp, "%" PRId64, n->expr.basic.value);
+            break;
+        case EXPR_BINARY:
+            if (n->expr.binary.op == token_AND_NOT) {
+                push_unary_operand(s, n->expr.binary.y);
+                push_text(s, " & ~");
+            } else {
+                push_operand(s, n->expr.binary.y, n->expr.binary.op, 1);
+                push_text(s, " ");
+                push_text(s, token_string(n->expr.binary.op));
+                push_text(s, " ");
+            }
+            push_operand(s, n->expr.binary.x, n->expr.binary.op, 0);
+            break;
+        case EXPR_CALL:
+            push_text(s, ")");
+            for (int i = count_args(n) - 1; i >= 0; --i) {
+                push_wrapped(s, strip_parens(n->expr.call.args[i]), 0);
+                if (i)
+                    push_text(s, ", ");
+            }
+            push_text(s, "(");
+            push_wrapped(s, n->expr.call.func, 0);
+            break;
+        case EXPR_IDENT:
+            fprintf(c->fp, "%s", n->expr.ident.name);
+            break;
+        case EXPR_PAREN:
+            push_wrapped(s, strip_parens(n), 0);
+            break;
+        case EXPR_SELECTOR:
+            push_wrapped(s, n->expr.selector.sel, 0);
+            push_text(s, ".");
+            push_wrapped(s, n->expr.selector.x, 0);
+            break;
+        case EXPR_UNARY:
+            push_unary_operand(s, n->expr.unary.expr);
+            push_text(s, token_string(n->expr.unary.op));
+            break;
+        default:
+            emit(c, n);
+            break;
+        }
+    }
+}
 
+static void emit_expr(crawler_t *c, const node_t *n)
+{
+    ast_stack_t s;
+
+    ast_stack_init(&s, sizeof(piece_t));
+    push_wrapped(&s, n, 0);
+    emit_pieces(c, &s);
+    ast_stack_deinit(&s);
+}
+
+static void emit_unary_operand(crawler_t *c, const node_t *n)
+{
+    ast_stack_t s;
+
+    ast_stack_init(&s, sizeof(piece_t));
+    push_unary_operand(&s, n);
+    emit_pieces(c, &s);
+    ast_stack_deinit(&s);
+}
+
+static const node_t *find_func(const node_t *n)
+{
+    return ast_find_func(file, n->decl.func.name->expr.ident.name);
+}
+
+static void emit_signature(crawler_t *c, const node_t *n)
+{
+    node_t **params = n->decl.func.params;
+
+    if (find_func(n)->decl.func.body
+            && !ast_is_exported(n->decl.func.name->expr.ident.name))
+        fprintf(c->fp, "static ");
+    emit(c, n->decl.func.type);
+    fputc(' ', c->fp);
+    emit(c, n->decl.func.name);
+    fputc('(', c->fp);
+    if (!params || !*params)
+        fprintf(c->fp, "void");
+    while (params && *params) {
+        emit(c, *params);
+        if (*++params)
+            fprintf(c->fp, ", ");
+    }
+    fputc(')', c->fp);
+}
+
+/* Whether n is a statement C terminates with a semicolon. */
+static int needs_semicolon(const node_t *n)
+{
+    switch (n->t) {
+    case STMT_BLOCK:
+    case STMT_CASE:
+    case STMT_FOR:
+    case STMT_IF:
+    case STMT_EMPTY:
+    case STMT_SWITCH:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/* The statements of a block, a line each, indented one more than it. */
+static void emit_stmts(crawler_t *c, node_t **stmts)
+{
+    ++indent;
+    for (; stmts && *stmts; ++stmts) {
+        // STMT_SWITCH marks it outside the clause's braces, where C wants it
+        if ((*stmts)->t == STMT_BRANCH && (*stmts)->stmt.branch.tok == token_FALLTHROUGH)
+            continue;
+        begin_line(c, *stmts);
+        emit(c, *stmts);
+        if (needs_semicolon(*stmts))
+            fputc(';', c->fp);
+        newline(c);
+    }
+    --indent;
+}
+
+static void emit(crawler_t *c, const node_t *n)
+{
     assert(n);
 
     switch (n->t) {
@@ -24,142 +340,140 @@ static void emit(crawler_t *c, const node_t *n)
         break;
 
     case DECL_FUNC:
-        emit(c, n->decl.func.type);
-        fprintf(c->fp, " ");
-        emit(c, n->decl.func.name);
-        fprintf(c->fp, "(");
-        for (node_t **params = n->decl.func.params; params && *params; ) {
-            emit(c, *params);
-            if (*++params)
-                fprintf(c->fp, ",");
-        }
-        fprintf(c->fp, ") ");
-        if (n->decl.func.body)
+        emit_signature(c, n);
+        if (n->decl.func.body) {
+            fputc(' ', c->fp);
             emit(c, n->decl.func.body);
+        } else {
+            fputc(';', c->fp);
+        }
         break;
 
     case DECL_TYPE:
         fprintf(c->fp, "typedef ");
         emit(c, n->decl.type.type);
-        fprintf(c->fp, " ");
+        fputc(' ', c->fp);
         emit(c, n->decl.type.name);
+        fputc(';', c->fp);
         break;
 
     case DECL_VAR:
         emit(c, n->decl.var.type);
-        fprintf(c->fp, " ");
+        fputc(' ', c->fp);
         emit(c, n->decl.var.name);
         if (n->decl.var.value) {
             fprintf(c->fp, " = ");
-            emit(c, n->decl.var.value);
+            emit(c, strip_parens(n->decl.var.value));
         }
         break;
 
     case EXPR_BASIC:
-        fprintf(c->fp, "%s", n->expr.basic.value);
-        break;
-
     case EXPR_BINARY:
-        fprintf(c->fp, "(");
-        emit(c, n->expr.binary.x);
-        fprintf(c->fp, " %s ", token_string(n->expr.binary.op));
-        emit(c, n->expr.binary.y);
-        fprintf(c->fp, ")");
-        break;
-
     case EXPR_CALL:
-        emit(c, n->expr.call.func);
-        fprintf(c->fp, "(");
-        for (node_t **args = n->expr.call.args; args && *args; ) {
-            emit(c, *args);
-            if (*++args)
-                fprintf(c->fp, ", ");
-        }
-        fprintf(c->fp, ")");
+    case EXPR_IDENT:
+    case EXPR_PAREN:
+    case EXPR_SELECTOR:
+    case EXPR_UNARY:
+        emit_expr(c, n);
         break;
 
     case EXPR_FIELD:
         emit(c, n->expr.field.type);
-        fprintf(c->fp, " ");
+        fputc(' ', c->fp);
         emit(c, n->expr.field.name);
         break;
 
-    case EXPR_IDENT:
-        fprintf(c->fp, "%s", n->expr.ident.name);
-        break;
-
-    case EXPR_PAREN:
-        fprintf(c->fp, "(");
-        emit(c, n->expr.paren.x);
-        fprintf(c->fp, ")");
-        break;
-
     case EXPR_STRUCT:
-        fprintf(c->fp, "struct {\n");
-        node_t **fields = n->expr.struct_.fields;
-        while (*fields) {
-            emit(c, *fields++);
-            fprintf(c->fp, ";\n");
+        fprintf(c->fp, "struct {");
+        newline(c);
+        ++indent;
+        for (node_t **fields = n->expr.struct_.fields; *fields; ++fields) {
+            emit_tabs(c, indent);
+            emit(c, *fields);
+            fputc(';', c->fp);
+            newline(c);
         }
-        fprintf(c->fp, "}");
-        break;
-
-    case EXPR_UNARY:
-        fprintf(c->fp, "%s", token_string(n->expr.unary.op));
-        emit(c, n->expr.unary.expr);
+        --indent;
+        emit_tabs(c, indent);
+        fputc('}', c->fp);
         break;
 
     case STMT_ASSIGN:
         emit(c, n->stmt.assign.lhs);
-        fprintf(c->fp, "%s", token_string(n->stmt.assign.tok));
-        emit(c, n->stmt.assign.rhs);
+        if (n->stmt.assign.tok == token_AND_NOT_ASSIGN) {
+            fprintf(c->fp, " &= ~");
+            emit_unary_operand(c, n->stmt.assign.rhs);
+            break;
+        }
+        fprintf(c->fp, " %s ", token_string(n->stmt.assign.tok));
+        emit(c, strip_parens(n->stmt.assign.rhs));
         break;
 
     case STMT_BLOCK:
-        fprintf(c->fp, "{\n");
-        ++indent;
-        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts) {
-            emit_tabs(c, indent);
-            emit(c, *stmts);
-            fprintf(c->fp, ";\n");
-        }
-        --indent;
+        fputc('{', c->fp);
+        newline(c);
+        emit_stmts(c, n->stmt.block.stmts);
         emit_tabs(c, indent);
-        fprintf(c->fp, "}");
+        fputc('}', c->fp);
         break;
 
     case STMT_BRANCH:
         fprintf(c->fp, "%s", token_string(n->stmt.branch.tok));
         break;
 
+    case STMT_CASE:
+        if (!n->stmt.case_.exprs)
+            fprintf(c->fp, "default: ");
+        for (node_t **exprs = n->stmt.case_.exprs; exprs && *exprs; ++exprs) {
+            fprintf(c->fp, "case ");
+            emit(c, *exprs);
+            fprintf(c->fp, ": ");
+        }
+        fputc('{', c->fp);
+        newline(c);
+        emit_stmts(c, n->stmt.case_.stmts);
+        if (!ast_falls_through(n)) {
+            emit_tabs(c, indent + 1);
+            fprintf(c->fp, "break;");
+            newline(c);
+        }
+        emit_tabs(c, indent);
+        fputc('}', c->fp);
+        break;
+
     case STMT_DECL:
         emit(c, n->stmt.decl.decl);
         break;
 
     case STMT_EMPTY:
+        fputc(';', c->fp);
         break;
 
     case STMT_EXPR:
-        emit(c, n->stmt.decl.decl);
+        emit(c, strip_parens(n->stmt.expr.x));
         break;
 
     case STMT_FOR:
         fprintf(c->fp, "for (");
         if (n->stmt.for_.init)
             emit(c, n->stmt.for_.init);
-        fprintf(c->fp, ";");
-        if (n->stmt.for_.cond)
-            emit(c, n->stmt.for_.cond);
-        fprintf(c->fp, ";");
-        if (n->stmt.for_.post)
+        fputc(';', c->fp);
+        if (n->stmt.for_.cond) {
+            fputc(' ', c->fp);
+            emit(c, strip_parens(n->stmt.for_.cond));
+        }
+        fputc(';', c->fp);
+        if (n->stmt.for_.post) {
+            fputc(' ', c->fp);
             emit(c, n->stmt.for_.post);
+        }
         fprintf(c->fp, ") ");
         emit(c, n->stmt.for_.body);
         break;
 
     case STMT_IF:
         fprintf(c->fp, "if (");
-        emit(c, n->stmt.if_.cond);
+        emit(c, strip_parens(n->stmt.if_.cond));
         fprintf(c->fp, ") ");
         emit(c, n->stmt.if_.body);
         if (n->stmt.if_.else_) {
@@ -168,11 +482,28 @@ static void emit(crawler_t *c, const node_t *n)
         }
         break;
 
+    case STMT_SWITCH:
+        fprintf(c->fp, "switch (");
+        emit(c, strip_parens(n->stmt.switch_.tag));
+        fprintf(c->fp, ") {");
+        newline(c);
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+            begin_line(c, *clauses);
+            // right before the label, past any #line, for -Wimplicit-fallthrough
+            if (clauses != n->stmt.switch_.clauses && ast_falls_through(clauses[-1]))
+                fprintf(c->fp, "/* fallthrough */ ");
+            emit(c, *clauses);
+            newline(c);
+        }
+        emit_tabs(c, indent);
+        fputc('}', c->fp);
+        break;
+
     case STMT_RETURN:
         fprintf(c->fp, "return");
         if (n->stmt.return_.expr) {
-            fprintf(c->fp, " ");
-            emit(c, n->stmt.return_.expr);
+            fputc(' ', c->fp);
+            emit(c, strip_parens(n->stmt.return_.expr));
         }
         break;
 
@@ -180,10 +511,44 @@ static void emit(crawler_t *c, const node_t *n)
     }
 }
 
+static void emit_decl(crawler_t *c, const node_t *n)
+{
+    begin_line(c, n);
+    emit(c, n);
+    if (n->t == DECL_VAR)
+        fputc(';', c->fp);
+    newline(c);
+}
+
+/* Types come first, then one prototype for every function, then variables
+ * and function bodies in source order. */
 extern void emit_c(crawler_t *c, const file_t *f)
 {
+    file = f;
+    indent = 0;
+    out_line = 0;
+    src_offset = 0;
+    src_line = 1;
+
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_TYPE)
+            emit_decl(c, *decls);
+    }
     for (node_t **decls = f->decls; decls && *decls; ++decls) {
-        emit(c, *decls);
-        fprintf(c->fp, ";\n");
+        if ((*decls)->t == DECL_FUNC && find_func(*decls) == *decls) {
+            begin_line(c, *decls);
+            emit_signature(c, *decls);
+            fputc(';', c->fp);
+            newline(c);
+        }
+    }
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_VAR) {
+            emit_decl(c, *decls);
+        } else if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body) {
+            TRACE_BEGIN(TRACE_EMIT, (*decls)->decl.func.name->expr.ident.name);
+            emit_decl(c, *decls);
+            TRACE_END();
+        }
     }
 }
@@ -0,0 +1,675 @@
+#include "emit.h"
+#include "log.h"
+#include "token.h"
+#include "trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#define countof(a) ((int)(sizeof(a) / sizeof(*(a))))
+
+/*
+ * Textual LLVM IR for opt and llc to finish. Every local lives in an alloca
+ * in the entry block and every use loads it, which mem2reg turns into SSA.
+ *
+ * Temporaries are %tN, incoming arguments %aN and locals %name.N, so none
+ * of them can collide with another. Semantics follow the other backends:
+ * && and || evaluate both operands, shift counts are taken mod 32 and
+ * falling off the end of a function returns 0.
+ */
+
+typedef struct {
+    int is_const;
+    int value; // the constant, or the temporary's number
+} value_t;
+
+typedef struct _binding {
+    const char *name;
+    int local;
+    struct _binding *next;
+} binding_t;
+
+typedef struct {
+    int post;
+    int end;
+} loop_t;
+
+typedef struct {
+    crawler_t *c;
+    const file_t *file;
+    binding_t *bindings;
+    loop_t *loop;
+    int num_temps;
+    int num_labels;
+    int num_locals;
+    int terminated; // the current block has ended
+} compiler_t;
+
+static void bind(compiler_t *c, const char *name, int local)
+{
+    binding_t b = {.name = name, .local = local, .next = c->bindings};
+    c->bindings = copy(&b);
+}
+
+static void unbind(compiler_t *c, binding_t *mark)
+{
+    while (c->bindings != mark) {
+        binding_t *b = c->bindings;
+        c->bindings = b->next;
+        free(b);
+    }
+}
+
+static const binding_t *lookup(compiler_t *c, const char *ident)
+{
+    for (binding_t *b = c->bindings; b; b = b->next) {
+        if (!strcmp(b->name, ident))
+            return b;
+    }
+    PANIC("undeclared identifier: `%s`", ident);
+    return NULL;
+}
+
+static char *ident_string(const node_t *n)
+{
+    return n->expr.ident.name;
+}
+
+/* Start an instruction, opening a block for it if the last one ended. Code
+ * after a return or branch lands in a block nothing jumps to. */
+static void begin(compiler_t *c)
+{
+    if (c->terminated) {
+        fprintf(c->c->fp, "L%d:\n", c->num_labels++);
+        c->terminated = 0;
+    }
+    fprintf(c->c->fp, "  ");
+}
+
+static int new_label(compiler_t *c)
+{
+    return c->num_labels++;
+}
+
+/* Start block l, falling through to it from the current one. */
+static void label(compiler_t *c, int l)
+{
+    if (!c->terminated)
+        fprintf(c->c->fp, "  br label %%L%d\n", l);
+    fprintf(c->c->fp, "L%d:\n", l);
+    c->terminated = 0;
+}
+
+static void br(compiler_t *c, int l)
+{
+    begin(c);
+    fprintf(c->c->fp, "br label %%L%d\n", l);
+    c->terminated = 1;
+}
+
+static void print_value(compiler_t *c, value_t v)
+{
+    if (v.is_const)
+        fprintf(c->c->fp, "%d", v.value);
+    else
+        fprintf(c->c->fp, "%%t%d", v.value);
+}
+
+/* Begin an instruction defining a new temporary and return it. */
+static value_t def(compiler_t *c)
+{
+    value_t v = {.value = c->num_temps++};
+    begin(c);
+    fprintf(c->c->fp, "%%t%d = ", v.value);
+    return v;
+}
+
+/* Emit "%tN = op ty x, y" and return %tN. */
+static value_t op2(compiler_t *c, const char *op, const char *ty, value_t x,
+        value_t y)
+{
+    value_t v = def(c);
+    fprintf(c->c->fp, "%s %s ", op, ty);
+    print_value(c, x);
+    fprintf(c->c->fp, ", ");
+    print_value(c, y);
+    fprintf(c->c->fp, "\n");
+    return v;
+}
+
+static value_t zext(compiler_t *c, value_t x)
+{
+    value_t v = def(c);
+    fprintf(c->c->fp, "zext i1 ");
+    print_value(c, x);
+    fprintf(c->c->fp, " to i32\n");
+    return v;
+}
+
+static value_t icmp(compiler_t *c, const char *pred, value_t x, value_t y)
+{
+    value_t v = def(c);
+    fprintf(c->c->fp, "icmp %s i32 ", pred);
+    print_value(c, x);
+    fprintf(c->c->fp, ", ");
+    print_value(c, y);
+    fprintf(c->c->fp, "\n");
+    return v;
+}
+
+static value_t constant(int k)
+{
+    return (value_t){.is_const = 1, .value = k};
+}
+
+static int is_simple(const node_t *n)
+{
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    return n->t == EXPR_BASIC || n->t == EXPR_IDENT;
+}
+
+static const char *binary_ops[] = {
+    [token_ADD] = "add",
+    [token_SUB] = "sub",
+    [token_MUL] = "mul",
+    [token_QUO] = "sdiv",
+    [token_REM] = "srem",
+    [token_AND] = "and",
+    [token_OR] = "or",
+    [token_XOR] = "xor",
+    [token_SHL] = "shl",
+    [token_SHR] = "ashr",
+};
+
+static const char *predicates[] = {
+    [token_EQL] = "eq",
+    [token_NEQ] = "ne",
+    [token_LSS] = "slt",
+    [token_LEQ] = "sle",
+    [token_GTR] = "sgt",
+    [token_GEQ] = "sge",
+};
+
+static value_t binary(compiler_t *c, int op, value_t x, value_t y)
+{
+    switch (op) {
+    case token_EQL:
+    case token_NEQ:
+    case token_LSS:
+    case token_LEQ:
+    case token_GTR:
+    case token_GEQ:
+        return zext(c, icmp(c, predicates[op], x, y));
+    case token_LAND:
+        x = icmp(c, "ne", x, constant(0));
+        y = icmp(c, "ne", y, constant(0));
+        return zext(c, op2(c, "and", "i1", x, y));
+    case token_LOR:
+        x = op2(c, "or", "i32", x, y);
+        return zext(c, icmp(c, "ne", x, constant(0)));
+    case token_AND_NOT:
+        y = op2(c, "xor", "i32", y, constant(-1));
+        return op2(c, "and", "i32", x, y);
+    case token_SHL:
+    case token_SHR:
+        y = op2(c, "and", "i32", y, constant(31));
+        return op2(c, binary_ops[op], "i32", x, y);
+    default:
+        if (op >= countof(binary_ops) || !binary_ops[op])
+            PANIC("unknown binary op: `%s`", token_string(op));
+        return op2(c, binary_ops[op], "i32", x, y);
+    }
+}
+
+static value_t unary(compiler_t *c, int op, value_t x)
+{
+    switch (op) {
+    case token_ADD:
+        return x;
+    case token_SUB:
+        return op2(c, "sub", "i32", constant(0), x);
+    case token_BITWISE_NOT:
+        return op2(c, "xor", "i32", x, constant(-1));
+    case token_NOT:
+        return zext(c, icmp(c, "eq", x, constant(0)));
+    default:
+        PANIC("unknown unary op: `%s`", token_string(op));
+        return x;
+    }
+}
+
+static value_t call(compiler_t *c, const node_t *n, const value_t *args, int num_args)
+{
+    const char *name = ident_string(n->expr.call.func);
+    value_t v;
+
+    if (!ast_find_func(c->file, name))
+        PANIC("undeclared function: `%s`", name);
+    v = def(c);
+    fprintf(c->c->fp, "call i32 @%s(", name);
+    for (int i = 0; i < num_args; ++i) {
+        fprintf(c->c->fp, i ? ", i32 " : "i32 ");
+        print_value(c, args[i]);
+    }
+    fprintf(c->c->fp, ")\n");
+    return v;
+}
+
+/* An expression being evaluated, and how far along it is. */
+typedef struct {
+    const node_t *n;
+    enum {
+        EXPR_START,
+        EXPR_SECOND, // the first operand is on the value stack
+        EXPR_APPLY, // the operands are on the value stack
+    } state;
+    int y_first; // the right operand is evaluated before the left
+    int arg; // the next argument of a call
+    int not_const; // under a negation that wasn't a constant
+} task_t;
+
+static void push_task(ast_stack_t *s, const node_t *n)
+{
+    *(task_t *)ast_stack_push(s) = (task_t){.n = n};
+}
+
+static void push_value(ast_stack_t *s, value_t v)
+{
+    *(value_t *)ast_stack_push(s) = v;
+}
+
+/* Evaluate n. Operands and arguments are evaluated from a stack of tasks,
+ * with their values on a stack of their own, rather than by recursing, so
+ * nesting costs heap instead of C stack. */
+static value_t expr(compiler_t *c, const node_t *n)
+{
+    ast_stack_t tasks;
+    ast_stack_t values;
+    const binding_t *b;
+    task_t *t;
+    value_t v, x, y;
+    int k;
+
+    ast_stack_init(&tasks, sizeof(task_t));
+    ast_stack_init(&values, sizeof(value_t));
+    push_task(&tasks, n);
+    while ((t = ast_stack_top(&tasks))) {
+        n = t->n;
+        switch (n->t) {
+        case EXPR_BASIC:
+            ast_const_value(n, &k);
+            push_value(&values, constant(k));
+            break;
+        case EXPR_BINARY:
+            // in the same order as emit_x64: a complex right operand first
+            if (t->state == EXPR_START) {
+                t->state = EXPR_SECOND;
+                t->y_first = !is_simple(n->expr.binary.y);
+                push_task(&tasks, t->y_first ? n->expr.binary.y : n->expr.binary.x);
+                continue;
+            }
+            if (t->state == EXPR_SECOND) {
+                t->state = EXPR_APPLY;
+                push_task(&tasks, t->y_first ? n->expr.binary.x : n->expr.binary.y);
+                continue;
+            }
+            if (t->y_first) {
+                x = *(value_t *)ast_stack_pop(&values);
+                y = *(value_t *)ast_stack_pop(&values);
+            } else {
+                y = *(value_t *)ast_stack_pop(&values);
+                x = *(value_t *)ast_stack_pop(&values);
+            }
+            push_value(&values, binary(c, n->expr.binary.op, x, y));
+            break;
+        case EXPR_CALL:
+            if (n->expr.call.args && n->expr.call.args[t->arg]) {
+                push_task(&tasks, n->expr.call.args[t->arg++]);
+                continue;
+            }
+            values.len -= t->arg;
+            v = call(c, n, (value_t *)values.items + values.len, t->arg);
+            push_value(&values, v);
+            break;
+        case EXPR_IDENT:
+            b = lookup(c, ident_string(n));
+            v = def(c);
+            fprintf(c->c->fp, "load i32, i32* %%%s.%d\n", b->name, b->local);
+            push_value(&values, v);
+            break;
+        case EXPR_PAREN:
+            t->n = n->expr.paren.x;
+            continue;
+        case EXPR_UNARY:
+            if (t->state == EXPR_START && !t->not_const && ast_const_value(n, &k)) {
+                push_value(&values, constant(k));
+            } else if (t->state == EXPR_START) {
+                t->state = EXPR_APPLY;
+                push_task(&tasks, n->expr.unary.expr);
+                // the rest of a chain of negations can't be either, and
+                // checking each again would be quadratic
+                ((task_t *)ast_stack_top(&tasks))->not_const = n->expr.unary.op == token_SUB;
+                continue;
+            } else {
+                x = *(value_t *)ast_stack_pop(&values);
+                push_value(&values, unary(c, n->expr.unary.op, x));
+            }
+            break;
+        default:
+            PANIC("illegal expression");
+            break;
+        }
+        ast_stack_pop(&tasks);
+    }
+    v = *(value_t *)ast_stack_pop(&values);
+    ast_stack_deinit(&tasks);
+    ast_stack_deinit(&values);
+    return v;
+}
+
+/* Evaluate both operands of a binary node in the same order as emit_x64:
+ * a complex right operand goes first. */
+static void operands(compiler_t *c, const node_t *n, value_t *x, value_t *y)
+{
+    if (is_simple(n->expr.binary.y)) {
+        *x = expr(c, n->expr.binary.x);
+        *y = expr(c, n->expr.binary.y);
+    } else {
+        *y = expr(c, n->expr.binary.y);
+        *x = expr(c, n->expr.binary.x);
+    }
+}
+
+/* Evaluate n as an i1. */
+static value_t cond(compiler_t *c, const node_t *n)
+{
+    int op;
+    value_t x, y;
+
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    op = n->t == EXPR_BINARY ? n->expr.binary.op : 0;
+    if (op < countof(predicates) && predicates[op]) {
+        operands(c, n, &x, &y);
+        return icmp(c, predicates[op], x, y);
+    }
+    return icmp(c, "ne", expr(c, n), constant(0));
+}
+
+static void store(compiler_t *c, value_t v, const binding_t *b)
+{
+    begin(c);
+    fprintf(c->c->fp, "store i32 ");
+    print_value(c, v);
+    fprintf(c->c->fp, ", i32* %%%s.%d\n", b->name, b->local);
+}
+
+static void cond_br(compiler_t *c, const node_t *n, int then, int else_)
+{
+    value_t v = cond(c, n);
+    begin(c);
+    fprintf(c->c->fp, "br i1 ");
+    print_value(c, v);
+    fprintf(c->c->fp, ", label %%L%d, label %%L%d\n", then, else_);
+    c->terminated = 1;
+}
+
+static void stmt(compiler_t *c, const node_t *n)
+{
+    binding_t *mark = c->bindings;
+    loop_t loop, *outer;
+    int start, body, end;
+
+    switch (n->t) {
+    case STMT_ASSIGN:
+        do {
+            node_t tmp;
+            store(c, expr(c, ast_assign_value(n, &tmp)),
+                    lookup(c, ident_string(n->stmt.assign.lhs)));
+        } while (0);
+        break;
+
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            stmt(c, *stmts);
+        unbind(c, mark);
+        break;
+
+    case STMT_BRANCH:
+        assert(c->loop);
+        // fallthrough is the clause's block falling into the next one's
+        if (n->stmt.branch.tok != token_FALLTHROUGH)
+            br(c, n->stmt.branch.tok == token_BREAK ? c->loop->end : c->loop->post);
+        break;
+
+    case STMT_DECL:
+        n = n->stmt.decl.decl;
+        if (n->t != DECL_VAR)
+            PANIC("only var decls are supported in functions");
+        if (n->decl.var.value) {
+            value_t v = expr(c, n->decl.var.value);
+            bind(c, ident_string(n->decl.var.name), c->num_locals++);
+            store(c, v, c->bindings);
+        } else {
+            // no initializer, the local keeps whatever it held
+            bind(c, ident_string(n->decl.var.name), c->num_locals++);
+        }
+        break;
+
+    case STMT_EMPTY:
+        break;
+
+    case STMT_EXPR:
+        expr(c, n->stmt.expr.x);
+        break;
+
+    case STMT_FOR:
+        if (n->stmt.for_.init)
+            stmt(c, n->stmt.for_.init);
+        start = new_label(c);
+        body = new_label(c);
+        loop = (loop_t){.post = new_label(c), .end = new_label(c)};
+        label(c, start);
+        if (n->stmt.for_.cond)
+            cond_br(c, n->stmt.for_.cond, body, loop.end);
+        label(c, body);
+        outer = c->loop;
+        c->loop = &loop;
+        stmt(c, n->stmt.for_.body);
+        c->loop = outer;
+        label(c, loop.post);
+        if (n->stmt.for_.post)
+            stmt(c, n->stmt.for_.post);
+        br(c, start);
+        label(c, loop.end);
+        unbind(c, mark);
+        break;
+
+    case STMT_IF:
+        body = new_label(c);
+        start = n->stmt.if_.else_ ? new_label(c) : -1;
+        end = new_label(c);
+        cond_br(c, n->stmt.if_.cond, body, start >= 0 ? start : end);
+        label(c, body);
+        stmt(c, n->stmt.if_.body);
+        if (start >= 0) {
+            br(c, end);
+            label(c, start);
+            stmt(c, n->stmt.if_.else_);
+        }
+        label(c, end);
+        break;
+
+    case STMT_SWITCH:
+        do {
+            node_t **clauses = n->stmt.switch_.clauses;
+            value_t v = expr(c, n->stmt.switch_.tag);
+            int num = 0;
+            while (clauses[num])
+                num++;
+            // a block per clause, in order, then the end
+            start = c->num_labels;
+            c->num_labels += num;
+            loop = (loop_t){.post = c->loop ? c->loop->post : -1, .end = new_label(c)};
+            end = loop.end;
+            for (int i = 0; i < num; ++i) {
+                if (!clauses[i]->stmt.case_.exprs)
+                    end = start + i;
+            }
+            begin(c);
+            fprintf(c->c->fp, "switch i32 ");
+            print_value(c, v);
+            fprintf(c->c->fp, ", label %%L%d [", end);
+            for (int i = 0; i < num; ++i) {
+                for (node_t **exprs = clauses[i]->stmt.case_.exprs; exprs && *exprs; ++exprs)
+                    fprintf(c->c->fp, " i32 %d, label %%L%d", (int)(*exprs)->expr.basic.value,
+                            start + i);
+            }
+            fprintf(c->c->fp, " ]\n");
+            c->terminated = 1;
+            outer = c->loop;
+            c->loop = &loop;
+            for (int i = 0; i < num; ++i) {
+                label(c, start + i);
+                for (node_t **stmts = clauses[i]->stmt.case_.stmts; *stmts; ++stmts)
+                    stmt(c, *stmts);
+                unbind(c, mark);
+                if (!ast_falls_through(clauses[i]))
+                    br(c, loop.end);
+            }
+            c->loop = outer;
+            label(c, loop.end);
+        } while (0);
+        break;
+
+    case STMT_RETURN:
+        do {
+            value_t v = n->stmt.return_.expr ? expr(c, n->stmt.return_.expr)
+                : constant(0);
+            begin(c);
+            fprintf(c->c->fp, "ret i32 ");
+            print_value(c, v);
+            fprintf(c->c->fp, "\n");
+            c->terminated = 1;
+        } while (0);
+        break;
+
+    default:
+        PANIC("illegal statement");
+        break;
+    }
+}
+
+/* Emit an alloca for every local declared in n, numbered in the order stmt
+ * will bind them. */
+static void allocas(compiler_t *c, const node_t *n)
+{
+    switch (n->t) {
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            allocas(c, *stmts);
+        break;
+    case STMT_DECL:
+        if (n->stmt.decl.decl->t == DECL_VAR)
+            fprintf(c->c->fp, "  %%%s.%d = alloca i32\n",
+                    ident_string(n->stmt.decl.decl->decl.var.name),
+                    c->num_locals++);
+        break;
+    case STMT_FOR:
+        if (n->stmt.for_.init)
+            allocas(c, n->stmt.for_.init);
+        allocas(c, n->stmt.for_.body);
+        break;
+    case STMT_IF:
+        allocas(c, n->stmt.if_.body);
+        if (n->stmt.if_.else_)
+            allocas(c, n->stmt.if_.else_);
+        break;
+    case STMT_SWITCH:
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+            for (node_t **stmts = (*clauses)->stmt.case_.stmts; *stmts; ++stmts)
+                allocas(c, *stmts);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Print n's type and name, with its arguments named %aN if named. */
+static void signature(compiler_t *c, const node_t *n, int named)
+{
+    node_t **params = n->decl.func.params;
+
+    fprintf(c->c->fp, "i32 @%s(", ident_string(n->decl.func.name));
+    for (int i = 0; params && params[i]; ++i) {
+        fprintf(c->c->fp, i ? ", i32" : "i32");
+        if (named)
+            fprintf(c->c->fp, " %%a%d", i);
+    }
+    fprintf(c->c->fp, ")");
+}
+
+static void func(compiler_t *c, const node_t *n)
+{
+    node_t **params = n->decl.func.params;
+
+    fprintf(c->c->fp, "\ndefine %s",
+            ast_is_exported(ident_string(n->decl.func.name)) ? "" : "internal ");
+    signature(c, n, 1);
+    fprintf(c->c->fp, " {\n");
+    c->num_temps = c->num_labels = c->num_locals = 0;
+    c->terminated = 0;
+    for (int i = 0; params && params[i]; ++i)
+        fprintf(c->c->fp, "  %%%s.%d = alloca i32\n",
+                ident_string(params[i]->expr.field.name), c->num_locals++);
+    allocas(c, n->decl.func.body);
+    c->num_locals = 0;
+    for (int i = 0; params && params[i]; ++i) {
+        bind(c, ident_string(params[i]->expr.field.name), c->num_locals++);
+        fprintf(c->c->fp, "  store i32 %%a%d, i32* %%%s.%d\n", i,
+                c->bindings->name, c->bindings->local);
+    }
+    stmt(c, n->decl.func.body);
+    if (!c->terminated)
+        fprintf(c->c->fp, "  ret i32 0\n");
+    fprintf(c->c->fp, "}\n");
+    unbind(c, NULL);
+}
+
+extern void emit_llvm(crawler_t *crawler, const file_t *f)
+{
+    compiler_t c = {.c = crawler, .file = f};
+    const node_t *n = ast_find_struct_use(f);
+
+    if (n)
+        ast_error(f, n, "structs aren't supported by the LLVM backend");
+    fprintf(crawler->fp, "source_filename = \"");
+    for (const char *s = f->filename; *s; ++s) {
+        if (*s == '"' || *s == '\\' || *s < ' ')
+            fprintf(crawler->fp, "\\%02X", (unsigned char)*s);
+        else
+            fputc(*s, crawler->fp);
+    }
+    fprintf(crawler->fp, "\"\n");
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_TYPE)
+            continue;
+        if ((*decls)->t != DECL_FUNC)
+            PANIC("only func and type decls are supported at the top level");
+        if (ast_find_func(f, ident_string((*decls)->decl.func.name)) == *decls
+                && !(*decls)->decl.func.body) {
+            fprintf(crawler->fp, "\ndeclare ");
+            signature(&c, *decls, 0);
+            fprintf(crawler->fp, "\n");
+        }
+    }
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body) {
+            TRACE_BEGIN(TRACE_EMIT, ident_string((*decls)->decl.func.name));
+            func(&c, *decls);
+            TRACE_END();
+        }
+    }
+}
@@ -1,83 +1,1711 @@
+#include "elf.h"
 #include "emit.h"
+#include "jit.h"
 #include "token.h"
 #include "log.h"
+#include "profile.h"
+#include "trace.h"
+#include "x64.h"
 
 #include <assert.h>
+#include <limits.h> // INT_MIN
 #include <stdio.h>
 
-#ifdef __APPLE__
-static const char *pre = "_";
-#else
-static const char *pre = "";
-#endif
+#include <da/da_util.h>
 
-static const char *eax = "%eax";
-static const char *ecx = "%ecx";
+#define NUM_ARG_REGS 6
 
+static const x64_reg_t arg_regs[NUM_ARG_REGS] = {
+    X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9,
+};
 
-#ifdef __APPLE__
-static int scope_len(const scope_t *s)
+/* Functions nothing outside the file can call take their arguments in
+ * registers that evaluating an expression never touches, so a caller can
+ * compute each one straight into its register. Otherwise the convention is
+ * System V's. */
+static const x64_reg_t private_arg_regs[NUM_ARG_REGS] = {
+    X64_RDI, X64_RSI, X64_R8, X64_R9, X64_R10, X64_R11,
+};
+
+/* Expression temporaries live in callee-saved registers when the function
+ * makes calls, and in free caller-saved ones when it doesn't. */
+static const x64_reg_t saved_regs[] = {X64_RBX, X64_R12, X64_R13, X64_R14, X64_R15};
+static const x64_reg_t leaf_regs[] = {X64_R8, X64_R9, X64_R10, X64_R11, X64_RSI, X64_RDI};
+
+#define countof(a) ((int)(sizeof(a) / sizeof(*(a))))
+
+#define RED_ZONE 128
+
+/* A switch jumps through a table when it has at least MIN_TABLE_CASES
+ * cases spread over fewer than MAX_TABLE_SPREAD entries per case. Smaller
+ * or sparser ones binary search down to MAX_LINEAR_CASES compares. */
+#define MIN_TABLE_CASES 4
+#define MAX_TABLE_SPREAD 3
+#define MAX_LINEAR_CASES 3
+
+static x64_operand_t r32(x64_reg_t reg)
+{
+    return x64_reg(reg, 4);
+}
+
+static x64_operand_t r64(x64_reg_t reg)
+{
+    return x64_reg(reg, 8);
+}
+
+static x64_label_t label(const char *name, const void *id)
+{
+    return (x64_label_t){.name = name, .id = id};
+}
+
+/* A local or parameter bound to its slot. */
+typedef struct _binding {
+    const char *name;
+    int offset;
+    const node_t *type;
+    struct _binding *next;
+} binding_t;
+
+/* Where a struct value goes: the frame offset it's stored at, or the frame
+ * offset of a pointer to where it's stored. */
+typedef struct {
+    int offset;
+    int indirect;
+} dest_t;
+
+/* Where an argument is passed: in consecutive registers starting with the
+ * reg-th of its convention's, or on the stack at offset from the first stack argument
+ * if reg < 0. */
+typedef struct {
+    int reg;
+    int offset;
+    int size;
+} arg_t;
+
+typedef struct {
+    const node_t *decl;
+    int index;
+} slot_t;
+
+/*
+ * Layout of the function being emitted. Register parameters and locals are
+ * assigned 4-byte slots below the saved registers before any code is
+ * emitted, and locals of disjoint blocks share slots. Temporaries that don't
+ * fit in registers get slots after them.
+ *
+ * Leaf functions never move %rsp: their frame lives in the red zone and is
+ * addressed off %rsp unless it's too big to fit.
+ */
+typedef struct {
+    da_t slots;
+    int num_slots;
+    int num_temps;
+    int num_saved;
+    int size;
+    int has_calls;
+    int has_frame;
+    int temps;
+} frame_t;
+
+DA_DEF_HELPERS(slot, slot_t);
+
+static frame_t frame;
+static binding_t *bindings = NULL;
+
+/* Sites and counts from --profile-use, and whether to count with
+ * --profile-generate. */
+static const profile_t *profile = NULL;
+static const char *profile_path = NULL;
+
+static void bind(const char *name, int offset, const node_t *type)
+{
+    binding_t b = {.name = name, .offset = offset, .type = type, .next = bindings};
+    bindings = copy(&b);
+}
+
+static void unbind(binding_t *mark)
+{
+    while (bindings != mark) {
+        binding_t *b = bindings;
+        bindings = b->next;
+        free(b);
+    }
+}
+
+static const binding_t *lookup(const char *ident)
+{
+    for (binding_t *b = bindings; b; b = b->next) {
+        if (!strcmp(b->name, ident))
+            return b;
+    }
+    PANIC("undeclared identifier: `%s`", ident);
+    return NULL;
+}
+
+/* Offsets are relative to %rbp, as if every function had a frame. */
+static int slot_offset(int index)
+{
+    return -8 * frame.num_saved - 4 * index;
+}
+
+static x64_operand_t frame_operand(int offset, int size)
+{
+    if (frame.has_frame)
+        return x64_mem(X64_RBP, offset, size);
+    return x64_mem(X64_RSP, offset - 8, size);
+}
+
+static x64_operand_t slot_operand(int offset)
+{
+    return frame_operand(offset, 4);
+}
+
+/*
+ * Types
+ *
+ * A type is int or a struct of types. Every type is a whole number of 4-byte
+ * words aligned to 4, so fields are laid out in declaration order without
+ * padding and no reordering could make a struct smaller.
+ */
+
+static const file_t *file = NULL;
+
+static node_t int_type = {.t = EXPR_IDENT, .expr.ident.name = "int"};
+
+/* The struct a type denotes, or NULL if it's int. */
+static const node_t *struct_of(const node_t *type)
+{
+    while (type->t == EXPR_IDENT) {
+        const char *name = type->expr.ident.name;
+        const node_t *decl = NULL;
+        if (!strcmp(name, "int"))
+            return NULL;
+        for (node_t **decls = file->decls; decls && *decls && !decl; ++decls) {
+            if ((*decls)->t == DECL_TYPE
+                    && !strcmp((*decls)->decl.type.name->expr.ident.name, name))
+                decl = *decls;
+        }
+        if (!decl)
+            PANIC("unknown type: `%s`", name);
+        type = decl->decl.type.type;
+    }
+    return type;
+}
+
+static int type_size(const node_t *type)
+{
+    const node_t *s = struct_of(type);
+    int size = 0;
+
+    if (!s)
+        return 4;
+    for (node_t **fields = s->expr.struct_.fields; *fields; ++fields)
+        size += type_size((*fields)->decl.var.type);
+    return size;
+}
+
+/* The type of the field sel of a struct type, and its offset in *offset. */
+static const node_t *field_type(const node_t *type, const node_t *sel, int *offset)
+{
+    const node_t *s = struct_of(type);
+    const char *name = sel->expr.ident.name;
+
+    if (!s)
+        PANIC("selector `.%s` on an int", name);
+    *offset = 0;
+    for (node_t **fields = s->expr.struct_.fields; *fields; ++fields) {
+        if (!strcmp((*fields)->decl.var.name->expr.ident.name, name))
+            return (*fields)->decl.var.type;
+        *offset += type_size((*fields)->decl.var.type);
+    }
+    PANIC("no field `%s`", name);
+    return NULL;
+}
+
+/* The type a call returns: its declaration's, or int if undeclared. */
+static const node_t *return_type(const node_t *call)
+{
+    const node_t *func = ast_find_func(file, call->expr.call.func->expr.ident.name);
+    return func ? func->decl.func.type : &int_type;
+}
+
+/* Whether values of type are returned through a pointer the caller passes
+ * in %rdi instead of in %rax and %rdx. */
+static int is_sret(const node_t *type)
+{
+    return type_size(type) > 16;
+}
+
+/* Assign registers and stack space to arguments of the given types, as the
+ * System V ABI does for ints and structs of ints: a struct of up to 16
+ * bytes takes a register per eightbyte if enough are left and goes on the
+ * stack otherwise. Returns the bytes of stack arguments. */
+static int classify(const node_t *ret, int n, const node_t **types, arg_t *args)
+{
+    int next = is_sret(ret);
+    int stack = 0;
+
+    for (int i = 0; i < n; ++i) {
+        int size = type_size(types[i]);
+        int words = (size + 7) / 8;
+        if (size <= 16 && next + words <= NUM_ARG_REGS) {
+            args[i] = (arg_t){.reg = next, .size = size};
+            next += words;
+        } else {
+            args[i] = (arg_t){.reg = -1, .offset = stack, .size = size};
+            stack += 8 * words;
+        }
+    }
+    return stack;
+}
+
+/* The types of a call's arguments: its parameters' if it's declared with
+ * them, int otherwise. */
+static void arg_types(const node_t *call, int n, const node_t **types)
+{
+    const node_t *func = ast_find_func(file, call->expr.call.func->expr.ident.name);
+    node_t **params = func ? func->decl.func.params : NULL;
+
+    for (int i = 0; i < n; ++i)
+        types[i] = params && *params ? (*params++)->expr.field.type : &int_type;
+}
+
+static int count_params(const node_t *func)
+{
+    int n = 0;
+    for (node_t **params = func->decl.func.params; params && *params; ++params)
+        n++;
+    return n;
+}
+
+/* Where func's parameters are passed, by classify. */
+static void classify_params(const node_t *func, arg_t *args)
+{
+    int n = count_params(func);
+    const node_t *types[n + 1];
+
+    for (int i = 0; i < n; ++i)
+        types[i] = func->decl.func.params[i]->expr.field.type;
+    classify(func->decl.func.type, n, types, args);
+}
+
+/* Whether func is defined here and can't be called from outside the file,
+ * so it can use private_arg_regs. */
+static int is_private(const node_t *func)
+{
+    return func && func->decl.func.body
+        && !ast_is_exported(func->decl.func.name->expr.ident.name);
+}
+
+static const x64_reg_t *arg_regs_of(const node_t *func)
+{
+    return is_private(func) ? private_arg_regs : arg_regs;
+}
+
+static int slot_of(const node_t *decl)
+{
+    for (int i = 0; i < da_len(&frame.slots); ++i) {
+        slot_t *slot = da_get(&frame.slots, i);
+        if (slot->decl == decl)
+            return slot_offset(slot->index);
+    }
+    PANIC("no slot for declaration");
+    return 0;
+}
+
+static const x64_reg_t *temp_regs(int *n)
+{
+    if (frame.has_calls) {
+        *n = countof(saved_regs);
+        return saved_regs;
+    }
+    *n = countof(leaf_regs);
+    return leaf_regs;
+}
+
+/* Move %eax into the next temporary and return where it went. */
+static x64_operand_t hold(x64_t *a)
+{
+    int n;
+    const x64_reg_t *regs = temp_regs(&n);
+    int i = frame.temps++;
+    x64_operand_t ret;
+    assert(frame.temps <= frame.num_temps);
+    if (i < n)
+        ret = r32(regs[i]);
+    else
+        ret = slot_operand(slot_offset(frame.num_slots + i - n + 1));
+    x64_op2(a, X64_MOV, r32(X64_RAX), ret);
+    return ret;
+}
+
+static void release(void)
+{
+    frame.temps--;
+}
+
+static int log2_exact(unsigned v)
+{
+    if (!v || (v & (v - 1)))
+        return -1;
+    return __builtin_ctz(v);
+}
+
+/*
+ * Signed magic number for division by d, where |d| >= 2 (Hacker's Delight,
+ * figure 10-1): n / d == mulhs(n, *m) >> *s, plus a correction for the sign.
+ */
+static void magic(int d, int *m, int *s)
+{
+    const unsigned two31 = 0x80000000;
+    unsigned ad = d < 0 ? -(unsigned)d : (unsigned)d;
+    unsigned t = two31 + ((unsigned)d >> 31);
+    unsigned anc = t - 1 - t % ad;
+    unsigned q1 = two31 / anc;
+    unsigned r1 = two31 - q1 * anc;
+    unsigned q2 = two31 / ad;
+    unsigned r2 = two31 - q2 * ad;
+    unsigned delta;
+    int p = 31;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *m = q2 + 1;
+    if (d < 0)
+        *m = -*m;
+    *s = p - 32;
+}
+
+/* Whether a constant divisor can skip idivl; 0 must still trap. */
+static int is_div_const(int d)
+{
+    return d != 0 && d != INT_MIN;
+}
+
+/* %eax = %eax / d or %eax % d, truncating toward zero like idivl. */
+static void emit_div_const(x64_t *a, int d, int rem)
+{
+    x64_operand_t eax = r32(X64_RAX);
+    x64_operand_t ecx = r32(X64_RCX);
+    x64_operand_t edx = r32(X64_RDX);
+    int m, s;
+    int k = log2_exact(d < 0 ? -(unsigned)d : (unsigned)d);
+
+    if (k == 0) {
+        if (rem)
+            x64_op2(a, X64_MOV, x64_imm(0), eax);
+        else if (d < 0)
+            x64_op1(a, X64_NEG, eax);
+        return;
+    }
+    if (k > 0) {
+        /* round toward zero by adding 2^k-1 to negative dividends */
+        x64_op2(a, X64_MOV, eax, edx);
+        if (k > 1)
+            x64_op2(a, X64_SAR, x64_imm(31), edx);
+        x64_op2(a, X64_SHR, x64_imm(32 - k), edx);
+        if (rem) {
+            x64_op2(a, X64_LEA, x64_sib(X64_RAX, X64_RDX, 1, 4), ecx);
+            x64_op2(a, X64_AND, x64_imm(-(1 << k)), ecx);
+            x64_op2(a, X64_SUB, ecx, eax);
+        } else {
+            x64_op2(a, X64_ADD, edx, eax);
+            x64_op2(a, X64_SAR, x64_imm(k), eax);
+            if (d < 0)
+                x64_op1(a, X64_NEG, eax);
+        }
+        return;
+    }
+    magic(d, &m, &s);
+    x64_op2(a, X64_MOV, eax, ecx);
+    x64_op2(a, X64_MOV, x64_imm(m), edx);
+    x64_op1(a, X64_IMUL1, edx);
+    if (d > 0 && m < 0)
+        x64_op2(a, X64_ADD, ecx, edx);
+    else if (d < 0 && m > 0)
+        x64_op2(a, X64_SUB, ecx, edx);
+    if (s)
+        x64_op2(a, X64_SAR, x64_imm(s), edx);
+    x64_op2(a, X64_MOV, edx, eax);
+    x64_op2(a, X64_SHR, x64_imm(31), eax);
+    x64_op2(a, X64_ADD, edx, eax);
+    if (rem) {
+        x64_op3(a, X64_IMUL3, x64_imm(d), eax, eax);
+        x64_op2(a, X64_SUB, eax, ecx);
+        x64_op2(a, X64_MOV, ecx, eax);
+    }
+}
+
+static int is_lea_scale(unsigned v)
+{
+    return v == 3 || v == 5 || v == 9;
+}
+
+/* %eax = %eax * v using lea, shifts and subtraction where they beat imul. */
+static void emit_mul_const(x64_t *a, int v)
+{
+    x64_operand_t eax = r32(X64_RAX);
+    unsigned u = v < 0 ? -(unsigned)v : (unsigned)v;
+    unsigned f = 1;
+    int k, j;
+
+    if (!u) {
+        x64_op2(a, X64_MOV, x64_imm(0), eax);
+        return;
+    }
+    k = __builtin_ctz(u);
+    u >>= k;
+    if (u == 1 || is_lea_scale(u)) {
+        f = u;
+    } else if ((u % 3 == 0 && is_lea_scale(u / 3)) ||
+            (u % 5 == 0 && is_lea_scale(u / 5)) ||
+            (u % 9 == 0 && is_lea_scale(u / 9))) {
+        f = u % 3 == 0 && is_lea_scale(u / 3) ? 3 :
+            u % 5 == 0 && is_lea_scale(u / 5) ? 5 : 9;
+        x64_op2(a, X64_LEA, x64_sib(X64_RAX, X64_RAX, f - 1, 4), eax);
+        f = u / f;
+    } else if ((j = log2_exact(u + 1)) > 0) {
+        x64_op2(a, X64_MOV, eax, r32(X64_RCX));
+        x64_op2(a, X64_SHL, x64_imm(j), eax);
+        x64_op2(a, X64_SUB, r32(X64_RCX), eax);
+    } else {
+        x64_op3(a, X64_IMUL3, x64_imm(v), eax, eax);
+        return;
+    }
+    if (f > 1)
+        x64_op2(a, X64_LEA, x64_sib(X64_RAX, X64_RAX, f - 1, 4), eax);
+    if (k)
+        x64_op2(a, X64_SHL, x64_imm(k), eax);
+    if (v < 0)
+        x64_op1(a, X64_NEG, eax);
+}
+
+
+static void emit(x64_t *a, const node_t *n);
+
+/* The operand left to evaluate when n is strength-reduced by
+ * emit_const_op, with the constant in *k; NULL otherwise. */
+static const node_t *reduced_operand(const node_t *n, int *k)
+{
+    switch (n->expr.binary.op) {
+    case token_MUL:
+        if (ast_const_value(n->expr.binary.y, k))
+            return n->expr.binary.x;
+        if (ast_const_value(n->expr.binary.x, k))
+            return n->expr.binary.y;
+        return NULL;
+    case token_QUO:
+    case token_REM:
+        if (ast_const_value(n->expr.binary.y, k) && is_div_const(*k))
+            return n->expr.binary.x;
+        return NULL;
+    default:
+        return NULL;
+    }
+}
+
+/* Strength-reduce multiplication and division by the constant k, with the
+ * operand reduced_operand() left in %eax. */
+static void emit_const_op(x64_t *a, int op, int k)
+{
+    if (op == token_MUL)
+        emit_mul_const(a, k);
+    else
+        emit_div_const(a, k, op == token_REM);
+}
+
+/* Whether n is a variable or a field of one. */
+static int is_addressable(const node_t *n)
+{
+    for (;;) {
+        switch (n->t) {
+        case EXPR_IDENT:
+            return 1;
+        case EXPR_PAREN:
+            n = n->expr.paren.x;
+            break;
+        case EXPR_SELECTOR:
+            n = n->expr.selector.x;
+            break;
+        default:
+            return 0;
+        }
+    }
+}
+
+/* Whether n can be used as an instruction operand without evaluating it. */
+static int is_simple(const node_t *n)
+{
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    return n->t == EXPR_BASIC || is_addressable(n);
+}
+
+/*
+ * The walks over expressions below keep their own stack instead of
+ * recursing, so that expressions nest as deep as the parser allows. A node
+ * is pushed once to have its operands pushed, and again, visited, where
+ * work has to wait for them.
+ */
+typedef struct {
+    const node_t *n;
+    int visited;
+} visit_t;
+
+static void push_visit(ast_stack_t *s, const node_t *n, int visited)
+{
+    *(visit_t *)ast_stack_push(s) = (visit_t){.n = n, .visited = visited};
+}
+
+/* The operands of n that count towards its temporaries, pushed onto s last
+ * first so they come off in the order emit() evaluates them. Returns how
+ * many there are; with s NULL they're only counted. */
+static int need_operands(ast_stack_t *s, const node_t *n)
+{
+    const node_t *x;
+    int count = 0;
+    int k = 0;
+
+    switch (n->t) {
+    case EXPR_BINARY:
+        if ((x = reduced_operand(n, &k)) || is_simple(n->expr.binary.y)) {
+            if (s)
+                push_visit(s, x ? x : n->expr.binary.x, 0);
+            return 1;
+        }
+        if (s) {
+            push_visit(s, n->expr.binary.y, 0);
+            push_visit(s, n->expr.binary.x, 0);
+        }
+        return 2;
+    case EXPR_CALL:
+        while (n->expr.call.args && n->expr.call.args[k])
+            k++;
+        while (k--) {
+            if (is_simple(n->expr.call.args[k]))
+                continue;
+            if (s)
+                push_visit(s, n->expr.call.args[k], 0);
+            count++;
+        }
+        return count;
+    case EXPR_PAREN:
+        x = n->expr.paren.x;
+        break;
+    case EXPR_SELECTOR:
+        x = n->expr.selector.x;
+        break;
+    case EXPR_UNARY:
+        x = n->expr.unary.expr;
+        break;
+    default:
+        return 0;
+    }
+    if (s)
+        push_visit(s, x, 0);
+    return 1;
+}
+
+static int has_calls(const node_t *n);
+
+/* Which of call's n arguments are evaluated straight into the registers
+ * they're passed in: ints in registers of a private callee, as long as no
+ * call among the later arguments could clobber them. */
+static void direct_args(const node_t *call, int n, int *direct)
+{
+    const node_t *func = ast_find_func(file, call->expr.call.func->expr.ident.name);
+    const node_t *types[n + 1];
+    arg_t args[n + 1];
+    int calls_after = 0;
+
+    arg_types(call, n, types);
+    classify(return_type(call), n, types, args);
+    for (int i = n - 1; i >= 0; --i) {
+        const node_t *arg = call->expr.call.args[i];
+        direct[i] = is_private(func) && !calls_after && args[i].reg >= 0
+            && !struct_of(types[i]) && !is_simple(arg);
+        calls_after = calls_after || has_calls(arg);
+    }
+}
+
+/* The most temporaries held at once while evaluating n. This mirrors the
+ * order in which emit() evaluates operands. */
+static int temp_need(const node_t *n)
+{
+    ast_stack_t todo;
+    ast_stack_t needs; // of the operands visited so far
+    visit_t *v;
+    int need;
+
+    ast_stack_init(&todo, sizeof(visit_t));
+    ast_stack_init(&needs, sizeof(int));
+    push_visit(&todo, n, 0);
+    while ((v = ast_stack_top(&todo))) {
+        n = v->n;
+        if (!v->visited) {
+            v->visited = 1;
+            need_operands(&todo, n);
+            continue;
+        }
+        ast_stack_pop(&todo);
+        int count = need_operands(NULL, n);
+        needs.len -= count;
+        int *k = (int *)needs.items + needs.len;
+        need = 0;
+        if (n->t == EXPR_CALL) {
+            // each argument's value is held while the next is evaluated,
+            // unless it went straight to its register
+            int num_args = 0;
+            int held = 0;
+            while (n->expr.call.args && n->expr.call.args[num_args])
+                num_args++;
+            int direct[num_args + 1];
+            direct_args(n, num_args, direct);
+            for (int i = 0, j = 0; j < num_args; ++j) {
+                if (is_simple(n->expr.call.args[j]))
+                    continue;
+                if (need < held + k[i])
+                    need = held + k[i];
+                held += !direct[j];
+                i++;
+            }
+            if (need < held)
+                need = held;
+        } else if (count == 2) {
+            need = 1 + k[0] > k[1] ? 1 + k[0] : k[1];
+        } else if (count == 1) {
+            need = k[0];
+        }
+        *(int *)ast_stack_push(&needs) = need;
+    }
+    need = *(int *)ast_stack_pop(&needs);
+    ast_stack_deinit(&todo);
+    ast_stack_deinit(&needs);
+    return need;
+}
+
+static int has_calls(const node_t *n)
+{
+    ast_stack_t s;
+    visit_t *v;
+    int found = 0;
+
+    ast_stack_init(&s, sizeof(visit_t));
+    push_visit(&s, n, 0);
+    while (!found && (v = ast_stack_pop(&s))) {
+        n = v->n;
+        switch (n->t) {
+        case EXPR_BINARY:
+            push_visit(&s, n->expr.binary.y, 0);
+            push_visit(&s, n->expr.binary.x, 0);
+            break;
+        case EXPR_CALL:
+            found = 1;
+            break;
+        case EXPR_PAREN:
+            push_visit(&s, n->expr.paren.x, 0);
+            break;
+        case EXPR_SELECTOR:
+            push_visit(&s, n->expr.selector.x, 0);
+            break;
+        case EXPR_UNARY:
+            push_visit(&s, n->expr.unary.expr, 0);
+            break;
+        default:
+            break;
+        }
+    }
+    ast_stack_deinit(&s);
+    return found;
+}
+
+static void add_slot(const node_t *decl, int index)
+{
+    slot_t slot = {.decl = decl, .index = index};
+    da_append_slot(&frame.slots, slot);
+    if (frame.num_slots < index)
+        frame.num_slots = index;
+}
+
+/* A struct takes as many slots as it has words, and its slot is the
+ * lowest-addressed one. */
+static int add_slots(const node_t *decl, int depth, const node_t *type)
+{
+    depth += type_size(type) / 4;
+    add_slot(decl, depth);
+    return depth;
+}
+
+/* Give every call in n that returns a struct a slot to return it in, the
+ * first one after depth, after the calls in its arguments. Returns the
+ * depth after them. */
+static int layout_calls(const node_t *n, int depth)
+{
+    ast_stack_t s;
+    visit_t *v;
+    int k = 0;
+
+    ast_stack_init(&s, sizeof(visit_t));
+    push_visit(&s, n, 0);
+    while ((v = ast_stack_pop(&s))) {
+        n = v->n;
+        if (v->visited) {
+            if (struct_of(return_type(n)))
+                depth = add_slots(n, depth, return_type(n));
+            continue;
+        }
+        switch (n->t) {
+        case EXPR_BINARY:
+            push_visit(&s, n->expr.binary.y, 0);
+            push_visit(&s, n->expr.binary.x, 0);
+            break;
+        case EXPR_CALL:
+            push_visit(&s, n, 1);
+            for (k = 0; n->expr.call.args && n->expr.call.args[k]; ++k)
+                ;
+            while (k--)
+                push_visit(&s, n->expr.call.args[k], 0);
+            break;
+        case EXPR_PAREN:
+            push_visit(&s, n->expr.paren.x, 0);
+            break;
+        case EXPR_SELECTOR:
+            push_visit(&s, n->expr.selector.x, 0);
+            break;
+        case EXPR_UNARY:
+            push_visit(&s, n->expr.unary.expr, 0);
+            break;
+        default:
+            break;
+        }
+    }
+    ast_stack_deinit(&s);
+    return depth;
+}
+
+static void layout_expr(const node_t *n, int depth)
+{
+    int need = temp_need(n);
+    if (frame.num_temps < need)
+        frame.num_temps = need;
+    if (has_calls(n))
+        frame.has_calls = 1;
+    layout_calls(n, depth);
+}
+
+/* Assign slots to the locals declared by n, the first one after depth.
+ * Returns the depth after n. */
+static int layout(const node_t *n, int depth)
+{
+    node_t tmp;
+    int d = depth;
+
+    switch (n->t) {
+    case DECL_VAR:
+        d = add_slots(n, d, n->decl.var.type);
+        if (n->decl.var.value)
+            layout_expr(n->decl.var.value, d);
+        return d;
+    case STMT_DECL:
+        return layout(n->stmt.decl.decl, d);
+    case STMT_ASSIGN:
+        layout_expr(ast_assign_value(n, &tmp), d);
+        return d;
+    case STMT_EXPR:
+        layout_expr(n->stmt.expr.x, d);
+        return d;
+    case STMT_RETURN:
+        if (n->stmt.return_.expr)
+            layout_expr(n->stmt.return_.expr, d);
+        return d;
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            d = layout(*stmts, d);
+        return depth;
+    case STMT_FOR:
+        if (n->stmt.for_.init)
+            d = layout(n->stmt.for_.init, d);
+        if (n->stmt.for_.cond)
+            layout_expr(n->stmt.for_.cond, d);
+        if (n->stmt.for_.post)
+            layout(n->stmt.for_.post, d);
+        layout(n->stmt.for_.body, d);
+        return depth;
+    case STMT_IF:
+        layout_expr(n->stmt.if_.cond, d);
+        layout(n->stmt.if_.body, d);
+        if (n->stmt.if_.else_)
+            layout(n->stmt.if_.else_, d);
+        return depth;
+    case STMT_SWITCH:
+        layout_expr(n->stmt.switch_.tag, d);
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+            int c = d;
+            for (node_t **stmts = (*clauses)->stmt.case_.stmts; *stmts; ++stmts)
+                c = layout(*stmts, c);
+        }
+        return depth;
+    default:
+        return d;
+    }
+}
+
+static void layout_func(const node_t *n)
+{
+    node_t **params = n->decl.func.params;
+    arg_t args[count_params(n) + 1];
+    int num_regs;
+
+    frame = (frame_t){};
+    da_init_slot(&frame.slots);
+    classify_params(n, args);
+    // the pointer to return a struct through, if the caller passes one
+    if (is_sret(n->decl.func.type))
+        add_slot(n, 2);
+    for (int i = 0; params && params[i]; ++i) {
+        if (args[i].reg >= 0)
+            add_slots(params[i], frame.num_slots, params[i]->expr.field.type);
+    }
+    layout(n->decl.func.body, frame.num_slots);
+    // main registers the profile dump to run at exit
+    if (profile_path && !strcmp(n->decl.func.name->expr.ident.name, "main"))
+        frame.has_calls = 1;
+    temp_regs(&num_regs);
+    if (frame.has_calls)
+        frame.num_saved = frame.num_temps < num_regs ? frame.num_temps : num_regs;
+    frame.size = 4 * frame.num_slots;
+    if (frame.num_temps > num_regs)
+        frame.size += 4 * (frame.num_temps - num_regs);
+    frame.has_frame = frame.has_calls || frame.size + 8 > RED_ZONE;
+}
+
+static void emit_expr(x64_t *a, const node_t *n, const dest_t *dest);
+
+/* The frame offset of a struct or field n and its type in *type, calling
+ * the call at its base first if there is one. Variables and their fields
+ * emit nothing, and a is NULL when the call has already been made. */
+static int place_of(x64_t *a, const node_t *n, const node_t **type)
+{
+    ast_stack_t sels; // from n down to its base
+    const node_t **sel;
+    dest_t dest;
+    int offset = 0;
+    int field;
+
+    ast_stack_init(&sels, sizeof(n));
+    while (n->t == EXPR_PAREN || n->t == EXPR_SELECTOR) {
+        if (n->t == EXPR_SELECTOR)
+            *(const node_t **)ast_stack_push(&sels) = n;
+        n = n->t == EXPR_PAREN ? n->expr.paren.x : n->expr.selector.x;
+    }
+    switch (n->t) {
+    case EXPR_CALL:
+        *type = return_type(n);
+        if (!struct_of(*type))
+            PANIC("`%s` doesn't return a struct", n->expr.call.func->expr.ident.name);
+        dest = (dest_t){.offset = slot_of(n)};
+        if (a)
+            emit_expr(a, n, &dest);
+        offset = dest.offset;
+        break;
+    case EXPR_IDENT:
+        *type = lookup(n->expr.ident.name)->type;
+        offset = lookup(n->expr.ident.name)->offset;
+        break;
+    default:
+        PANIC("expression isn't a struct");
+        break;
+    }
+    while ((sel = ast_stack_pop(&sels))) {
+        *type = field_type(*type, (*sel)->expr.selector.sel, &field);
+        offset += field;
+    }
+    ast_stack_deinit(&sels);
+    return offset;
+}
+
+/* The call a struct expression is a field of, or is, if any. */
+static const node_t *base_call(const node_t *n)
+{
+    while (n->t == EXPR_PAREN || n->t == EXPR_SELECTOR)
+        n = n->t == EXPR_PAREN ? n->expr.paren.x : n->expr.selector.x;
+    return n->t == EXPR_CALL ? n : NULL;
+}
+
+/* The operand n can be used as, if it is simple. */
+static int simplify(const node_t *n, x64_operand_t *x)
+{
+    const node_t *type;
+
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    switch (n->t) {
+    case EXPR_BASIC:
+        *x = x64_imm(n->expr.basic.value);
+        return 1;
+    default:
+        if (!is_addressable(n))
+            return 0;
+        *x = slot_operand(place_of(NULL, n, &type));
+        if (struct_of(type))
+            PANIC("struct used as an int");
+        return 1;
+    }
+}
+
+static char *ident_string(node_t *n)
+{
+    return n->expr.ident.name;
+}
+
+static x64_operand_t counter_operand(int counter)
+{
+    return x64_rip(label("profile_counts_", file), 8 * counter, 8);
+}
+
+static void emit_count(x64_t *a, const node_t *n, int i)
+{
+    if (profile_path)
+        x64_op2(a, X64_ADD, x64_imm(1), counter_operand(profile_counter(profile, n) + i));
+}
+
+/* The counters and a function that writes them to profile_path, which main
+ * registers to run at exit. */
+static void emit_profile_dump(x64_t *a)
+{
+    x64_label_t header = label("profile_header_", file);
+    x64_label_t path = label("profile_path_", file);
+    x64_label_t mode = label("profile_mode_", file);
+    x64_label_t done = label("profile_done_", file);
+    x64_operand_t spill = x64_mem(X64_RSP, 0, 8);
+    unsigned char bytes[8] = PROFILE_MAGIC;
+
+    for (int i = 0; i < 4; ++i)
+        bytes[4 + i] = (unsigned)profile->num_counters >> (8 * i);
+    // the counters directly follow the header, as in the file
+    x64_data(a, header, bytes, sizeof(bytes));
+    x64_data(a, label("profile_counts_", file), NULL, 8 * profile->num_counters);
+    x64_data(a, path, profile_path, strlen(profile_path) + 1);
+    x64_data(a, mode, "wb", 3);
+
+    x64_label(a, label("profile_dump_", file));
+    x64_op2(a, X64_SUB, x64_imm(8), r64(X64_RSP));
+    x64_op2(a, X64_LEA, x64_rip(path, 0, 8), r64(X64_RDI));
+    x64_op2(a, X64_LEA, x64_rip(mode, 0, 8), r64(X64_RSI));
+    x64_call(a, "fopen", 1);
+    x64_op2(a, X64_CMP, x64_imm(0), r64(X64_RAX));
+    x64_jump(a, X64_JE, done);
+    x64_op2(a, X64_MOV, r64(X64_RAX), spill);
+    x64_op2(a, X64_LEA, x64_rip(header, 0, 8), r64(X64_RDI));
+    x64_op2(a, X64_MOV, x64_imm(1), r32(X64_RSI));
+    x64_op2(a, X64_MOV, x64_imm(8 + 8 * profile->num_counters), r32(X64_RDX));
+    x64_op2(a, X64_MOV, r64(X64_RAX), r64(X64_RCX));
+    x64_call(a, "fwrite", 1);
+    x64_op2(a, X64_MOV, spill, r64(X64_RDI));
+    x64_call(a, "fclose", 1);
+    x64_label(a, done);
+    x64_op2(a, X64_ADD, x64_imm(8), r64(X64_RSP));
+    x64_op0(a, X64_RET);
+}
+
+static int is_extern(const char *name)
+{
+    for (node_t **decls = file->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body
+                && !strcmp(ident_string((*decls)->decl.func.name), name))
+            return 0;
+    }
+    return 1;
+}
+
+/* dst op= src for the bitwise operators, which all have forms that work
+ * on memory. Shifts by a variable count take it in %cl. */
+static void emit_bitwise(x64_t *a, int op, x64_operand_t src, x64_operand_t dst)
+{
+    x64_operand_t ecx = r32(X64_RCX);
+
+    switch (op) {
+    case token_AND:
+        x64_op2(a, X64_AND, src, dst);
+        break;
+    case token_OR:
+        x64_op2(a, X64_OR, src, dst);
+        break;
+    case token_XOR:
+        x64_op2(a, X64_XOR, src, dst);
+        break;
+    case token_AND_NOT:
+        if (src.kind == X64_IMM) {
+            x64_op2(a, X64_AND, x64_imm(~src.disp), dst);
+            break;
+        }
+        x64_op2(a, X64_MOV, src, ecx);
+        x64_op1(a, X64_NOT, ecx);
+        x64_op2(a, X64_AND, ecx, dst);
+        break;
+    case token_SHL:
+    case token_SHR:
+        if (src.kind == X64_IMM) {
+            src = x64_imm(src.disp & 31);
+        } else {
+            x64_op2(a, X64_MOV, src, ecx);
+            src = x64_reg(X64_RCX, 1);
+        }
+        x64_op2(a, op == token_SHL ? X64_SHL : X64_SAR, src, dst);
+        break;
+    default:
+        PANIC("unknown bitwise op: `%s`", token_string(op));
+        break;
+    }
+}
+
+/* x op= y as a single instruction on x's slot where x64 has one, and as
+ * x = x op y otherwise. */
+static void emit_assign_op(x64_t *a, const node_t *n, x64_operand_t slot)
 {
-    int n = 1;
-    while (s) {
-        n += da_len(&s->list);
-        s = s->outer;
+    int op = ast_assign_op(n->stmt.assign.tok);
+    const node_t *rhs = n->stmt.assign.rhs;
+    x64_operand_t src;
+    node_t tmp;
+    int k;
+
+    switch (op) {
+    case token_ADD:
+    case token_SUB:
+    case token_AND:
+    case token_OR:
+    case token_XOR:
+    case token_AND_NOT:
+    case token_SHL:
+    case token_SHR:
+        if (ast_const_value(rhs, &k)) {
+            src = x64_imm(k);
+        } else if (!simplify(rhs, &src) || op == token_ADD || op == token_SUB
+                || op == token_AND || op == token_OR || op == token_XOR) {
+            // there's no memory to memory form
+            emit(a, rhs);
+            src = r32(X64_RAX);
+        }
+        if (op == token_ADD)
+            x64_op2(a, X64_ADD, src, slot);
+        else if (op == token_SUB)
+            x64_op2(a, X64_SUB, src, slot);
+        else
+            emit_bitwise(a, op, src, slot);
+        break;
+    default:
+        emit(a, ast_assign_value(n, &tmp));
+        x64_op2(a, X64_MOV, r32(X64_RAX), slot);
+        break;
+    }
+}
+
+/*
+ * Structs
+ *
+ * Structs are moved an eightbyte at a time through %rax, with a 4-byte move
+ * for the last word of a struct of an odd number of words.
+ */
+
+static int chunk_size(int size, int k)
+{
+    return size - k < 8 ? 4 : 8;
+}
+
+/* Point %rcx at dest if it's indirect. */
+static void load_dest(x64_t *a, dest_t dest)
+{
+    if (dest.indirect)
+        x64_op2(a, X64_MOV, frame_operand(dest.offset, 8), r64(X64_RCX));
+}
+
+static x64_operand_t dest_operand(dest_t dest, int k, int size)
+{
+    if (dest.indirect)
+        return x64_mem(X64_RCX, k, size);
+    return frame_operand(dest.offset + k, size);
+}
+
+static void copy_struct(x64_t *a, dest_t dest, int offset, int size)
+{
+    load_dest(a, dest);
+    for (int k = 0; k < size; k += 8) {
+        int c = chunk_size(size, k);
+        x64_op2(a, X64_MOV, frame_operand(offset + k, c), x64_reg(X64_RAX, c));
+        x64_op2(a, X64_MOV, x64_reg(X64_RAX, c), dest_operand(dest, k, c));
+    }
+}
+
+/* Store a struct returned in %rax and %rdx. */
+static void store_regs(x64_t *a, dest_t dest, int size)
+{
+    load_dest(a, dest);
+    for (int k = 0; k < size; k += 8) {
+        int c = chunk_size(size, k);
+        x64_op2(a, X64_MOV, x64_reg(k ? X64_RDX : X64_RAX, c), dest_operand(dest, k, c));
     }
-    return n;
 }
-#endif
 
-static int lookup(scope_t *s, const char *ident)
+/* Evaluate struct n into dest. A call stores its result there itself, so
+ * nothing is copied twice. */
+static void emit_struct(x64_t *a, const node_t *n, dest_t dest)
 {
-    int idx = 1;
-    while (s) {
-        for (int i = 1; i <= da_len(&s->list); ++i, ++idx) {
-            if (!strcmp(da_get_s(&s->list, -i), ident))
-                return 4 * (idx - 1);
+    const node_t *type;
+    int offset;
+
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    if (n->t == EXPR_CALL) {
+        emit_expr(a, n, &dest);
+        return;
+    }
+    offset = place_of(a, n, &type);
+    copy_struct(a, dest, offset, type_size(type));
+}
+
+/* Evaluate struct n of up to 16 bytes into %rax and %rdx. */
+static void emit_struct_regs(x64_t *a, const node_t *n)
+{
+    const node_t *type;
+    int offset;
+    int size;
+
+    while (n->t == EXPR_PAREN)
+        n = n->expr.paren.x;
+    if (n->t == EXPR_CALL) {
+        emit_expr(a, n, NULL);
+        return;
+    }
+    offset = place_of(a, n, &type);
+    size = type_size(type);
+    for (int k = 0; k < size; k += 8) {
+        int c = chunk_size(size, k);
+        x64_op2(a, X64_MOV, frame_operand(offset + k, c), x64_reg(k ? X64_RDX : X64_RAX, c));
+    }
+}
+
+/* A call being made. A struct it returns is stored at dest, or left in
+ * %rax and %rdx without one if it fits there; a bigger one is written by
+ * the callee straight to dest, or to the call's own slot without one. */
+typedef struct {
+    const node_t *n;
+    const char *name;
+    const x64_reg_t *regs;
+    const node_t *ret;
+    dest_t dest;
+    int has_dest;
+    int num_args;
+    x64_operand_t *ops; // of the int arguments not passed directly
+    const node_t **types;
+    arg_t *args;
+    int *places; // of the struct arguments
+    int *direct;
+    int stack;
+    int held;
+} call_t;
+
+static call_t *start_call(const node_t *n, const dest_t *dest)
+{
+    call_t *c = calloc(1, sizeof(*c));
+
+    c->n = n;
+    c->name = ident_string(n->expr.call.func);
+    c->regs = arg_regs_of(ast_find_func(file, c->name));
+    c->ret = return_type(n);
+    if (dest && !struct_of(c->ret))
+        PANIC("`%s` doesn't return a struct", c->name);
+    if ((c->has_dest = dest != NULL))
+        c->dest = *dest;
+    for (node_t **args = n->expr.call.args; args && *args; ++args)
+        c->num_args++;
+    c->ops = malloc((c->num_args + 1) * sizeof(*c->ops));
+    c->types = malloc((c->num_args + 1) * sizeof(*c->types));
+    c->args = malloc((c->num_args + 1) * sizeof(*c->args));
+    c->places = malloc((c->num_args + 1) * sizeof(*c->places));
+    c->direct = malloc((c->num_args + 1) * sizeof(*c->direct));
+    arg_types(n, c->num_args, c->types);
+    c->stack = classify(c->ret, c->num_args, c->types, c->args);
+    direct_args(n, c->num_args, c->direct);
+    return c;
+}
+
+/* Take the arguments of c from the i-th on that need nothing evaluated,
+ * and return the index of the first that does, or num_args. */
+static int simple_args(call_t *c, int i)
+{
+    for (; i < c->num_args; ++i) {
+        node_t *arg = c->n->expr.call.args[i];
+        if (struct_of(c->types[i])) {
+            if (base_call(arg))
+                return i;
+            c->places[i] = place_of(NULL, arg, &c->types[i]);
+        } else if (c->direct[i] || !simplify(arg, &c->ops[i])) {
+            return i;
         }
-        s = s->outer;
     }
-    return 0;
+    return i;
 }
 
-static char *simplify(const node_t *n, scope_t *s) {
-    char *ret = NULL;
-    switch (n->t) {
-    case EXPR_BASIC:
-        asprintf(&ret, "$%s", n->expr.basic.value);
+/* Take argument i of c once it's evaluated: an int into %eax, a struct
+ * call into its slot. */
+static void finish_arg(x64_t *a, call_t *c, int i)
+{
+    if (struct_of(c->types[i])) {
+        c->places[i] = place_of(NULL, c->n->expr.call.args[i], &c->types[i]);
+    } else if (c->direct[i]) {
+        x64_op2(a, X64_MOV, r32(X64_RAX), r32(c->regs[c->args[i].reg]));
+    } else {
+        c->ops[i] = hold(a);
+        c->held++;
+    }
+}
+
+/* Pass the arguments of c, make the call and free c. */
+static void end_call(x64_t *a, call_t *c)
+{
+    const dest_t *dest = c->has_dest ? &c->dest : NULL;
+    dest_t scratch = {0};
+
+    // keep %rsp 16-byte aligned across the call
+    int pad = c->stack / 8 % 2;
+    if (pad)
+        x64_op2(a, X64_SUB, x64_imm(8), r64(X64_RSP));
+    for (int i = c->num_args - 1; i >= 0; --i) {
+        if (c->args[i].reg >= 0)
+            continue;
+        if (!struct_of(c->types[i])) {
+            x64_op2(a, X64_MOV, c->ops[i], r32(X64_RAX));
+            x64_op1(a, X64_PUSH, r64(X64_RAX));
+            continue;
+        }
+        for (int k = (c->args[i].size - 1) / 8 * 8; k >= 0; k -= 8) {
+            int size = chunk_size(c->args[i].size, k);
+            x64_op2(a, X64_MOV, frame_operand(c->places[i] + k, size), x64_reg(X64_RAX, size));
+            x64_op1(a, X64_PUSH, r64(X64_RAX));
+        }
+    }
+    for (int i = 0; i < c->num_args; ++i) {
+        if (c->args[i].reg < 0 || c->direct[i])
+            continue;
+        if (!struct_of(c->types[i])) {
+            x64_op2(a, X64_MOV, c->ops[i], r32(c->regs[c->args[i].reg]));
+            continue;
+        }
+        for (int k = 0; k < c->args[i].size; k += 8) {
+            int size = chunk_size(c->args[i].size, k);
+            x64_op2(a, X64_MOV, frame_operand(c->places[i] + k, size),
+                    x64_reg(c->regs[c->args[i].reg + k / 8], size));
+        }
+    }
+    if (is_sret(c->ret)) {
+        if (!dest) {
+            scratch.offset = slot_of(c->n);
+            dest = &scratch;
+        }
+        if (dest->indirect)
+            x64_op2(a, X64_MOV, frame_operand(dest->offset, 8), r64(X64_RDI));
+        else
+            x64_op2(a, X64_LEA, frame_operand(dest->offset, 8), r64(X64_RDI));
+    }
+    frame.temps -= c->held;
+    emit_count(a, c->n, 0);
+    if (is_extern(c->name)) {
+        // variadic callees expect the number of vector args in %al
+        x64_op2(a, X64_MOV, x64_imm(0), r32(X64_RAX));
+        x64_call(a, c->name, 1);
+    } else {
+        x64_call(a, c->name, 0);
+    }
+    if (c->stack)
+        x64_op2(a, X64_ADD, x64_imm(c->stack + 8 * pad), r64(X64_RSP));
+    if (dest && !is_sret(c->ret))
+        store_regs(a, *dest, type_size(c->ret));
+    free(c->ops);
+    free(c->types);
+    free(c->args);
+    free(c->places);
+    free(c->direct);
+    free(c);
+}
+
+/* %eax = %eax op rhs */
+static void emit_binary_op(x64_t *a, int op, x64_operand_t rhs)
+{
+    x64_operand_t eax = r32(X64_RAX);
+    x64_operand_t ecx = r32(X64_RCX);
+
+    switch (op) {
+    case token_EQL:
+    case token_GEQ:
+    case token_GTR:
+    case token_LEQ:
+    case token_LSS:
+    case token_NEQ:
+        x64_op2(a, X64_CMP, rhs, eax);
+        x64_op2(a, X64_MOV, x64_imm(0), eax);
         break;
-    case EXPR_IDENT:
-        asprintf(&ret, "%d(%%esp)", lookup(s, n->expr.ident.name));
+    default:
+        break;
+    }
+    switch (op) {
+    case token_ADD:
+        x64_op2(a, X64_ADD, rhs, eax);
+        break;
+    case token_SUB:
+        x64_op2(a, X64_SUB, rhs, eax);
+        break;
+    case token_MUL:
+        x64_op2(a, X64_IMUL, rhs, eax);
+        break;
+    case token_QUO:
+    case token_REM:
+        x64_op2(a, X64_MOV, rhs, ecx);
+        x64_op0(a, X64_CLTD);
+        x64_op1(a, X64_IDIV, ecx);
+        if (op == token_REM)
+            x64_op2(a, X64_MOV, r32(X64_RDX), eax);
+        break;
+    case token_EQL:
+        x64_op1(a, X64_SETE, x64_reg(X64_RAX, 1));
+        break;
+    case token_GEQ:
+        x64_op1(a, X64_SETGE, x64_reg(X64_RAX, 1));
+        break;
+    case token_GTR:
+        x64_op1(a, X64_SETG, x64_reg(X64_RAX, 1));
+        break;
+    case token_LEQ:
+        x64_op1(a, X64_SETLE, x64_reg(X64_RAX, 1));
+        break;
+    case token_LSS:
+        x64_op1(a, X64_SETL, x64_reg(X64_RAX, 1));
+        break;
+    case token_NEQ:
+        x64_op1(a, X64_SETNE, x64_reg(X64_RAX, 1));
+        break;
+    case token_LAND:
+        x64_op2(a, X64_MOV, rhs, ecx);
+        x64_op2(a, X64_CMP, x64_imm(0), ecx);
+        x64_op1(a, X64_SETNE, x64_reg(X64_RCX, 1));
+        x64_op2(a, X64_CMP, x64_imm(0), eax);
+        x64_op2(a, X64_MOV, x64_imm(0), eax);
+        x64_op1(a, X64_SETNE, x64_reg(X64_RAX, 1));
+        x64_op2(a, X64_AND, x64_reg(X64_RCX, 1), x64_reg(X64_RAX, 1));
+        break;
+    case token_LOR:
+        x64_op2(a, X64_OR, rhs, eax);
+        x64_op2(a, X64_MOV, x64_imm(0), eax);
+        x64_op1(a, X64_SETNE, x64_reg(X64_RAX, 1));
+        break;
+    case token_AND:
+    case token_OR:
+    case token_XOR:
+    case token_AND_NOT:
+    case token_SHL:
+    case token_SHR:
+        emit_bitwise(a, op, rhs, eax);
         break;
     default:
+        PANIC("unknown binary op: `%s`", token_string(op));
         break;
     }
-    return ret;
 }
 
-static char *ident_string(node_t *n)
+/* %eax = op %eax */
+static void emit_unary_op(x64_t *a, int op)
 {
-    return n->expr.ident.name;
+    x64_operand_t eax = r32(X64_RAX);
+
+    switch (op) {
+    case token_SUB:
+        x64_op1(a, X64_NEG, eax);
+        break;
+    case token_BITWISE_NOT:
+        x64_op1(a, X64_NOT, eax);
+        break;
+    case token_NOT:
+        x64_op2(a, X64_CMP, x64_imm(0), eax);
+        x64_op2(a, X64_MOV, x64_imm(0), eax);
+        x64_op1(a, X64_SETE, x64_reg(X64_RAX, 1));
+        break;
+    default:
+        PANIC("unknown unary op: `%s`", token_string(op));
+        break;
+    }
+}
+
+/* An expression being evaluated, and how far along it is. */
+typedef struct {
+    const node_t *n;
+    enum {
+        EVAL_START,
+        EVAL_HOLD, // the right operand is in %eax
+        EVAL_APPLY, // the operands are in %eax and rhs
+        EVAL_APPLY_CONST, // the reduced operand is in %eax
+    } state;
+    int held;
+    int k;
+    x64_operand_t rhs;
+    dest_t dest; // of a call, if has_dest
+    int has_dest;
+    call_t *call;
+    int arg; // of the call, being evaluated
+} eval_t;
+
+static void push_eval(ast_stack_t *s, const node_t *n)
+{
+    *(eval_t *)ast_stack_push(s) = (eval_t){.n = n};
+}
+
+/* Push struct call n, to be stored in its own slot. */
+static void push_call(ast_stack_t *s, const node_t *n)
+{
+    *(eval_t *)ast_stack_push(s) = (eval_t){
+        .n = n,
+        .dest = {.offset = slot_of(n)},
+        .has_dest = 1,
+    };
+}
+
+/* Evaluate expression n into %eax, or call n with a struct result as
+ * call_t describes for dest. Operators and arguments are evaluated from a
+ * stack of their own rather than by recursing, so nesting costs heap
+ * instead of C stack. */
+static void emit_expr(x64_t *a, const node_t *n, const dest_t *dest)
+{
+    x64_operand_t eax = r32(X64_RAX);
+    const node_t *call;
+    ast_stack_t s;
+    eval_t *e;
+
+    ast_stack_init(&s, sizeof(eval_t));
+    push_eval(&s, n);
+    if (dest) {
+        e = ast_stack_top(&s);
+        e->dest = *dest;
+        e->has_dest = 1;
+    }
+    while ((e = ast_stack_top(&s))) {
+        n = e->n;
+        switch (n->t) {
+        case EXPR_BINARY:
+            if (e->state == EVAL_START) {
+                const node_t *x = reduced_operand(n, &e->k);
+                if (x) {
+                    e->state = EVAL_APPLY_CONST;
+                    push_eval(&s, x);
+                } else if ((e->held = !simplify(n->expr.binary.y, &e->rhs))) {
+                    e->state = EVAL_HOLD;
+                    push_eval(&s, n->expr.binary.y);
+                } else {
+                    e->state = EVAL_APPLY;
+                    push_eval(&s, n->expr.binary.x);
+                }
+            } else if (e->state == EVAL_HOLD) {
+                e->rhs = hold(a);
+                e->state = EVAL_APPLY;
+                push_eval(&s, n->expr.binary.x);
+            } else {
+                if (e->state == EVAL_APPLY_CONST) {
+                    emit_const_op(a, n->expr.binary.op, e->k);
+                } else {
+                    emit_binary_op(a, n->expr.binary.op, e->rhs);
+                    if (e->held)
+                        release();
+                }
+                ast_stack_pop(&s);
+            }
+            break;
+
+        case EXPR_PAREN:
+            e->n = n->expr.paren.x;
+            break;
+
+        case EXPR_UNARY:
+            if (e->state == EVAL_START) {
+                e->state = EVAL_APPLY;
+                push_eval(&s, n->expr.unary.expr);
+            } else {
+                emit_unary_op(a, n->expr.unary.op);
+                ast_stack_pop(&s);
+            }
+            break;
+
+        case EXPR_BASIC:
+        case EXPR_IDENT:
+            do {
+                x64_operand_t value;
+                simplify(n, &value);
+                x64_op2(a, X64_MOV, value, eax);
+            } while (0);
+            ast_stack_pop(&s);
+            break;
+
+        case EXPR_CALL:
+            if (e->state == EVAL_START) {
+                e->call = start_call(n, e->has_dest ? &e->dest : NULL);
+                e->state = EVAL_APPLY;
+            } else {
+                finish_arg(a, e->call, e->arg++);
+            }
+            e->arg = simple_args(e->call, e->arg);
+            if (e->arg < e->call->num_args) {
+                const node_t *arg = n->expr.call.args[e->arg];
+                if (struct_of(e->call->types[e->arg]))
+                    push_call(&s, base_call(arg));
+                else
+                    push_eval(&s, arg);
+                break;
+            }
+            end_call(a, e->call);
+            ast_stack_pop(&s);
+            break;
+
+        case EXPR_SELECTOR:
+            if (e->state == EVAL_START && (call = base_call(n))) {
+                e->state = EVAL_APPLY;
+                push_call(&s, call);
+                break;
+            }
+            do {
+                const node_t *type;
+                x64_operand_t value = slot_operand(place_of(NULL, n, &type));
+                if (struct_of(type))
+                    PANIC("struct used as an int");
+                x64_op2(a, X64_MOV, value, eax);
+            } while (0);
+            ast_stack_pop(&s);
+            break;
+
+        default:
+            ast_stack_pop(&s);
+            break;
+        }
+    }
+    ast_stack_deinit(&s);
+}
+
+/* A case value and the clause it selects. */
+typedef struct {
+    int value;
+    const node_t *expr; // whose identity names the search's labels
+    const node_t *clause;
+} case_t;
+
+static int compare_cases(const void *l, const void *r)
+{
+    const case_t *x = l;
+    const case_t *y = r;
+    return (x->value > y->value) - (x->value < y->value);
+}
+
+static int is_dense(const case_t *cases, int n)
+{
+    return n >= MIN_TABLE_CASES
+        && (int64_t)cases[n - 1].value - cases[0].value < (int64_t)MAX_TABLE_SPREAD * n;
+}
+
+/* Jump through a table of the clauses of the sorted cases, indexed by the
+ * tag in %eax less the first value. Values in between go to def, and so do
+ * ones out of range, which the unsigned compare catches on both sides. */
+static void emit_table(x64_t *a, const case_t *cases, int n, x64_label_t def)
+{
+    int len = cases[n - 1].value - cases[0].value + 1;
+    x64_label_t table = label("switch_TABLE_", cases[0].expr);
+    x64_label_t *targets = malloc(len * sizeof(*targets));
+
+    for (int i = 0; i < len; ++i)
+        targets[i] = def;
+    for (int i = 0; i < n; ++i)
+        targets[cases[i].value - cases[0].value] = label("case_", cases[i].clause);
+    if (cases[0].value)
+        x64_op2(a, X64_SUB, x64_imm(cases[0].value), r32(X64_RAX));
+    x64_op2(a, X64_CMP, x64_imm(len - 1), r32(X64_RAX));
+    x64_jump(a, X64_JA, def);
+    x64_op2(a, X64_LEA, x64_rip(table, 0, 8), r64(X64_RDX));
+    x64_op2(a, X64_MOVSLQ, x64_sib(X64_RDX, X64_RAX, 4, 4), r64(X64_RAX));
+    x64_op2(a, X64_ADD, r64(X64_RDX), r64(X64_RAX));
+    x64_op1(a, X64_JMP, r64(X64_RAX));
+    x64_table(a, table, targets, len);
+    free(targets);
 }
 
-static void push(crawler_t *c, scope_t *s, const char *val, char *var)
+/* Jump to the clause of the sorted case the tag in %eax matches, or to
+ * def. Dense runs of cases that the search narrows down to get a table. */
+static void emit_search(x64_t *a, const case_t *cases, int n, x64_label_t def)
 {
-    fprintf(c->fp, "\tpushl %s\n", val);
-    da_append_s(&s->list, var = var ? var : "");
+    x64_label_t low;
+    int mid;
+
+    if (is_dense(cases, n)) {
+        emit_table(a, cases, n, def);
+        return;
+    }
+    if (n <= MAX_LINEAR_CASES) {
+        for (int i = 0; i < n; ++i) {
+            x64_op2(a, X64_CMP, x64_imm(cases[i].value), r32(X64_RAX));
+            x64_jump(a, X64_JE, label("case_", cases[i].clause));
+        }
+        x64_jump(a, X64_JMP, def);
+        return;
+    }
+    mid = n / 2;
+    low = label("switch_LOW_", cases[mid].expr);
+    x64_op2(a, X64_CMP, x64_imm(cases[mid].value), r32(X64_RAX));
+    x64_jump(a, X64_JL, low);
+    x64_jump(a, X64_JE, label("case_", cases[mid].clause));
+    emit_search(a, cases + mid + 1, n - mid - 1, def);
+    x64_label(a, low);
+    emit_search(a, cases, mid, def);
 }
 
-static void pop(crawler_t *c, scope_t *s, const char *val)
+/* Evaluate a switch's tag and jump to the clause it selects. */
+static void emit_dispatch(x64_t *a, const node_t *n)
 {
-    fprintf(c->fp, "\tpopl %s\n", val);
-    free(da_pop_s(&s->list));
+    x64_label_t def = label("switch_END_", n);
+    da_t cases;
+
+    da_init(&cases, sizeof(case_t));
+    for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+        node_t **exprs = (*clauses)->stmt.case_.exprs;
+        if (!exprs)
+            def = label("case_", *clauses);
+        for (; exprs && *exprs; ++exprs) {
+            case_t c = {
+                .value = (*exprs)->expr.basic.value,
+                .expr = *exprs,
+                .clause = *clauses,
+            };
+            da_append(&cases, &c);
+        }
+    }
+    if (da_len(&cases))
+        qsort(cases.data, da_len(&cases), sizeof(case_t), compare_cases);
+    emit_expr(a, n->stmt.switch_.tag, NULL);
+    emit_search(a, cases.data, da_len(&cases), def);
+    da_deinit(&cases);
 }
 
-static void emit(crawler_t *c, const node_t *n)
+static void emit(x64_t *a, const node_t *n)
 {
     static const node_t *func_node = NULL;
-    static const node_t *loop_node = NULL;
-    static scope_t *top_scope = NULL;
+    static const node_t *loop_node = NULL; // what continue continues
+    static const node_t *break_node = NULL; // a loop or a switch
     static int num_rets = 0;
+    x64_operand_t eax = r32(X64_RAX);
 
     assert(n);
 
@@ -91,237 +1719,144 @@ static void emit(crawler_t *c, const node_t *n)
 
     case DECL_FUNC:
         if (n->decl.func.body) {
-            fprintf(c->fp, ".globl %s%s\n", pre, ident_string(n->decl.func.name));
-            top_scope = ast_new_scope(NULL);
-            for (node_t **params = n->decl.func.params; params && *params; ++params) {
-                node_t *param = *params;
-                da_append_s(&top_scope->list, ident_string(param->expr.field.name));
+            node_t **params = n->decl.func.params;
+            const x64_reg_t *regs = arg_regs_of(n);
+            arg_t args[count_params(n) + 1];
+            layout_func(n);
+            classify_params(n, args);
+            for (int i = 0; params && params[i]; ++i) {
+                bind(ident_string(params[i]->expr.field.name),
+                        args[i].reg >= 0 ? slot_of(params[i]) : 16 + args[i].offset,
+                        params[i]->expr.field.type);
+            }
+            if (is_private(n))
+                x64_local(a, ident_string(n->decl.func.name));
+            else
+                x64_global(a, ident_string(n->decl.func.name));
+            if (frame.has_frame) {
+                int saved = 8 * frame.num_saved;
+                int size = (saved + frame.size + 15) / 16 * 16 - saved;
+                x64_op1(a, X64_PUSH, r64(X64_RBP));
+                x64_op2(a, X64_MOV, r64(X64_RSP), r64(X64_RBP));
+                for (int i = 0; i < frame.num_saved; ++i)
+                    x64_op1(a, X64_PUSH, r64(saved_regs[i]));
+                if (size)
+                    x64_op2(a, X64_SUB, x64_imm(size), r64(X64_RSP));
+            }
+            if (is_sret(n->decl.func.type))
+                x64_op2(a, X64_MOV, r64(X64_RDI), frame_operand(slot_of(n), 8));
+            for (int i = 0; params && params[i]; ++i) {
+                for (int k = 0; args[i].reg >= 0 && k < args[i].size; k += 8) {
+                    int c = chunk_size(args[i].size, k);
+                    x64_op2(a, X64_MOV, x64_reg(regs[args[i].reg + k / 8], c),
+                            frame_operand(slot_of(params[i]) + k, c));
+                }
+            }
+            if (profile_path && !strcmp(ident_string(n->decl.func.name), "main")) {
+                // atexit itself isn't exported by glibc's libc.so
+                x64_op2(a, X64_LEA, x64_rip(label("profile_dump_", file), 0, 8),
+                        r64(X64_RDI));
+                x64_op2(a, X64_MOV, x64_imm(0), r32(X64_RSI));
+                x64_op2(a, X64_MOV, x64_imm(0), r32(X64_RDX));
+                x64_call(a, "__cxa_atexit", 1);
             }
-            da_append_s(&top_scope->list, ""); // return address
-            fprintf(c->fp, "%s%s:\n", pre, ident_string(n->decl.func.name));
-            push(c, top_scope, "%ebp", NULL);
-            fprintf(c->fp, "\tmovl %%esp, %%ebp\n");
             num_rets = 0;
             for (const node_t *tmp = func_node;;) {
                 func_node = n;
-                emit(c, n->decl.func.body);
+                emit(a, n->decl.func.body);
                 func_node = tmp;
                 break;
             }
             if (!num_rets)
-                fprintf(c->fp, "\tmovl $0, %%eax\n");
-            fprintf(c->fp, "ret_%p:\n", n);
-            fprintf(c->fp, "\tmovl %%ebp, %%esp\n");
-            pop(c, top_scope, "%ebp");
-            fprintf(c->fp, "\tret\n");
-            da_deinit(&top_scope->list);
-            top_scope = NULL;
-        }
-        break;
-
-    case DECL_VAR:
-        if (n->decl.var.value) {
-            char *lit = simplify(n->decl.var.value, top_scope);
-            if (lit) {
-                push(c, top_scope, lit, ident_string(n->decl.var.name));
-                free(lit);
-            } else {
-                emit(c, n->decl.var.value);
-                push(c, top_scope, eax, ident_string(n->decl.var.name));
+                x64_op2(a, X64_MOV, x64_imm(0), eax);
+            x64_label(a, label("ret_", n));
+            if (frame.has_frame) {
+                for (int i = frame.num_saved - 1; i >= 0; --i)
+                    x64_op2(a, X64_MOV, x64_mem(X64_RBP, -8 * (i + 1), 8),
+                            r64(saved_regs[i]));
+                x64_op2(a, X64_MOV, r64(X64_RBP), r64(X64_RSP));
+                x64_op1(a, X64_POP, r64(X64_RBP));
             }
-        } else {
-            da_append_s(&top_scope->list, ident_string(n->decl.var.name));
-            fprintf(c->fp, "\tsubl $4, %%esp\n");
+            x64_op0(a, X64_RET);
+            unbind(NULL);
+            da_deinit(&frame.slots);
         }
         break;
 
-    case EXPR_BASIC:
-        fprintf(c->fp, "\tmovl $%s, %%eax\n", n->expr.basic.value);
-        break;
-
-    case EXPR_BINARY:
+    case DECL_VAR:
         do {
-            char *rhs = simplify(n->expr.binary.y, top_scope);
-            if (rhs) {
-                emit(c, n->expr.binary.x);
+            x64_operand_t slot = slot_operand(slot_of(n));
+            if (struct_of(n->decl.var.type)) {
+                if (n->decl.var.value)
+                    emit_struct(a, n->decl.var.value, (dest_t){.offset = slot_of(n)});
+            } else if (!n->decl.var.value) {
+                // no initializer, the slot keeps whatever it held
+            } else if (n->decl.var.value->t == EXPR_BASIC) {
+                x64_operand_t value;
+                simplify(n->decl.var.value, &value);
+                x64_op2(a, X64_MOV, value, slot);
             } else {
-                asprintf(&rhs, "%s", ecx);
-                emit(c, n->expr.binary.y);
-                push(c, top_scope, eax, NULL);
-                emit(c, n->expr.binary.x);
-                pop(c, top_scope, ecx);
-            }
-            switch (n->expr.binary.op) {
-            case token_EQL:
-            case token_GEQ:
-            case token_GTR:
-            case token_LEQ:
-            case token_LSS:
-            case token_NEQ:
-                fprintf(c->fp, "\tcmpl %s, %s\n", rhs, eax);
-                fprintf(c->fp, "\tmovl $0, %%eax\n");
-                break;
-            default:
-                break;
-            }
-            switch (n->expr.binary.op) {
-            case token_ADD:
-                fprintf(c->fp, "\taddl %s, %s\n", rhs, eax);
-                break;
-            case token_SUB:
-                fprintf(c->fp, "\tsubl %s, %s\n", rhs, eax);
-                break;
-            case token_MUL:
-                fprintf(c->fp, "\timul %s, %s\n", rhs, eax);
-                break;
-            case token_QUO:
-            case token_REM:
-                fprintf(c->fp, "\tmovl %s, %s\n", rhs, ecx);
-                fprintf(c->fp, "\tmovl $0, %%edx\n");
-                fprintf(c->fp, "\tidivl %s\n", ecx);
-                if (n->expr.binary.op == token_REM)
-                    fprintf(c->fp, "\tmovl %%edx, %%eax\n");
-                break;
-            case token_EQL:
-                fprintf(c->fp, "\tsete %%al\n");
-                break;
-            case token_GEQ:
-                fprintf(c->fp, "\tsetge %%al\n");
-                break;
-            case token_GTR:
-                fprintf(c->fp, "\tsetg %%al\n");
-                break;
-            case token_LEQ:
-                fprintf(c->fp, "\tsetle %%al\n");
-                break;
-            case token_LSS:
-                fprintf(c->fp, "\tsetl %%al\n");
-                break;
-            case token_NEQ:
-                fprintf(c->fp, "\tsetne %%al\n");
-                break;
-            case token_LAND:
-                fprintf(c->fp, "\tmovl %s, %s\n", rhs, ecx);
-                fprintf(c->fp, "\tcmpl $0, %s\n", ecx);
-                fprintf(c->fp, "\tsetne %%cl\n");
-                fprintf(c->fp, "\tcmpl $0, %s\n", eax);
-                fprintf(c->fp, "\tmovl $0, %%eax\n");
-                fprintf(c->fp, "\tsetne %%al\n");
-                fprintf(c->fp, "\tandb %%cl, %%al\n");
-                break;
-            case token_LOR:
-                fprintf(c->fp, "\torl %s, %s\n", rhs, eax);
-                fprintf(c->fp, "\tmovl $0, %%eax\n");
-                fprintf(c->fp, "\tsetne %%al\n");
-                break;
-            default:
-                fprintf(c->fp, "\t# error: unknown binary op: `%s`;\n",
-                        token_string(n->expr.binary.op));
-                break;
+                emit(a, n->decl.var.value);
+                x64_op2(a, X64_MOV, eax, slot);
             }
-            free(rhs);
+            bind(ident_string(n->decl.var.name), slot_of(n), n->decl.var.type);
         } while (0);
         break;
 
+    case EXPR_BASIC:
+    case EXPR_BINARY:
     case EXPR_CALL:
-        do {
-            top_scope = ast_new_scope(top_scope);
-#ifdef __APPLE__
-            int num_args = 0;
-            for (node_t **args = n->expr.call.args; args && *args; ++args)
-                num_args += 1;
-            int len = scope_len(top_scope) + num_args + 1;
-            int pad = len % 4;
-            if (pad) {
-                fprintf(c->fp, "\tsubl $%d, %%esp # pad\n", 4 * pad);
-                for (int i = 0; i < pad; ++i)
-                    da_append_s(&top_scope->list, "");
-            }
-#endif
-            for (node_t **args = n->expr.call.args; args && *args; ++args) {
-                char *lit = simplify(*args, top_scope);
-                if (lit) {
-                    push(c, top_scope, lit, NULL);
-                    free(lit);
-                } else {
-                    emit(c, *args);
-                    push(c, top_scope, eax, NULL);
-                }
-            }
-            fprintf(c->fp, "\tcall %s%s\n", pre,
-                    ident_string(n->expr.call.func));
-            if (da_len(&top_scope->list))
-                fprintf(c->fp, "\taddl $%d, %%esp\n",
-                        4 * da_len(&top_scope->list));
-            da_deinit(&top_scope->list);
-            top_scope = top_scope->outer;
-        } while (0);
-        break;
-
     case EXPR_IDENT:
-        fprintf(c->fp, "\tmovl %d(%%esp), %%eax\n",
-                lookup(top_scope, n->expr.ident.name));
-        break;
-
     case EXPR_PAREN:
-        emit(c, n->expr.paren.x);
-        break;
-
+    case EXPR_SELECTOR:
     case EXPR_STRUCT:
-        break;
-
     case EXPR_UNARY:
-        emit(c, n->expr.unary.expr);
-        switch (n->expr.unary.op) {
-        case token_SUB:
-            fprintf(c->fp, "\tneg %%eax\n");
-            break;
-        case token_BITWISE_NOT:
-            fprintf(c->fp, "\tnot %%eax\n");
-            break;
-        case token_NOT:
-            fprintf(c->fp, "\tcmpl $0, %%eax\n");
-            fprintf(c->fp, "\tmovl $0, %%eax\n");
-            fprintf(c->fp, "\tsete %%al\n");
-            break;
-        default:
-            fprintf(c->fp, "\t# unknown op `%s` #\n",
-                    token_string(n->expr.unary.op));
-            break;
-        }
+        emit_expr(a, n, NULL);
         break;
 
     case STMT_ASSIGN:
-        if (n->stmt.assign.rhs->t == EXPR_BASIC) {
-            char *rhs = NULL;
-            rhs = simplify(n->stmt.assign.rhs, top_scope);
-            fprintf(c->fp, "\tmovl %s, %d(%%esp)\n", rhs,
-                    lookup(top_scope, ident_string(n->stmt.assign.lhs)));
-            free(rhs);
-        } else {
-            emit(c, n->stmt.assign.rhs);
-            fprintf(c->fp, "\tmovl %%eax, %d(%%esp)\n",
-                    lookup(top_scope, ident_string(n->stmt.assign.lhs)));
-        }
+        do {
+            const node_t *type;
+            x64_operand_t slot;
+            int offset;
+            if (!is_addressable(n->stmt.assign.lhs))
+                PANIC("cannot assign to a field of a temporary");
+            offset = place_of(NULL, n->stmt.assign.lhs, &type);
+            slot = slot_operand(offset);
+            if (struct_of(type)) {
+                if (ast_assign_op(n->stmt.assign.tok))
+                    PANIC("`%s` on a struct", token_string(n->stmt.assign.tok));
+                emit_struct(a, n->stmt.assign.rhs, (dest_t){.offset = offset});
+            } else if (ast_assign_op(n->stmt.assign.tok)) {
+                emit_assign_op(a, n, slot);
+            } else if (n->stmt.assign.rhs->t == EXPR_BASIC) {
+                x64_operand_t value;
+                simplify(n->stmt.assign.rhs, &value);
+                x64_op2(a, X64_MOV, value, slot);
+            } else {
+                emit(a, n->stmt.assign.rhs);
+                x64_op2(a, X64_MOV, eax, slot);
+            }
+        } while (0);
         break;
 
     case STMT_BLOCK:
-        top_scope = ast_new_scope(top_scope);
-        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
-            emit(c, *stmts);
-        if (da_len(&top_scope->list))
-            fprintf(c->fp, "\taddl $%d, %%esp\n", 4 * da_len(&top_scope->list));
-        da_deinit(&top_scope->list);
-        top_scope = top_scope->outer;
+        for (binding_t *mark = bindings;;) {
+            for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+                emit(a, *stmts);
+            unbind(mark);
+            break;
+        }
         break;
 
     case STMT_BRANCH:
         switch (n->stmt.branch.tok) {
         case token_BREAK:
-            fprintf(c->fp, "\tjmp loop_END_%p\n", loop_node);
+            x64_jump(a, X64_JMP, label(break_node->t == STMT_SWITCH ? "switch_END_"
+                        : "loop_END_", break_node));
             break;
         case token_CONTINUE:
-            fprintf(c->fp, "\tjmp loop_POST_%p\n", loop_node);
+            x64_jump(a, X64_JMP, label("loop_POST_", loop_node));
             break;
         default:
             break;
@@ -329,79 +1864,178 @@ static void emit(crawler_t *c, const node_t *n)
         break;
 
     case STMT_DECL:
-        emit(c, n->stmt.decl.decl);
+        emit(a, n->stmt.decl.decl);
         break;
 
     case STMT_EMPTY:
         break;
 
     case STMT_EXPR:
-        emit(c, n->stmt.decl.decl);
+        emit(a, n->stmt.decl.decl);
         break;
 
     case STMT_FOR:
-        top_scope = ast_new_scope(top_scope);
-        if (n->stmt.for_.init)
-            emit(c, n->stmt.for_.init);
-        fprintf(c->fp, "loop_START_%p:\n", n);
-        if (n->stmt.for_.cond) {
-            emit(c, n->stmt.for_.cond);
-            fprintf(c->fp, "\tcmpl $0, %%eax\n");
-            fprintf(c->fp, "\tje loop_END_%p\n", n);
-        }
-        for (const node_t *tmp = loop_node;;) {
-            loop_node = n;
-            emit(c, n->stmt.for_.body);
-            loop_node = tmp;
+        for (binding_t *mark = bindings;;) {
+            int v;
+            if (n->stmt.for_.init)
+                emit(a, n->stmt.for_.init);
+            // the condition is tested once on the way in and then at the
+            // bottom, so an iteration takes one branch instead of two
+            if (n->stmt.for_.cond && !(ast_const_value(n->stmt.for_.cond, &v) && v)) {
+                emit(a, n->stmt.for_.cond);
+                x64_op2(a, X64_CMP, x64_imm(0), eax);
+                x64_jump(a, X64_JE, label("loop_END_", n));
+            }
+            x64_label(a, label("loop_START_", n));
+            for (const node_t *tmp = loop_node, *tmp_break = break_node;;) {
+                loop_node = break_node = n;
+                emit(a, n->stmt.for_.body);
+                loop_node = tmp;
+                break_node = tmp_break;
+                break;
+            }
+            x64_label(a, label("loop_POST_", n));
+            if (n->stmt.for_.post)
+                emit(a, n->stmt.for_.post);
+            emit_count(a, n, 0);
+            if (n->stmt.for_.cond) {
+                emit(a, n->stmt.for_.cond);
+                x64_op2(a, X64_CMP, x64_imm(0), eax);
+                x64_jump(a, X64_JNE, label("loop_START_", n));
+            } else {
+                x64_jump(a, X64_JMP, label("loop_START_", n));
+            }
+            x64_label(a, label("loop_END_", n));
+            unbind(mark);
             break;
         }
-        fprintf(c->fp, "loop_POST_%p:\n", n);
-        if (n->stmt.for_.post)
-            emit(c, n->stmt.for_.post);
-        fprintf(c->fp, "\tjmp loop_START_%p\n", n);
-        fprintf(c->fp, "loop_END_%p:\n", n);
-        fprintf(c->fp, "\taddl $%d, %%esp\n", 4 * da_len(&top_scope->list));
-        da_deinit(&top_scope->list);
-        top_scope = top_scope->outer;
         break;
 
     case STMT_IF:
-        emit(c, n->stmt.if_.cond);
-        fprintf(c->fp, "\tcmpl $0, %%eax\n");
-        if (n->stmt.if_.else_)
-            fprintf(c->fp, "\tje if_else_%p\n", n);
-        else
-            fprintf(c->fp, "\tje if_end_%p\n", n);
-        emit(c, n->stmt.if_.body);
-        if (n->stmt.if_.else_) {
-            fprintf(c->fp, "\tjmp if_end_%p\n", n);
-            fprintf(c->fp, "if_else_%p:\n", n);
-            emit(c, n->stmt.if_.else_);
+        emit(a, n->stmt.if_.cond);
+        x64_op2(a, X64_CMP, x64_imm(0), eax);
+        if (n->stmt.if_.else_ && profile
+                && profile_count(profile, n, 1) > profile_count(profile, n, 0)) {
+            // the else arm is hotter, so it gets to fall through
+            x64_jump(a, X64_JNE, label("if_then_", n));
+            emit(a, n->stmt.if_.else_);
+            x64_jump(a, X64_JMP, label("if_end_", n));
+            x64_label(a, label("if_then_", n));
+            emit(a, n->stmt.if_.body);
+        } else if (n->stmt.if_.else_ || profile_path) {
+            x64_jump(a, X64_JE, label("if_else_", n));
+            emit_count(a, n, 0);
+            emit(a, n->stmt.if_.body);
+            x64_jump(a, X64_JMP, label("if_end_", n));
+            x64_label(a, label("if_else_", n));
+            emit_count(a, n, 1);
+            if (n->stmt.if_.else_)
+                emit(a, n->stmt.if_.else_);
+        } else {
+            x64_jump(a, X64_JE, label("if_end_", n));
+            emit(a, n->stmt.if_.body);
         }
-        fprintf(c->fp, "if_end_%p:\n", n);
+        x64_label(a, label("if_end_", n));
         break;
 
     case STMT_RETURN:
-        if (n->stmt.return_.expr)
-            emit(c, n->stmt.return_.expr);
-        fprintf(c->fp, "\tjmp ret_%p\n", func_node);
+        if (!n->stmt.return_.expr) {
+            // nothing to return
+        } else if (is_sret(func_node->decl.func.type)) {
+            // return the pointer we were given, as the caller may expect
+            emit_struct(a, n->stmt.return_.expr,
+                    (dest_t){.offset = slot_of(func_node), .indirect = 1});
+            x64_op2(a, X64_MOV, frame_operand(slot_of(func_node), 8), r64(X64_RAX));
+        } else if (struct_of(func_node->decl.func.type)) {
+            emit_struct_regs(a, n->stmt.return_.expr);
+        } else {
+            emit(a, n->stmt.return_.expr);
+        }
+        x64_jump(a, X64_JMP, label("ret_", func_node));
         num_rets++;
         break;
 
+    case STMT_SWITCH:
+        emit_dispatch(a, n);
+        for (const node_t *tmp = break_node;;) {
+            break_node = n;
+            for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+                emit(a, *clauses);
+                // the next clause follows, so falling through takes no jump
+                if (clauses[1] && !ast_falls_through(*clauses))
+                    x64_jump(a, X64_JMP, label("switch_END_", n));
+            }
+            break_node = tmp;
+            break;
+        }
+        x64_label(a, label("switch_END_", n));
+        break;
+
+    case STMT_CASE:
+        x64_label(a, label("case_", n));
+        for (binding_t *mark = bindings;;) {
+            for (node_t **stmts = n->stmt.case_.stmts; *stmts; ++stmts)
+                emit(a, *stmts);
+            unbind(mark);
+            break;
+        }
+        break;
+
         /* XXX: no default clause, we want warnings for unhandled ndoe types */
     }
 }
 
-extern void emit_x64(crawler_t *c, const file_t *f)
+static void emit_file(crawler_t *c, x64_t *a, const file_t *f)
 {
+    file = f;
+    profile = c->profile;
+    profile_path = profile ? c->profile_generate : NULL;
+    x64_begin(a);
     for (node_t **decls = f->decls; decls && *decls; ++decls) {
         switch ((*decls)->t) {
         case DECL_FUNC:
-            emit(c, *decls);
+            TRACE_BEGIN(TRACE_EMIT, ident_string((*decls)->decl.func.name));
+            emit(a, *decls);
+            TRACE_END();
+            break;
+        case DECL_TYPE:
             break;
         default:
-            PANIC("only func decls are supported at the top level");
+            PANIC("only func and type decls are supported at the top level");
             break;
         }
     }
+    if (profile_path)
+        emit_profile_dump(a);
+    x64_end(a);
+}
+
+extern void emit_x64(crawler_t *c, const file_t *f)
+{
+    x64_t a;
+    x64_init(&a, c->fp);
+    emit_file(c, &a, f);
+    x64_deinit(&a);
+}
+
+/* Assemble f in memory and write it out as a relocatable ELF object. */
+extern void emit_x64_obj(crawler_t *c, const file_t *f)
+{
+    x64_t a;
+    x64_init(&a, NULL);
+    emit_file(c, &a, f);
+    TRACE_BEGIN(TRACE_WRITE, "elf_write");
+    elf_write(c->fp, &a);
+    TRACE_END();
+    x64_deinit(&a);
+}
+
+/* Assemble f in memory and run its main in this process. */
+extern int emit_x64_run(crawler_t *c, const file_t *f, int argc, char **argv)
+{
+    x64_t a;
+    x64_init(&a, NULL);
+    emit_file(c, &a, f);
+    TRACE_BEGIN(TRACE_RUN, "main");
+    return jit_run(&a, argc, argv);
 }
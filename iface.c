@@ -0,0 +1,544 @@
+/*
+ * The format is a magic number and version, the names the declarations
+ * use, NUL-terminated, and the declarations. A node is its type followed by
+ * its fields in the order ast.h declares them: nodes nested the same way,
+ * names as indices into the table, lists as their length plus one (zero
+ * for no list) and numbers as LEB128 varints, zigzagged where they can be
+ * negative. A NULL node is NODE_UNDEFINED. Positions aren't kept: nodes
+ * read back take the position of the import that brought them in.
+ */
+
+#include "iface.h"
+#include "log.h"
+
+#include <fcntl.h> // open
+#include <stdio.h>
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+
+#include <da/da_util.h>
+
+#define MAGIC "KCI"
+#define VERSION 2
+
+/* Bodies of at most this many nodes are written for opt_eval. */
+#define MAX_INLINE_NODES 64
+
+typedef struct {
+    unsigned char *data;
+    int len;
+    int cap;
+} buf_t;
+
+typedef struct {
+    buf_t out;
+    da_t names;
+} writer_t;
+
+typedef struct {
+    const char *path;
+    const unsigned char *p;
+    const unsigned char *end;
+    char **names;
+    int num_names;
+    int pos; // of the import, for every node read
+} reader_t;
+
+DA_DEF_HELPERS(node, node_t *);
+DA_DEF_HELPERS(name, const char *);
+
+static void put(buf_t *b, const void *p, int n)
+{
+    while (b->len + n > b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 256;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_varint(buf_t *b, uint64_t v)
+{
+    unsigned char byte;
+
+    do {
+        byte = v & 0x7f;
+        v >>= 7;
+        if (v)
+            byte |= 0x80;
+        put(b, &byte, 1);
+    } while (v);
+}
+
+static void put_int(buf_t *b, int64_t v)
+{
+    put_varint(b, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int name_index(writer_t *w, const char *name)
+{
+    int i;
+
+    for (i = 0; i < da_len(&w->names); ++i) {
+        if (!strcmp(*(const char **)da_get(&w->names, i), name))
+            return i;
+    }
+    da_append_name(&w->names, name);
+    return i;
+}
+
+static void write_node(writer_t *w, const node_t *n);
+
+static void write_list(writer_t *w, node_t **list)
+{
+    int len = 0;
+
+    while (list && list[len])
+        len++;
+    put_varint(&w->out, list ? len + 1 : 0);
+    for (int i = 0; i < len; ++i)
+        write_node(w, list[i]);
+}
+
+static void write_node(writer_t *w, const node_t *n)
+{
+    put_varint(&w->out, n ? n->t : NODE_UNDEFINED);
+    if (!n)
+        return;
+    switch (n->t) {
+    case EXPR_BASIC:
+        put_varint(&w->out, n->expr.basic.kind);
+        put_int(&w->out, n->expr.basic.value);
+        break;
+    case EXPR_BINARY:
+        put_varint(&w->out, n->expr.binary.op);
+        write_node(w, n->expr.binary.x);
+        write_node(w, n->expr.binary.y);
+        break;
+    case EXPR_CALL:
+        write_node(w, n->expr.call.func);
+        write_list(w, n->expr.call.args);
+        break;
+    case EXPR_FIELD:
+        write_node(w, n->expr.field.name);
+        write_node(w, n->expr.field.type);
+        break;
+    case EXPR_IDENT:
+        put_varint(&w->out, name_index(w, n->expr.ident.name));
+        break;
+    case EXPR_PAREN:
+        write_node(w, n->expr.paren.x);
+        break;
+    case EXPR_SELECTOR:
+        write_node(w, n->expr.selector.x);
+        write_node(w, n->expr.selector.sel);
+        break;
+    case EXPR_STRUCT:
+        write_list(w, n->expr.struct_.fields);
+        break;
+    case EXPR_UNARY:
+        put_varint(&w->out, n->expr.unary.op);
+        write_node(w, n->expr.unary.expr);
+        break;
+    case STMT_ASSIGN:
+        write_node(w, n->stmt.assign.lhs);
+        put_varint(&w->out, n->stmt.assign.tok);
+        write_node(w, n->stmt.assign.rhs);
+        break;
+    case STMT_BLOCK:
+        write_list(w, n->stmt.block.stmts);
+        break;
+    case STMT_BRANCH:
+        put_varint(&w->out, n->stmt.branch.tok);
+        break;
+    case STMT_CASE:
+        write_list(w, n->stmt.case_.exprs);
+        write_list(w, n->stmt.case_.stmts);
+        break;
+    case STMT_DECL:
+        write_node(w, n->stmt.decl.decl);
+        break;
+    case STMT_EMPTY:
+        break;
+    case STMT_EXPR:
+        write_node(w, n->stmt.expr.x);
+        break;
+    case STMT_FOR:
+        write_node(w, n->stmt.for_.init);
+        write_node(w, n->stmt.for_.cond);
+        write_node(w, n->stmt.for_.post);
+        write_node(w, n->stmt.for_.body);
+        break;
+    case STMT_IF:
+        write_node(w, n->stmt.if_.cond);
+        write_node(w, n->stmt.if_.body);
+        write_node(w, n->stmt.if_.else_);
+        break;
+    case STMT_RETURN:
+        write_node(w, n->stmt.return_.expr);
+        break;
+    case STMT_SWITCH:
+        write_node(w, n->stmt.switch_.tag);
+        write_list(w, n->stmt.switch_.clauses);
+        break;
+    case DECL_FUNC:
+        write_node(w, n->decl.func.recv);
+        write_node(w, n->decl.func.name);
+        write_list(w, n->decl.func.params);
+        write_node(w, n->decl.func.type);
+        write_node(w, n->decl.func.body);
+        break;
+    case DECL_TYPE:
+        write_node(w, n->decl.type.name);
+        write_node(w, n->decl.type.type);
+        break;
+    case DECL_VAR:
+        write_node(w, n->decl.var.name);
+        write_node(w, n->decl.var.type);
+        write_node(w, n->decl.var.value);
+        break;
+    default:
+        PANIC("can't write node type %d to an interface", n->t);
+        break;
+    }
+}
+
+/* Whether n has at most max nodes. */
+static int is_small(const node_t *n, int max)
+{
+    ast_stack_t s;
+    const node_t **top;
+    int count = 0;
+
+    ast_stack_init(&s, sizeof(n));
+    *(const node_t **)ast_stack_push(&s) = n;
+    while (count <= max && (top = ast_stack_pop(&s))) {
+        count++;
+        ast_push_children(&s, *top);
+    }
+    ast_stack_deinit(&s);
+    return count <= max;
+}
+
+/* What importers can use: the types, and the functions that link
+ * externally apart from main, each once. */
+static int is_interface(const file_t *f, const node_t *n)
+{
+    const char *name;
+
+    switch (n->t) {
+    case DECL_TYPE:
+        return 1;
+    case DECL_FUNC:
+        name = n->decl.func.name->expr.ident.name;
+        return ast_find_func(f, name) == n && strcmp(name, "main")
+            && (!n->decl.func.body || ast_is_exported(name));
+    default:
+        return 0;
+    }
+}
+
+extern void iface_write(const file_t *f, const char *path)
+{
+    writer_t w = {};
+    buf_t header = {};
+    int num_decls = 0;
+    FILE *fp;
+
+    da_init_name(&w.names);
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        node_t decl = **decls;
+        if (!is_interface(f, *decls))
+            continue;
+        if (decl.t == DECL_FUNC && decl.decl.func.body
+                && !is_small(decl.decl.func.body, MAX_INLINE_NODES))
+            decl.decl.func.body = NULL;
+        write_node(&w, &decl);
+        num_decls++;
+    }
+    put(&header, MAGIC, strlen(MAGIC));
+    put_varint(&header, VERSION);
+    put_varint(&header, da_len(&w.names));
+    for (int i = 0; i < da_len(&w.names); ++i) {
+        const char *name = *(const char **)da_get(&w.names, i);
+        put(&header, name, strlen(name) + 1);
+    }
+    put_varint(&header, num_decls);
+    if (!(fp = fopen(path, "wb")))
+        PANIC("can't write interface file: %s", path);
+    if (fwrite(header.data, 1, header.len, fp) != (size_t)header.len
+            || fwrite(w.out.data, 1, w.out.len, fp) != (size_t)w.out.len
+            || fclose(fp))
+        PANIC("can't write interface file: %s", path);
+    free(header.data);
+    free(w.out.data);
+    da_deinit(&w.names);
+}
+
+static void corrupt(reader_t *r)
+{
+    PANIC("%s: corrupt interface file", r->path);
+}
+
+static uint64_t read_varint(reader_t *r)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->p == r->end)
+            corrupt(r);
+        v |= (uint64_t)(*r->p & 0x7f) << shift;
+        if (!(*r->p++ & 0x80))
+            return v;
+    }
+    corrupt(r);
+    return 0;
+}
+
+static int64_t read_int(reader_t *r)
+{
+    uint64_t v = read_varint(r);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static node_t *read_node(reader_t *r);
+
+static node_t **read_list(reader_t *r)
+{
+    uint64_t len = read_varint(r);
+    node_t **list;
+
+    if (!len)
+        return NULL;
+    // every node takes a byte at least
+    if (len - 1 > (uint64_t)(r->end - r->p))
+        corrupt(r);
+    list = malloc(len * sizeof(*list));
+    for (uint64_t i = 0; i < len - 1; ++i)
+        list[i] = read_node(r);
+    list[len - 1] = NULL;
+    return list;
+}
+
+/* Fields are read one statement at a time, in the order they were
+ * written. */
+static node_t *read_node(reader_t *r)
+{
+    node_t n = {.t = read_varint(r), .pos = r->pos};
+    uint64_t i;
+
+    switch (n.t) {
+    case NODE_UNDEFINED:
+        return NULL;
+    case EXPR_BASIC:
+        n.expr.basic.kind = read_varint(r);
+        n.expr.basic.value = read_int(r);
+        break;
+    case EXPR_BINARY:
+        n.expr.binary.op = read_varint(r);
+        n.expr.binary.x = read_node(r);
+        n.expr.binary.y = read_node(r);
+        break;
+    case EXPR_CALL:
+        n.expr.call.func = read_node(r);
+        n.expr.call.args = read_list(r);
+        break;
+    case EXPR_FIELD:
+        n.expr.field.name = read_node(r);
+        n.expr.field.type = read_node(r);
+        break;
+    case EXPR_IDENT:
+        if ((i = read_varint(r)) >= (uint64_t)r->num_names)
+            corrupt(r);
+        n.expr.ident.name = r->names[i];
+        break;
+    case EXPR_PAREN:
+        n.expr.paren.x = read_node(r);
+        break;
+    case EXPR_SELECTOR:
+        n.expr.selector.x = read_node(r);
+        n.expr.selector.sel = read_node(r);
+        break;
+    case EXPR_STRUCT:
+        n.expr.struct_.fields = read_list(r);
+        break;
+    case EXPR_UNARY:
+        n.expr.unary.op = read_varint(r);
+        n.expr.unary.expr = read_node(r);
+        break;
+    case STMT_ASSIGN:
+        n.stmt.assign.lhs = read_node(r);
+        n.stmt.assign.tok = read_varint(r);
+        n.stmt.assign.rhs = read_node(r);
+        break;
+    case STMT_BLOCK:
+        n.stmt.block.stmts = read_list(r);
+        break;
+    case STMT_BRANCH:
+        n.stmt.branch.tok = read_varint(r);
+        break;
+    case STMT_CASE:
+        n.stmt.case_.exprs = read_list(r);
+        n.stmt.case_.stmts = read_list(r);
+        break;
+    case STMT_DECL:
+        n.stmt.decl.decl = read_node(r);
+        break;
+    case STMT_EMPTY:
+        break;
+    case STMT_EXPR:
+        n.stmt.expr.x = read_node(r);
+        break;
+    case STMT_FOR:
+        n.stmt.for_.init = read_node(r);
+        n.stmt.for_.cond = read_node(r);
+        n.stmt.for_.post = read_node(r);
+        n.stmt.for_.body = read_node(r);
+        break;
+    case STMT_IF:
+        n.stmt.if_.cond = read_node(r);
+        n.stmt.if_.body = read_node(r);
+        n.stmt.if_.else_ = read_node(r);
+        break;
+    case STMT_RETURN:
+        n.stmt.return_.expr = read_node(r);
+        break;
+    case STMT_SWITCH:
+        n.stmt.switch_.tag = read_node(r);
+        n.stmt.switch_.clauses = read_list(r);
+        break;
+    case DECL_FUNC:
+        n.decl.func.recv = read_node(r);
+        n.decl.func.name = read_node(r);
+        n.decl.func.params = read_list(r);
+        n.decl.func.type = read_node(r);
+        n.decl.func.inline_body = read_node(r);
+        break;
+    case DECL_TYPE:
+        n.decl.type.name = read_node(r);
+        n.decl.type.type = read_node(r);
+        break;
+    case DECL_VAR:
+        n.decl.var.name = read_node(r);
+        n.decl.var.type = read_node(r);
+        n.decl.var.value = read_node(r);
+        break;
+    default:
+        corrupt(r);
+        break;
+    }
+    return copy(&n);
+}
+
+/* Map the interface file at path and add its declarations to decls. The
+ * names are copied out once each, so the mapping doesn't outlive this. */
+static void read_iface(da_t *decls, const char *path, int pos)
+{
+    reader_t r = {.path = path, .pos = pos};
+    struct stat st;
+    void *map;
+    uint64_t num_decls;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st))
+        PANIC("can't read interface file: %s", path);
+    map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        PANIC("can't map interface file: %s", path);
+    r.p = map;
+    r.end = r.p + st.st_size;
+    if (st.st_size < (off_t)strlen(MAGIC) || memcmp(r.p, MAGIC, strlen(MAGIC)))
+        corrupt(&r);
+    r.p += strlen(MAGIC);
+    if (read_varint(&r) != VERSION)
+        PANIC("%s: interface file is from another version of the compiler", path);
+    r.num_names = read_varint(&r);
+    if (r.num_names < 0 || r.num_names > r.end - r.p)
+        corrupt(&r);
+    r.names = malloc(r.num_names * sizeof(*r.names));
+    for (int i = 0; i < r.num_names; ++i) {
+        const unsigned char *nul = memchr(r.p, '\0', r.end - r.p);
+        if (!nul)
+            corrupt(&r);
+        r.names[i] = strdup((const char *)r.p);
+        r.p = nul + 1;
+    }
+    num_decls = read_varint(&r);
+    for (uint64_t i = 0; i < num_decls; ++i)
+        da_append_node(decls, read_node(&r));
+    if (r.p != r.end)
+        corrupt(&r);
+    free(r.names);
+    munmap(map, st.st_size ? st.st_size : 1);
+}
+
+static int can_read(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return 1;
+}
+
+/* NAME.kci in the importing file's directory, or else in one of dirs. */
+static char *find_iface(const file_t *f, const char *name, const char **dirs)
+{
+    const char *slash = strrchr(f->filename, '/');
+    char *path;
+
+    if (asprintf(&path, "%.*s%s.kci", slash ? (int)(slash - f->filename + 1) : 0,
+                f->filename, name) < 0)
+        PANIC("out of memory");
+    for (; !can_read(path) && dirs && *dirs; ++dirs) {
+        free(path);
+        if (asprintf(&path, "%s/%s.kci", *dirs, name) < 0)
+            PANIC("out of memory");
+    }
+    if (!can_read(path))
+        PANIC("%s: can't find package `%s`", f->filename, name);
+    return path;
+}
+
+static const char *type_name(const node_t *n)
+{
+    return n->t == DECL_TYPE ? n->decl.type.name->expr.ident.name : NULL;
+}
+
+/* Read the interfaces f imports, each package once, and add their
+ * declarations ahead of f's own. Types can't be declared twice. */
+extern void iface_import(file_t *f, const char **dirs)
+{
+    da_t decls;
+    int num_imported;
+
+    da_init_node(&decls);
+    for (node_t **imports = f->imports; imports && *imports; ++imports) {
+        const char *name = (*imports)->expr.ident.name;
+        node_t **prev = f->imports;
+        while (prev < imports && strcmp((*prev)->expr.ident.name, name))
+            prev++;
+        if (prev < imports)
+            continue;
+        char *path = find_iface(f, name, dirs);
+        read_iface(&decls, path, (*imports)->pos);
+        free(path);
+    }
+    num_imported = da_len(&decls);
+    for (node_t **own = f->decls; own && *own; ++own)
+        da_append_node(&decls, *own);
+    for (int i = 0; i < num_imported; ++i) {
+        const char *name = type_name(*(node_t **)da_get(&decls, i));
+        for (int j = i + 1; name && j < da_len(&decls); ++j) {
+            const char *other = type_name(*(node_t **)da_get(&decls, j));
+            if (other && !strcmp(name, other))
+                PANIC("%s: type `%s` is declared more than once", f->filename, name);
+        }
+    }
+    da_append_node(&decls, NULL);
+    free(f->decls);
+    f->decls = decls.data;
+}
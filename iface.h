@@ -0,0 +1,17 @@
+#pragma once
+
+#include "ast.h"
+
+/*
+ * Interface files. Compiling a file with a package clause writes
+ * NAME.kci, holding what its importers need: the package's types, the
+ * signatures of its functions with external linkage and the bodies of the
+ * small ones, so opt_eval can still evaluate calls to them at compile time.
+ *
+ * Importing a package maps its interface file instead of parsing its
+ * source, and adds its declarations ahead of the file's own, unqualified,
+ * as if they had been written there without bodies.
+ */
+
+extern void iface_write(const file_t *f, const char *path);
+extern void iface_import(file_t *f, const char **dirs);
@@ -0,0 +1,77 @@
+#include "jit.h"
+#include "log.h"
+
+#include <dlfcn.h> // dlsym
+#include <string.h> // memcpy
+#include <sys/mman.h> // mmap
+#include <unistd.h> // sysconf
+
+/* jmp *0(%rip) followed by the absolute address of the callee. Calls to
+ * shared libraries may land more than 2GB away from the mapping, out of
+ * reach of a rel32. */
+#define STUB_SIZE 14
+
+static void put_stub(unsigned char *p, void *addr)
+{
+    static const unsigned char jmp[] = {0xff, 0x25, 0, 0, 0, 0};
+    memcpy(p, jmp, sizeof(jmp));
+    memcpy(p + sizeof(jmp), &addr, sizeof(addr));
+}
+
+static void patch32(unsigned char *p, int v)
+{
+    for (int i = 0; i < 4; ++i)
+        p[i] = (unsigned)v >> (8 * i);
+}
+
+/* Map the assembled code, with .data on the pages after it, link its
+ * external calls against this process and call main with the given
+ * arguments. */
+extern int jit_run(const x64_t *a, int argc, char **argv)
+{
+    int stubs[a->num_fixups + 1];
+    int num_stubs = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (a->len + STUB_SIZE * a->num_fixups + page) / page * page;
+    size_t data_size = (a->data_len + page) / page * page;
+    int (*entry)(int, char **) = NULL;
+
+    unsigned char *mem = mmap(NULL, size + data_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        PANIC("mmap failed");
+    memcpy(mem, a->code, a->len);
+    memcpy(mem + size, a->data, a->data_len);
+
+    for (int i = 0; i < a->num_fixups; ++i) {
+        const x64_fixup_t *f = &a->fixups[i];
+        if (f->section == X64_DATA) {
+            patch32(mem + f->offset, size + f->addend - f->offset);
+            continue;
+        }
+        stubs[i] = -1;
+        for (int j = 0; j < i && stubs[i] < 0; ++j) {
+            if (a->fixups[j].section == X64_TEXT
+                    && !strcmp(a->fixups[j].label.name, f->label.name))
+                stubs[i] = stubs[j];
+        }
+        if (stubs[i] < 0) {
+            void *addr = dlsym(RTLD_DEFAULT, f->label.name);
+            if (!addr)
+                PANIC("undefined symbol: %s", f->label.name);
+            stubs[i] = a->len + STUB_SIZE * num_stubs++;
+            put_stub(mem + stubs[i], addr);
+        }
+        patch32(mem + f->offset, stubs[i] + f->addend - f->offset);
+    }
+
+    for (int i = 0; i < a->num_funcs; ++i) {
+        if (!strcmp(a->funcs[i].label.name, "main"))
+            entry = (int (*)(int, char **))(mem + a->funcs[i].offset);
+    }
+    if (!entry)
+        PANIC("no main function");
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+        PANIC("mprotect failed");
+    return entry(argc, argv);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "x64.h"
+
+extern int jit_run(const x64_t *a, int argc, char **argv);
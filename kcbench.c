@@ -0,0 +1,242 @@
+/*
+ * kcbench: time the compiler's phases on a .kc file.
+ *
+ * Each run parses the file, emits C and emits x64 assembly, discarding the
+ * output, and times the three phases separately. Runs happen in a fresh
+ * child process so that one run's memory can't affect the next and peak RSS
+ * is per run. The first run warms the caches and isn't counted; the rest
+ * are summarized by their median, which a few slow runs can't skew, and
+ * their relative standard deviation, which says how far to trust it.
+ *
+ * Throughput is the input's size over the median time, in tokens, AST nodes
+ * and bytes per second, for every phase.
+ */
+
+#include "emit.h"
+#include "parser.h"
+#include "scanner.h"
+
+#include <math.h> // sqrt
+#include <stdio.h>
+#include <stdlib.h> // qsort
+#include <string.h> // strcmp
+#include <sys/resource.h> // wait4
+#include <sys/wait.h>
+#include <time.h> // clock_gettime
+#include <unistd.h> // fork, pipe
+
+enum {
+    PHASE_PARSE,
+    PHASE_EMIT_C,
+    PHASE_EMIT_X64,
+    NUM_PHASES,
+};
+
+static const char *phase_names[NUM_PHASES] = {
+    [PHASE_PARSE] = "parse",
+    [PHASE_EMIT_C] = "emit_c",
+    [PHASE_EMIT_X64] = "emit_x64",
+};
+
+typedef struct {
+    double secs[NUM_PHASES];
+    long max_rss; // KB
+} run_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *read_file(const char *filename, int *len)
+{
+    FILE *fp = fopen(filename, "r");
+    char *src;
+
+    if (!fp || fseek(fp, 0, SEEK_END) || (*len = ftell(fp)) < 0
+            || fseek(fp, 0, SEEK_SET)) {
+        perror(filename);
+        exit(2);
+    }
+    src = malloc(*len + 1);
+    if (fread(src, 1, *len, fp) != (size_t)*len) {
+        perror(filename);
+        exit(2);
+    }
+    src[*len] = '\0';
+    fclose(fp);
+    return src;
+}
+
+static int count_tokens(char *src, int len)
+{
+    static char lit[BUFSIZ];
+    scanner_t s;
+    int n = 0;
+
+    scanner_init(&s, src, len);
+    while (scanner_scan(&s, lit) != token_EOF)
+        n++;
+    return n;
+}
+
+static int count_nodes(const node_t *n)
+{
+    ast_stack_t s;
+    const node_t **top;
+    int count = 0;
+
+    ast_stack_init(&s, sizeof(n));
+    *(const node_t **)ast_stack_push(&s) = n;
+    while ((top = ast_stack_pop(&s))) {
+        n = *top;
+        count++;
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+    return count;
+}
+
+/* Compile src once in this process and write the phase times to fd. */
+static void compile(const char *filename, char *src, int len, int fd)
+{
+    run_t run = {};
+    crawler_t c = {.fp = fopen("/dev/null", "w")};
+    double t;
+
+    if (!c.fp)
+        exit(2);
+    t = now();
+    file_t *f = parse_file(filename, src, len);
+    run.secs[PHASE_PARSE] = now() - t;
+    t = now();
+    emit_c(&c, f);
+    fflush(c.fp);
+    run.secs[PHASE_EMIT_C] = now() - t;
+    t = now();
+    emit_x64(&c, f);
+    fflush(c.fp);
+    run.secs[PHASE_EMIT_X64] = now() - t;
+    if (write(fd, &run, sizeof(run)) != sizeof(run))
+        exit(2);
+    exit(0);
+}
+
+/* Compile in a child and collect its times and peak RSS. */
+static int measure(const char *filename, char *src, int len, run_t *run)
+{
+    struct rusage ru;
+    int fds[2];
+    int status;
+    pid_t pid;
+
+    if (pipe(fds))
+        return 1;
+    if (!(pid = fork())) {
+        close(fds[0]);
+        compile(filename, src, len, fds[1]);
+    }
+    close(fds[1]);
+    if (pid < 0 || read(fds[0], run, sizeof(*run)) != sizeof(*run)) {
+        close(fds[0]);
+        return 1;
+    }
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+        return 1;
+    run->max_rss = ru.ru_maxrss;
+    return 0;
+}
+
+static int double_cmp(const void *l, const void *r)
+{
+    double x = *(const double *)l;
+    double y = *(const double *)r;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *xs, int n)
+{
+    qsort(xs, n, sizeof(*xs), double_cmp);
+    return n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+}
+
+/* The sample standard deviation over the mean. */
+static double rsd(const double *xs, int n)
+{
+    double mean = 0;
+    double var = 0;
+
+    for (int i = 0; i < n; ++i)
+        mean += xs[i];
+    mean /= n;
+    for (int i = 0; i < n; ++i)
+        var += (xs[i] - mean) * (xs[i] - mean);
+    return n > 1 && mean > 0 ? sqrt(var / (n - 1)) / mean : 0;
+}
+
+static int usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-r runs] file.kc\n", progname);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    int num_runs = 10;
+    int noisy = 0;
+    int len;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            num_runs = atoi(argv[++i]);
+        else if (!filename)
+            filename = argv[i];
+        else
+            return usage(argv[0]);
+    }
+    if (!filename || num_runs < 1)
+        return usage(argv[0]);
+    char *src = read_file(filename, &len);
+
+    int num_tokens = count_tokens(src, len);
+    file_t *f = parse_file(filename, src, len);
+    int num_nodes = 0;
+    for (node_t **decls = f->decls; decls && *decls; ++decls)
+        num_nodes += count_nodes(*decls);
+
+    run_t runs[num_runs + 1];
+    for (int i = 0; i <= num_runs; ++i) {
+        if (measure(filename, src, len, &runs[i])) {
+            fprintf(stderr, "%s: compiling failed\n", filename);
+            return 2;
+        }
+    }
+
+    printf("%s: %d bytes, %d tokens, %d nodes, %d runs\n",
+            filename, len, num_tokens, num_nodes, num_runs);
+    printf("%-10s %10s %10s %7s %12s %12s %10s\n",
+            "phase", "median ms", "min ms", "rsd", "tokens/s", "nodes/s", "MB/s");
+    for (int p = 0; p < NUM_PHASES; ++p) {
+        double secs[num_runs];
+        for (int i = 0; i < num_runs; ++i)
+            secs[i] = runs[i + 1].secs[p];
+        double dev = rsd(secs, num_runs);
+        double med = median(secs, num_runs);
+        noisy |= dev > 0.05;
+        printf("%-10s %10.3f %10.3f %6.1f%% %12.0f %12.0f %10.2f\n",
+                phase_names[p], 1e3 * med, 1e3 * secs[0], 100 * dev,
+                num_tokens / med, num_nodes / med, len / med / 1e6);
+    }
+    double rss[num_runs];
+    for (int i = 0; i < num_runs; ++i)
+        rss[i] = runs[i + 1].max_rss;
+    printf("peak RSS: %.0f KB (median)\n", median(rss, num_runs));
+    if (noisy)
+        printf("warning: some phases vary by more than 5%%, use more runs or a quieter machine\n");
+    free(src);
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * kcgen: generate a synthetic .kc program for benchmarking the compiler.
+ *
+ * The program has -f functions, each with locals, statements nested -n deep
+ * in alternating ifs and loops and expressions -d operators deep. Every
+ * identifier is padded to at least -i characters. The same options and
+ * seed always give the same program, and the program compiles with every
+ * backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> // atoi
+#include <string.h> // strcmp
+
+static int num_funcs = 100;
+static int depth = 8;
+static int nesting = 3;
+static int ident_len = 8;
+static unsigned long long seed = 1;
+
+static const char *ops[] = {
+    "+", "-", "*", "&", "|", "^", "<", "<=", "==", "!=", "&&", "||",
+};
+
+#define countof(a) ((int)(sizeof(a) / sizeof(*(a))))
+
+/* xorshift64*, so programs don't depend on the C library's rand */
+static unsigned rnd(unsigned n)
+{
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (seed * 2685821657736338717ULL >> 32) % n;
+}
+
+static void ident(char kind, int i)
+{
+    int len = printf("%c%d", kind, i);
+    for (; len < ident_len; ++len)
+        putchar('a' + (len - 1) % 26);
+}
+
+/* A parameter, a local or a literal. Locals are declared before anything
+ * that uses them. */
+static void leaf(void)
+{
+    int r = rnd(5);
+    if (r < 2)
+        ident('p', r);
+    else if (r < 4)
+        ident('v', r - 2);
+    else
+        printf("%u", rnd(100));
+}
+
+static void expr(int d, int func)
+{
+    if (d <= 0) {
+        leaf();
+        return;
+    }
+    switch (rnd(4)) {
+    case 0:
+        leaf();
+        printf(" %s ", ops[rnd(countof(ops))]);
+        expr(d - 1, func);
+        break;
+    case 1:
+        putchar('(');
+        expr(d - 1, func);
+        printf(") %s ", ops[rnd(countof(ops))]);
+        leaf();
+        break;
+    case 2:
+        if (func > 0) {
+            ident('f', rnd(func));
+            putchar('(');
+            expr(d - 1, func);
+            printf(", ");
+            leaf();
+            putchar(')');
+            break;
+        }
+        // fall through
+    default:
+        printf("-(");
+        expr(d - 1, func);
+        putchar(')');
+        break;
+    }
+}
+
+static void indent(int n)
+{
+    for (int i = 0; i < n; ++i)
+        printf("    ");
+}
+
+static void stmts(int level, int func)
+{
+    indent(level + 1);
+    ident('v', rnd(2));
+    printf(" += ");
+    expr(depth, func);
+    printf(";\n");
+    if (level == nesting)
+        return;
+    indent(level + 1);
+    if (level % 2) {
+        printf("if ");
+        expr(depth, func);
+        printf(" {\n");
+    } else {
+        printf("for var ");
+        ident('i', level);
+        printf(" int = 0; ");
+        ident('i', level);
+        printf(" < 4; ");
+        ident('i', level);
+        printf("++ {\n");
+    }
+    stmts(level + 1, func);
+    indent(level + 1);
+    printf("}\n");
+}
+
+static void func(int i)
+{
+    printf("func ");
+    ident('f', i);
+    printf("(");
+    ident('p', 0);
+    printf(" int, ");
+    ident('p', 1);
+    printf(" int) int {\n");
+    for (int v = 0; v < 2; ++v) {
+        printf("    var ");
+        ident('v', v);
+        printf(" int = ");
+        ident('p', v);
+        printf(";\n");
+    }
+    stmts(0, i);
+    printf("    return ");
+    expr(depth, i);
+    printf(";\n}\n\n");
+}
+
+static int usage(const char *progname)
+{
+    fprintf(stderr, "usage: %s [-f funcs] [-d depth] [-n nesting] [-i ident-len] [-s seed]\n",
+            progname);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (i + 1 == argc)
+            return usage(argv[0]);
+        if (!strcmp(argv[i], "-f"))
+            num_funcs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-d"))
+            depth = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-n"))
+            nesting = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-i"))
+            ident_len = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s"))
+            seed = strtoull(argv[++i], NULL, 10) | 1;
+        else
+            return usage(argv[0]);
+    }
+    if (num_funcs < 1 || depth < 0 || nesting < 0 || ident_len > 1000)
+        return usage(argv[0]);
+
+    for (int i = 0; i < num_funcs; ++i)
+        func(i);
+    printf("func main() int {\n    return ");
+    ident('f', num_funcs - 1);
+    printf("(1, 2) & 255;\n}\n");
+    return 0;
+}
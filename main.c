@@ -3,11 +3,21 @@
 #include <string.h> // strcmp
 
 #include "emit.h"
+#include "iface.h"
+#include "log.h"
+#include "opt.h"
+#include "mem.h"
 #include "parser.h"
+#include "trace.h"
 
 static enum emitter {
+    EMIT_BC,
     EMIT_C,
+    EMIT_LLVM,
     EMIT_X64,
+    EMIT_OBJ,
+    EMIT_RUN,
+    EMIT_VM,
 } emitter = EMIT_C;
 
 int freadall(FILE *fp, char **sp)
@@ -30,44 +40,199 @@ int freadall(FILE *fp, char **sp)
     return n;
 }
 
+static const char *profile_generate = NULL;
+static const char *profile_use = NULL;
+static const char **import_dirs = NULL;
+static int unroll_factor = OPT_UNROLL_FACTOR;
+
+/* A package's interface file goes next to its output, or its source when
+ * the output goes to stdout. Package main can't be imported. */
+static void write_interface(const file_t *f, const char *outfile)
+{
+    const char *name = f->package->expr.ident.name;
+    const char *dir = outfile ? outfile : f->filename;
+    const char *slash = strrchr(dir, '/');
+    char *path;
+
+    if (!strcmp(name, "main"))
+        return;
+    if (asprintf(&path, "%.*s%s.kci", slash ? (int)(slash - dir + 1) : 0, dir, name) < 0)
+        exit(2);
+    TRACE_BEGIN(TRACE_WRITE, path);
+    iface_write(f, path);
+    TRACE_END();
+    free(path);
+}
+
+static int compile(const char *filename, const char *outfile, int argc,
+        char **argv)
+{
+    TRACE_BEGIN(TRACE_READ, filename);
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        TRACE_END();
+        return 2;
+    }
+
+    char *src = NULL;
+    int src_len = freadall(fp, &src);
+    fclose(fp);
+    TRACE_END();
+
+    TRACE_BEGIN(TRACE_PARSE, filename);
+    file_t *f = parse_file(filename, src, src_len);
+    TRACE_END();
+    if (f->package && emitter != EMIT_RUN && emitter != EMIT_VM)
+        write_interface(f, outfile);
+    if (f->imports) {
+        TRACE_BEGIN(TRACE_READ, "imports");
+        iface_import(f, import_dirs);
+        TRACE_END();
+    }
+    crawler_t crawler = {
+        .fp = stdout,
+        .profile_generate = profile_generate,
+    };
+    if (outfile && !(crawler.fp = fopen(outfile, "wb"))) {
+        free(src);
+        return 2;
+    }
+
+    profile_t profile = {};
+    if (emitter == EMIT_X64 || emitter == EMIT_OBJ || emitter == EMIT_RUN) {
+        TRACE_BEGIN(TRACE_OPT, filename);
+        opt_callgraph(f);
+        opt_eval(f);
+        opt_cse(f);
+        opt_callgraph(f);
+        // number the sites before unrolling so both profile builds agree
+        profile_init(&profile, f);
+        if (profile_use && profile_load(&profile, profile_use))
+            LOGW("ignoring profile that doesn't match this program: %s", profile_use);
+        // instrumented builds stay rolled so every copy counts as one site
+        opt_unroll(f, profile_generate ? 1 : unroll_factor, &profile);
+        crawler.profile = &profile;
+        TRACE_END();
+    }
+    if (mem_enabled)
+        mem_report_ast(f);
+
+    TRACE_BEGIN(TRACE_EMIT, filename);
+    switch (emitter) {
+    case EMIT_BC:
+        emit_bc(&crawler, f);
+        break;
+    case EMIT_C:
+        emit_c(&crawler, f);
+        break;
+    case EMIT_LLVM:
+        emit_llvm(&crawler, f);
+        break;
+    case EMIT_X64:
+        emit_x64(&crawler, f);
+        break;
+    case EMIT_OBJ:
+        emit_x64_obj(&crawler, f);
+        break;
+    case EMIT_RUN:
+        exit(emit_x64_run(&crawler, f, argc, argv));
+        break;
+    case EMIT_VM:
+        exit(emit_bc_run(f, argc));
+        break;
+    }
+    TRACE_END();
+
+    TRACE_BEGIN(TRACE_WRITE, filename);
+    if (outfile)
+        fclose(crawler.fp);
+    else
+        fflush(crawler.fp);
+    TRACE_END();
+
+    profile_deinit(&profile);
+    free(src);
+    return 0;
+}
+
+static void start_stats(int time_phases, int mem_stats, const char *trace_file)
+{
+    if (time_phases || mem_stats || trace_file)
+        trace_start(time_phases, trace_file);
+    if (mem_stats)
+        mem_start();
+}
+
 int main(int argc, char *argv[])
 {
     const char *progname = *argv;
+    char **start = argv;
+    const char *outfile = NULL;
+    const char *filenames[argc];
+    const char *dirs[argc];
+    int num_files = 0;
+    int num_dirs = 0;
+    int time_phases = 0;
+    int mem_stats = 0;
+    const char *trace_file = NULL;
     (void)progname;
 
+    dirs[0] = NULL;
+    import_dirs = dirs;
     while (*++argv) {
-        if (!strcmp(*argv, "--emit-c")) {
+        if (!strcmp(*argv, "--emit-bc")) {
+            emitter = EMIT_BC;
+        } else if (!strcmp(*argv, "--emit-c")) {
             emitter = EMIT_C;
+        } else if (!strcmp(*argv, "--emit-llvm")) {
+            emitter = EMIT_LLVM;
         } else if (!strcmp(*argv, "--emit-x64")) {
             emitter = EMIT_X64;
-        } else {
-            if (argc < 1)
+        } else if (!strcmp(*argv, "-c")) {
+            emitter = EMIT_OBJ;
+        } else if (!strcmp(*argv, "--run")) {
+            emitter = EMIT_RUN;
+        } else if (!strcmp(*argv, "--vm")) {
+            emitter = EMIT_VM;
+        } else if (!strcmp(*argv, "-o")) {
+            if (!(outfile = *++argv))
                 return 1;
-
-            const char *filename = *argv;
-            FILE *fp = fopen(filename, "r");
-            if (!fp)
-                return 2;
-
-            char *src = NULL;
-            int src_len = freadall(fp, &src);
-            fclose(fp);
-
-            file_t *f = parse_file(filename, src, src_len);
-            crawler_t crawler = {.fp = stdout};
-
-            switch (emitter) {
-            case EMIT_C:
-                emit_c(&crawler, f);
-                break;
-            case EMIT_X64:
-                emit_x64(&crawler, f);
-                break;
-            }
-
-            free(src);
+        } else if (!strcmp(*argv, "-I")) {
+            if (!(dirs[num_dirs++] = *++argv))
+                return 1;
+            dirs[num_dirs] = NULL;
+        } else if (!strcmp(*argv, "--profile-generate")) {
+            if (!(profile_generate = *++argv))
+                return 1;
+        } else if (!strcmp(*argv, "--profile-use")) {
+            if (!(profile_use = *++argv))
+                return 1;
+        } else if (!strcmp(*argv, "--unroll")) {
+            if (!*++argv)
+                return 1;
+            unroll_factor = atoi(*argv);
+        } else if (!strcmp(*argv, "--time-phases")) {
+            time_phases = 1;
+        } else if (!strcmp(*argv, "--mem-stats")) {
+            mem_stats = 1;
+        } else if (!strcmp(*argv, "--trace")) {
+            if (!(trace_file = *++argv))
+                return 1;
+        } else if (emitter == EMIT_RUN || emitter == EMIT_VM) {
+            // the rest of the command line belongs to the program
+            start_stats(time_phases, mem_stats, trace_file);
+            return compile(*argv, NULL, argc - (argv - start), argv);
+        } else {
+            filenames[num_files++] = *argv;
         }
     }
 
+    start_stats(time_phases, mem_stats, trace_file);
+    for (int i = 0; i < num_files; ++i) {
+        int ret = compile(filenames[i], outfile, 0, NULL);
+        if (ret)
+            return ret;
+    }
+
     return 0;
 }
@@ -0,0 +1,295 @@
+#include "mem.h"
+#include "trace.h"
+
+#include <malloc.h> // malloc_usable_size
+#include <stdio.h>
+#include <sys/resource.h> // getrusage
+
+/* glibc's allocator, under the names it keeps for wrappers like these */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static const char *kind_names[MEM_NUM_KINDS] = {
+    [MEM_NODES] = "nodes",
+    [MEM_STRINGS] = "strings",
+    [MEM_LISTS] = "lists",
+    [MEM_SCOPES] = "scopes",
+};
+
+static const char *node_names[] = {
+    [NODE_UNDEFINED] = "undefined",
+    [EXPR_BASIC] = "basic",
+    [EXPR_BINARY] = "binary",
+    [EXPR_CALL] = "call",
+    [EXPR_FIELD] = "field",
+    [EXPR_IDENT] = "ident",
+    [EXPR_PAREN] = "paren",
+    [EXPR_SELECTOR] = "selector",
+    [EXPR_STRUCT] = "struct",
+    [EXPR_UNARY] = "unary",
+    [STMT_ASSIGN] = "assign",
+    [STMT_BLOCK] = "block",
+    [STMT_BRANCH] = "branch",
+    [STMT_CASE] = "case",
+    [STMT_DECL] = "decl_stmt",
+    [STMT_EMPTY] = "empty",
+    [STMT_EXPR] = "expr_stmt",
+    [STMT_FOR] = "for",
+    [STMT_IF] = "if",
+    [STMT_RETURN] = "return",
+    [STMT_SWITCH] = "switch",
+    [DECL_FUNC] = "func",
+    [DECL_TYPE] = "type",
+    [DECL_VAR] = "var",
+};
+
+#define NUM_NODE_TYPES (DECL_VAR + 1)
+
+enum {
+    LIST_DECLS,
+    LIST_STMTS,
+    LIST_ARGS,
+    LIST_PARAMS,
+    LIST_FIELDS,
+    LIST_CLAUSES,
+    LIST_VALUES,
+    NUM_LIST_TYPES,
+};
+
+static const char *list_names[NUM_LIST_TYPES] = {
+    [LIST_DECLS] = "decls",
+    [LIST_STMTS] = "stmts",
+    [LIST_ARGS] = "args",
+    [LIST_PARAMS] = "params",
+    [LIST_FIELDS] = "fields",
+    [LIST_CLAUSES] = "clauses",
+    [LIST_VALUES] = "values",
+};
+
+typedef struct {
+    long count;
+    long bytes;
+} tally_t;
+
+typedef struct {
+    long count;
+    long elems;
+    long bytes; // allocated
+    long used; // elements and terminator
+} list_tally_t;
+
+int mem_enabled = 0;
+
+// the last slot is for allocations outside any phase
+static tally_t allocs[TRACE_NUM_PHASES + 1];
+static tally_t frees[TRACE_NUM_PHASES + 1];
+static long live;
+static long peak;
+static tally_t kinds[MEM_NUM_KINDS];
+static tally_t nodes[NUM_NODE_TYPES];
+static list_tally_t lists[NUM_LIST_TYPES];
+
+static tally_t *phase_tally(tally_t *tallies)
+{
+    int phase = trace_phase();
+    return &tallies[phase < 0 ? TRACE_NUM_PHASES : phase];
+}
+
+/* Count a block of size bytes that replaced one of old bytes. */
+static void count_alloc(long size, long old)
+{
+    tally_t *t = phase_tally(allocs);
+
+    t->count++;
+    if (size > old)
+        t->bytes += size - old;
+    live += size - old;
+    if (live > peak)
+        peak = live;
+}
+
+static void count_free(long size)
+{
+    tally_t *t = phase_tally(frees);
+
+    t->count++;
+    t->bytes += size;
+    live -= size;
+}
+
+extern void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+    if (mem_enabled && p)
+        count_alloc(malloc_usable_size(p), 0);
+    return p;
+}
+
+extern void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+    if (mem_enabled && p)
+        count_alloc(malloc_usable_size(p), 0);
+    return p;
+}
+
+extern void *realloc(void *p, size_t size)
+{
+    long old = mem_enabled && p ? malloc_usable_size(p) : 0;
+    void *q = __libc_realloc(p, size);
+    if (mem_enabled && q)
+        count_alloc(malloc_usable_size(q), old);
+    return q;
+}
+
+extern void free(void *p)
+{
+    if (mem_enabled && p)
+        count_free(malloc_usable_size(p));
+    __libc_free(p);
+}
+
+extern void mem_count(int kind, size_t bytes)
+{
+    kinds[kind].count++;
+    kinds[kind].bytes += bytes;
+}
+
+static void count_string(const char *s)
+{
+    if (s)
+        mem_count(MEM_STRINGS, malloc_usable_size((void *)s));
+}
+
+static void tally_list(int type, node_t **list)
+{
+    list_tally_t *l = &lists[type];
+    int len = 0;
+
+    if (!list)
+        return;
+    while (list[len])
+        len++;
+    l->count++;
+    l->elems += len;
+    l->bytes += malloc_usable_size(list);
+    l->used += (len + 1) * sizeof(*list);
+    mem_count(MEM_LISTS, malloc_usable_size(list));
+}
+
+/* Tally n and everything under it, from a stack of nodes rather than by
+ * recursing, so trees of any depth fit. */
+static void walk(const node_t *n)
+{
+    ast_stack_t s;
+    const node_t **top;
+
+    if (!n)
+        return;
+    ast_stack_init(&s, sizeof(n));
+    *(const node_t **)ast_stack_push(&s) = n;
+    while ((top = ast_stack_pop(&s))) {
+        n = *top;
+        nodes[n->t].count++;
+        nodes[n->t].bytes += malloc_usable_size((void *)n);
+        mem_count(MEM_NODES, malloc_usable_size((void *)n));
+        switch (n->t) {
+        case EXPR_CALL:
+            tally_list(LIST_ARGS, n->expr.call.args);
+            break;
+        case EXPR_IDENT:
+            count_string(n->expr.ident.name);
+            break;
+        case EXPR_STRUCT:
+            tally_list(LIST_FIELDS, n->expr.struct_.fields);
+            break;
+        case STMT_BLOCK:
+            tally_list(LIST_STMTS, n->stmt.block.stmts);
+            break;
+        case STMT_CASE:
+            tally_list(LIST_VALUES, n->stmt.case_.exprs);
+            tally_list(LIST_STMTS, n->stmt.case_.stmts);
+            break;
+        case STMT_SWITCH:
+            tally_list(LIST_CLAUSES, n->stmt.switch_.clauses);
+            break;
+        case DECL_FUNC:
+            tally_list(LIST_PARAMS, n->decl.func.params);
+            // ast_push_children leaves it out, as it isn't part of the source
+            if (n->decl.func.inline_body)
+                *(const node_t **)ast_stack_push(&s) = n->decl.func.inline_body;
+            break;
+        default:
+            break;
+        }
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+}
+
+/* Print what f's AST holds: memory by subsystem, a histogram of node
+ * kinds and the average length of each kind of list. */
+extern void mem_report_ast(const file_t *f)
+{
+    long num_nodes = 0;
+
+    for (node_t **decls = f->decls; decls && *decls; ++decls)
+        walk(*decls);
+    tally_list(LIST_DECLS, f->decls);
+    fprintf(stderr, "%s:\n", f->filename);
+    fprintf(stderr, "%-10s %10s %12s\n", "subsystem", "count", "bytes");
+    for (int i = 0; i < MEM_NUM_KINDS; ++i)
+        fprintf(stderr, "%-10s %10ld %12ld\n", kind_names[i], kinds[i].count, kinds[i].bytes);
+    for (int i = 0; i < NUM_NODE_TYPES; ++i)
+        num_nodes += nodes[i].count;
+    fprintf(stderr, "%-10s %10s %7s %12s\n", "node", "count", "%", "bytes");
+    for (int i = 0; i < NUM_NODE_TYPES; ++i) {
+        if (nodes[i].count)
+            fprintf(stderr, "%-10s %10ld %6.1f%% %12ld\n", node_names[i], nodes[i].count,
+                    100.0 * nodes[i].count / num_nodes, nodes[i].bytes);
+    }
+    fprintf(stderr, "%-10s %10s %10s %12s %7s\n", "list", "count", "avg len", "bytes", "slack");
+    for (int i = 0; i < NUM_LIST_TYPES; ++i) {
+        list_tally_t *l = &lists[i];
+        if (l->count)
+            fprintf(stderr, "%-10s %10ld %10.2f %12ld %6.1f%%\n", list_names[i], l->count,
+                    (double)l->elems / l->count, l->bytes,
+                    100.0 * (l->bytes - l->used) / l->bytes);
+    }
+    // a second file is a report of its own, apart from scopes
+    for (int i = 0; i < MEM_NUM_KINDS; ++i) {
+        if (i != MEM_SCOPES)
+            kinds[i] = (tally_t){};
+    }
+    for (int i = 0; i < NUM_NODE_TYPES; ++i)
+        nodes[i] = (tally_t){};
+    for (int i = 0; i < NUM_LIST_TYPES; ++i)
+        lists[i] = (list_tally_t){};
+}
+
+static void report(void)
+{
+    struct rusage ru;
+
+    mem_enabled = 0;
+    fprintf(stderr, "%-8s %10s %12s %10s %12s\n", "phase", "allocs", "bytes", "frees", "bytes");
+    for (int i = 0; i <= TRACE_NUM_PHASES; ++i) {
+        if (allocs[i].count || frees[i].count)
+            fprintf(stderr, "%-8s %10ld %12ld %10ld %12ld\n",
+                    i < TRACE_NUM_PHASES ? trace_phase_name(i) : "other",
+                    allocs[i].count, allocs[i].bytes, frees[i].count, frees[i].bytes);
+    }
+    fprintf(stderr, "peak heap: %ld KB\n", peak / 1024);
+    if (!getrusage(RUSAGE_SELF, &ru))
+        fprintf(stderr, "peak RSS: %ld KB\n", ru.ru_maxrss);
+}
+
+/* Start counting. The report is written at exit; trace_start must have
+ * been called for allocations to be charged to phases. */
+extern void mem_start(void)
+{
+    mem_enabled = 1;
+    atexit(report);
+}
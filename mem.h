@@ -0,0 +1,32 @@
+#pragma once
+
+#include "ast.h"
+
+/*
+ * Where the compiler's memory goes, for --mem-stats. Every malloc, calloc
+ * and realloc in the process, libda's included, is counted against the
+ * trace phase it happens in. The AST is walked for what it holds: nodes by
+ * kind, strings, and node lists with the slack their growth left behind.
+ * What the AST doesn't hold, like scopes, is counted where it's allocated
+ * with MEM_COUNT.
+ */
+
+enum {
+    MEM_NODES,
+    MEM_STRINGS,
+    MEM_LISTS,
+    MEM_SCOPES,
+    MEM_NUM_KINDS,
+};
+
+extern int mem_enabled;
+
+extern void mem_start(void);
+extern void mem_count(int kind, size_t bytes);
+extern void mem_report_ast(const file_t *f);
+
+#define MEM_COUNT(kind, bytes) \
+    do { \
+        if (mem_enabled) \
+            mem_count(kind, bytes); \
+    } while (0)
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "ast.h"
+#include "profile.h"
+
+/* How many copies of a loop's body opt_unroll makes by default. */
+#define OPT_UNROLL_FACTOR 4
+
+extern void opt_callgraph(file_t *f);
+extern void opt_cse(file_t *f);
+extern void opt_eval(file_t *f);
+extern void opt_unroll(file_t *f, int factor, profile_t *profile);
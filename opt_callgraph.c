@@ -0,0 +1,340 @@
+/*
+ * The call graph.
+ *
+ * Every function the file declares is a vertex, with an edge to each
+ * function its body calls. From the graph the pass finds:
+ *
+ * - the functions reachable from main and the other functions with external
+ *   linkage. Functions are only ever called by name, so the definitions of
+ *   the rest are dead and dropped from the file.
+ * - the strongly connected components, by Tarjan's algorithm, numbered so
+ *   a component's callees come before it. A function is recursive if its
+ *   component has others in it, or it calls itself.
+ * - the pure functions: those that take and return ints, declare only int
+ *   locals, assign only to locals and call only pure functions. Without
+ *   globals or pointers that leaves them nothing to do but compute their
+ *   result. A component is decided once everything it calls is, so
+ *   mutually recursive functions are pure together. Imported functions are
+ *   judged by the bodies their interface files carry.
+ *
+ * What it finds goes in each function's flags and scc for the passes that
+ * follow. Running it again after opt_eval drops what folding left dead.
+ */
+
+#include "log.h"
+#include "opt.h"
+
+#include <da/da_util.h>
+
+typedef struct {
+    node_t *func; // as ast_find_func finds it
+    da_t callees; // indices of vertices, in the order they're called
+    int computes; // whether it's pure if its callees are
+    int index; // when Tarjan's walk got to it, or -1
+    int low;
+    int on_stack;
+} vertex_t;
+
+typedef struct {
+    vertex_t *vertices; // sorted by name
+    int len;
+    ast_stack_t stack; // of vertices in components not yet closed
+    int num_visited;
+    int num_sccs;
+} graph_t;
+
+/* How far Tarjan's walk has got through a vertex's callees. */
+typedef struct {
+    int v;
+    int next;
+} frame_t;
+
+typedef struct {
+    node_t *func;
+    int order;
+} entry_t;
+
+DA_DEF_HELPERS(int, int);
+DA_DEF_HELPERS(node, node_t *);
+
+static const char *name_of(const node_t *func)
+{
+    return func->decl.func.name->expr.ident.name;
+}
+
+/* By name, then definitions first, then in the order they're declared. */
+static int compare_entries(const void *a, const void *b)
+{
+    const entry_t *x = a;
+    const entry_t *y = b;
+    int cmp = strcmp(name_of(x->func), name_of(y->func));
+
+    if (cmp)
+        return cmp;
+    if (!x->func->decl.func.body != !y->func->decl.func.body)
+        return x->func->decl.func.body ? -1 : 1;
+    return x->order - y->order;
+}
+
+static int compare_name(const void *key, const void *elem)
+{
+    return strcmp(key, name_of(((const vertex_t *)elem)->func));
+}
+
+static int find_vertex(const graph_t *g, const char *name)
+{
+    vertex_t *v = bsearch(name, g->vertices, g->len, sizeof(vertex_t), compare_name);
+    return v ? v - g->vertices : -1;
+}
+
+static int is_int(const node_t *type)
+{
+    return type->t == EXPR_IDENT && !strcmp(type->expr.ident.name, "int");
+}
+
+/* Whether n itself only computes, leaving its children and callees aside. */
+static int computes(const node_t *n)
+{
+    switch (n->t) {
+    case EXPR_BASIC:
+    case EXPR_BINARY:
+    case EXPR_CALL:
+    case EXPR_IDENT:
+    case EXPR_PAREN:
+    case EXPR_UNARY:
+    case STMT_BLOCK:
+    case STMT_BRANCH:
+    case STMT_CASE:
+    case STMT_DECL:
+    case STMT_EMPTY:
+    case STMT_EXPR:
+    case STMT_FOR:
+    case STMT_IF:
+    case STMT_RETURN:
+    case STMT_SWITCH:
+        return 1;
+    case STMT_ASSIGN:
+        return n->stmt.assign.lhs->t == EXPR_IDENT;
+    case DECL_VAR:
+        return is_int(n->decl.var.type);
+    default:
+        return 0;
+    }
+}
+
+/* The body to look into: its own, or the one its interface file carried if
+ * it's imported. */
+static const node_t *body_of(const node_t *func)
+{
+    return func->decl.func.body ? func->decl.func.body : func->decl.func.inline_body;
+}
+
+/* Whether func's signature allows it to be pure. */
+static int is_candidate(const node_t *func)
+{
+    if (!body_of(func) || !is_int(func->decl.func.type))
+        return 0;
+    for (node_t **params = func->decl.func.params; params && *params; ++params) {
+        if (!is_int((*params)->expr.field.type))
+            return 0;
+    }
+    return 1;
+}
+
+/* Collect v's callees and see whether it computes. A call to a function
+ * that isn't declared can't be pure. */
+static void scan_body(graph_t *g, vertex_t *v)
+{
+    ast_stack_t s;
+    const node_t **top;
+
+    v->computes = is_candidate(v->func);
+    if (!body_of(v->func))
+        return;
+    ast_stack_init(&s, sizeof(node_t *));
+    *(const node_t **)ast_stack_push(&s) = body_of(v->func);
+    while ((top = ast_stack_pop(&s))) {
+        const node_t *n = *top;
+        if (v->computes && !computes(n))
+            v->computes = 0;
+        if (n->t == EXPR_CALL) {
+            int w = find_vertex(g, n->expr.call.func->expr.ident.name);
+            if (w < 0)
+                v->computes = 0;
+            else
+                da_append_int(&v->callees, w);
+        }
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+}
+
+/* One vertex per function, as ast_find_func would resolve its name. */
+static void build(graph_t *g, const file_t *f)
+{
+    da_t entries;
+    int order = 0;
+
+    da_init(&entries, sizeof(entry_t));
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC) {
+            entry_t e = {.func = *decls, .order = order++};
+            da_append(&entries, &e);
+        }
+    }
+    qsort(entries.data, da_len(&entries), sizeof(entry_t), compare_entries);
+
+    g->vertices = calloc(da_len(&entries) + 1, sizeof(vertex_t));
+    for (int i = 0; i < da_len(&entries); ++i) {
+        node_t *func = ((entry_t *)da_get(&entries, i))->func;
+        if (g->len && !strcmp(name_of(func), name_of(g->vertices[g->len - 1].func)))
+            continue;
+        vertex_t *v = &g->vertices[g->len++];
+        v->func = func;
+        v->index = -1;
+        da_init_int(&v->callees);
+        func->decl.func.flags = 0;
+        func->decl.func.scc = -1;
+    }
+    da_deinit(&entries);
+    for (int i = 0; i < g->len; ++i)
+        scan_body(g, &g->vertices[i]);
+}
+
+static int callee(vertex_t *v, int i)
+{
+    return *(int *)da_get(&v->callees, i);
+}
+
+/* Number the component v is the root of, which is on top of the stack, and
+ * decide whether it's recursive and pure. */
+static void close_scc(graph_t *g, int v)
+{
+    int *stack = (int *)g->stack.items;
+    int first = g->stack.len;
+    int recursive;
+    int pure = 1;
+
+    do
+        first--;
+    while (stack[first] != v);
+    for (int i = first; i < g->stack.len; ++i) {
+        g->vertices[stack[i]].on_stack = 0;
+        g->vertices[stack[i]].func->decl.func.scc = g->num_sccs;
+    }
+    recursive = g->stack.len - first > 1;
+    for (int i = first; i < g->stack.len; ++i) {
+        vertex_t *x = &g->vertices[stack[i]];
+        pure = pure && x->computes;
+        for (int j = 0; j < da_len(&x->callees); ++j) {
+            const node_t *func = g->vertices[callee(x, j)].func;
+            if (func == x->func)
+                recursive = 1;
+            else if (func->decl.func.scc != g->num_sccs
+                    && !(func->decl.func.flags & FUNC_PURE))
+                pure = 0;
+        }
+    }
+    for (int i = first; i < g->stack.len; ++i) {
+        node_t *func = g->vertices[stack[i]].func;
+        func->decl.func.flags |= (recursive ? FUNC_RECURSIVE : 0) | (pure ? FUNC_PURE : 0);
+    }
+    g->stack.len = first;
+    g->num_sccs++;
+}
+
+static void visit(graph_t *g, ast_stack_t *frames, int v)
+{
+    g->vertices[v].index = g->vertices[v].low = g->num_visited++;
+    g->vertices[v].on_stack = 1;
+    *(int *)ast_stack_push(&g->stack) = v;
+    *(frame_t *)ast_stack_push(frames) = (frame_t){.v = v};
+}
+
+/* Tarjan's algorithm, with a stack of its own for the depth-first walk
+ * since call chains can be as long as the file. */
+static void find_sccs(graph_t *g)
+{
+    ast_stack_t frames;
+    frame_t *top;
+
+    ast_stack_init(&g->stack, sizeof(int));
+    ast_stack_init(&frames, sizeof(frame_t));
+    for (int root = 0; root < g->len; ++root) {
+        if (g->vertices[root].index >= 0)
+            continue;
+        visit(g, &frames, root);
+        while ((top = ast_stack_top(&frames))) {
+            vertex_t *v = &g->vertices[top->v];
+            if (top->next < da_len(&v->callees)) {
+                int w = callee(v, top->next++);
+                if (g->vertices[w].index < 0)
+                    visit(g, &frames, w);
+                else if (g->vertices[w].on_stack && v->low > g->vertices[w].index)
+                    v->low = g->vertices[w].index;
+                continue;
+            }
+            int low = v->low;
+            if (low == v->index)
+                close_scc(g, top->v);
+            ast_stack_pop(&frames);
+            if ((top = ast_stack_top(&frames)) && g->vertices[top->v].low > low)
+                g->vertices[top->v].low = low;
+        }
+    }
+    ast_stack_deinit(&frames);
+    ast_stack_deinit(&g->stack);
+}
+
+static void find_reachable(graph_t *g)
+{
+    ast_stack_t s;
+    int *top;
+
+    ast_stack_init(&s, sizeof(int));
+    for (int i = 0; i < g->len; ++i) {
+        if (g->vertices[i].func->decl.func.body && ast_is_exported(name_of(g->vertices[i].func)))
+            *(int *)ast_stack_push(&s) = i;
+    }
+    while ((top = ast_stack_pop(&s))) {
+        vertex_t *v = &g->vertices[*top];
+        if (v->func->decl.func.flags & FUNC_REACHABLE)
+            continue;
+        v->func->decl.func.flags |= FUNC_REACHABLE;
+        for (int j = 0; j < da_len(&v->callees); ++j)
+            *(int *)ast_stack_push(&s) = callee(v, j);
+    }
+    ast_stack_deinit(&s);
+}
+
+/* Drop every declaration of a function this file defines but can't reach. */
+static void drop_dead(graph_t *g, file_t *f)
+{
+    da_t decls;
+
+    da_init_node(&decls);
+    for (node_t **d = f->decls; d && *d; ++d) {
+        if ((*d)->t == DECL_FUNC) {
+            const node_t *func = g->vertices[find_vertex(g, name_of(*d))].func;
+            if (func->decl.func.body && !(func->decl.func.flags & FUNC_REACHABLE))
+                continue;
+        }
+        da_append_node(&decls, *d);
+    }
+    da_append_node(&decls, NULL);
+    free(f->decls);
+    f->decls = decls.data;
+}
+
+extern void opt_callgraph(file_t *f)
+{
+    graph_t g = {};
+
+    build(&g, f);
+    find_sccs(&g);
+    find_reachable(&g);
+    drop_dead(&g, f);
+    for (int i = 0; i < g.len; ++i)
+        da_deinit(&g.vertices[i].callees);
+    free(g.vertices);
+}
@@ -0,0 +1,501 @@
+/*
+ * Local value numbering.
+ *
+ * Each straight-line run of statements in a block is numbered in evaluation
+ * order. A pure expression whose number was already computed earlier in the
+ * run is replaced by an identifier that holds the value: either a variable
+ * assigned it and not reassigned since, or a hidden temporary declared just
+ * before the statement that first computed it.
+ *
+ * Identifiers are numbered by their current value, so an assignment gives
+ * the variable a fresh number and everything built on the old one stops
+ * matching. Struct fields aren't numbered at all, and storing to one gives
+ * the whole variable a fresh number. Locals never escape, so a call can't
+ * clobber a numbered value; a call's own result is never numbered since it
+ * may have side effects.
+ */
+
+#include "log.h"
+#include "opt.h"
+#include "token.h"
+
+#include <stdio.h> // asprintf
+
+#include <da/da.h>
+#include <da/da_util.h>
+
+/* Expressions are numbered by recursing, so functions that nest deeper
+ * than this are left alone rather than overflow the stack. */
+#define MAX_NESTING 1000
+
+typedef struct {
+    node_type_t t;
+    int op;
+    int x;
+    int y;
+    int64_t value;
+    int vn;
+} expr_t;
+
+typedef struct {
+    const char *name;
+    int vn;
+} var_t;
+
+typedef struct {
+    node_t *first; // first unconditional occurrence
+    int stmt;      // index of the statement containing it
+    int seq;       // evaluation order within the run
+    const char *home;
+} value_t;
+
+typedef struct {
+    int stmt;
+    int seq;
+    node_t *decl;
+} temp_t;
+
+typedef struct {
+    da_t exprs;
+    da_t vars;
+    da_t values; // indexed by value number - 1
+    da_t temps;
+    int stmt;
+    int seq;
+} lvn_t;
+
+DA_DEF_HELPERS(expr, expr_t);
+DA_DEF_HELPERS(var, var_t);
+DA_DEF_HELPERS(value, value_t);
+DA_DEF_HELPERS(temp, temp_t);
+DA_DEF_HELPERS(node, node_t *);
+
+static void lvn_stmts(node_t ***list);
+static void lvn_nested(node_t *n);
+
+static void init(lvn_t *l)
+{
+    da_init_expr(&l->exprs);
+    da_init_var(&l->vars);
+    da_init_value(&l->values);
+    da_init_temp(&l->temps);
+    l->stmt = 0;
+    l->seq = 0;
+}
+
+static void reset(lvn_t *l)
+{
+    da_deinit(&l->exprs);
+    da_deinit(&l->vars);
+    da_deinit(&l->values);
+    da_init_expr(&l->exprs);
+    da_init_var(&l->vars);
+    da_init_value(&l->values);
+}
+
+static int fresh(lvn_t *l)
+{
+    value_t v = {};
+    da_append_value(&l->values, v);
+    return da_len(&l->values);
+}
+
+static value_t *value(lvn_t *l, int vn)
+{
+    return da_get(&l->values, vn - 1);
+}
+
+static var_t *find_var(lvn_t *l, const char *name)
+{
+    for (int i = da_len(&l->vars) - 1; i >= 0; --i) {
+        var_t *v = da_get(&l->vars, i);
+        if (!strcmp(v->name, name))
+            return v;
+    }
+    return NULL;
+}
+
+static void set_var(lvn_t *l, const char *name, int vn)
+{
+    var_t *v = find_var(l, name);
+    if (v) {
+        v->vn = vn;
+    } else {
+        var_t tmp = {.name = name, .vn = vn};
+        da_append_var(&l->vars, tmp);
+    }
+}
+
+static int is_commutative(int op)
+{
+    switch (op) {
+    case token_ADD:
+    case token_MUL:
+    case token_AND:
+    case token_OR:
+    case token_XOR:
+    case token_EQL:
+    case token_NEQ:
+    case token_LAND:
+    case token_LOR:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int is_conditional(int op)
+{
+    return op == token_LAND || op == token_LOR;
+}
+
+static expr_t key(const node_t *n, int x, int y)
+{
+    expr_t k = {.t = n->t};
+    switch (n->t) {
+    case EXPR_BASIC:
+        k.op = n->expr.basic.kind;
+        k.value = n->expr.basic.value;
+        break;
+    case EXPR_UNARY:
+        k.op = n->expr.unary.op;
+        k.x = x;
+        break;
+    case EXPR_BINARY:
+        k.op = n->expr.binary.op;
+        if (is_commutative(k.op) && y < x) {
+            k.x = y;
+            k.y = x;
+        } else {
+            k.x = x;
+            k.y = y;
+        }
+        break;
+    default:
+        PANIC("no key for node type %d", n->t);
+    }
+    return k;
+}
+
+static int find_expr(lvn_t *l, const expr_t *k)
+{
+    for (int i = 0; i < da_len(&l->exprs); ++i) {
+        expr_t *e = da_get(&l->exprs, i);
+        if (e->t == k->t && e->op == k->op && e->x == k->x && e->y == k->y
+                && e->value == k->value)
+            return e->vn;
+    }
+    return 0;
+}
+
+static int insert_expr(lvn_t *l, expr_t k)
+{
+    int vn = find_expr(l, &k);
+    if (!vn) {
+        k.vn = vn = fresh(l);
+        da_append_expr(&l->exprs, k);
+    }
+    return vn;
+}
+
+/* The value number n would get, without recording anything; 0 if new. */
+static int peek(lvn_t *l, const node_t *n)
+{
+    var_t *v;
+    int x, y;
+    switch (n->t) {
+    case EXPR_BASIC:
+        return find_expr(l, (expr_t []){key(n, 0, 0)});
+    case EXPR_IDENT:
+        v = find_var(l, n->expr.ident.name);
+        return v ? v->vn : 0;
+    case EXPR_PAREN:
+        return peek(l, n->expr.paren.x);
+    case EXPR_UNARY:
+        if (!(x = peek(l, n->expr.unary.expr)))
+            return 0;
+        return find_expr(l, (expr_t []){key(n, x, 0)});
+    case EXPR_BINARY:
+        if (!(x = peek(l, n->expr.binary.x)))
+            return 0;
+        if (!(y = peek(l, n->expr.binary.y)))
+            return 0;
+        return find_expr(l, (expr_t []){key(n, x, y)});
+    default:
+        return 0;
+    }
+}
+
+static node_t *new_ident(int pos, const char *name)
+{
+    node_t tmp = {
+        .t = EXPR_IDENT,
+        .pos = pos,
+        .expr.ident.name = strdup(name),
+    };
+    return copy(&tmp);
+}
+
+static void replace(node_t *n, const char *name)
+{
+    node_t *ident = new_ident(n->pos, name);
+    *n = *ident;
+    free(ident);
+}
+
+/* Whether vn currently lives in a variable or temporary. */
+static int is_held(lvn_t *l, int vn)
+{
+    value_t *v = value(l, vn);
+    if (!v->home)
+        return 0;
+    var_t *var = find_var(l, v->home);
+    return var && var->vn == vn;
+}
+
+/* Move the first occurrence of vn into a temporary declared before its
+ * statement and leave an identifier in its place. */
+static void spill(lvn_t *l, int vn)
+{
+    static int num_temps = 0;
+    value_t *v = value(l, vn);
+    char *name = NULL;
+    asprintf(&name, "vn.%d", ++num_temps);
+    node_t var = {
+        .t = DECL_VAR,
+        .pos = v->first->pos,
+        .decl.var = {
+            .name = new_ident(v->first->pos, name),
+            .type = new_ident(v->first->pos, "int"),
+            .value = copy(v->first),
+        },
+    };
+    node_t decl = {
+        .t = STMT_DECL,
+        .pos = v->first->pos,
+        .stmt.decl.decl = copy(&var),
+    };
+    temp_t tmp = {.stmt = v->stmt, .seq = v->seq, .decl = copy(&decl)};
+    da_append_temp(&l->temps, tmp);
+    replace(v->first, name);
+    v->first = NULL;
+    v->home = name;
+    set_var(l, name, vn);
+}
+
+static int reuse(lvn_t *l, node_t *n, int vn)
+{
+    if (!is_held(l, vn)) {
+        if (!value(l, vn)->first)
+            return 0;
+        spill(l, vn);
+    }
+    replace(n, value(l, vn)->home);
+    return 1;
+}
+
+static int visit(lvn_t *l, node_t *n, int cond)
+{
+    int vn, x, y;
+    var_t *v;
+
+    switch (n->t) {
+    case EXPR_BASIC:
+        return insert_expr(l, key(n, 0, 0));
+
+    case EXPR_IDENT:
+        if ((v = find_var(l, n->expr.ident.name)))
+            return v->vn;
+        vn = fresh(l);
+        set_var(l, n->expr.ident.name, vn);
+        return vn;
+
+    case EXPR_PAREN:
+        return visit(l, n->expr.paren.x, cond);
+
+    case EXPR_CALL:
+        for (node_t **args = n->expr.call.args; args && *args; ++args)
+            visit(l, *args, cond);
+        return fresh(l);
+
+    case EXPR_SELECTOR:
+        // fields aren't tracked, so every load is a new value
+        visit(l, n->expr.selector.x, cond);
+        return fresh(l);
+
+    case EXPR_UNARY:
+    case EXPR_BINARY:
+        if ((vn = peek(l, n)) && reuse(l, n, vn))
+            return vn;
+        if (n->t == EXPR_UNARY) {
+            x = visit(l, n->expr.unary.expr, cond);
+            y = 0;
+        } else {
+            x = visit(l, n->expr.binary.x, cond);
+            y = visit(l, n->expr.binary.y,
+                    cond || is_conditional(n->expr.binary.op));
+        }
+        vn = insert_expr(l, key(n, x, y));
+        if (!cond && !value(l, vn)->first && !is_held(l, vn)) {
+            value_t *v = value(l, vn);
+            v->first = n;
+            v->stmt = l->stmt;
+            v->seq = l->seq++;
+        }
+        return vn;
+
+    default:
+        PANIC("unexpected node type in expression: %d", n->t);
+        return 0;
+    }
+}
+
+static void bind(lvn_t *l, const char *name, int vn, const node_t *x)
+{
+    set_var(l, name, vn);
+    if (x && x->t != EXPR_IDENT && x->t != EXPR_BASIC
+            && !is_held(l, vn))
+        value(l, vn)->home = name;
+}
+
+/* The variable a chain of selectors starts from. */
+static const char *root_name(const node_t *n)
+{
+    while (n->t == EXPR_SELECTOR)
+        n = n->expr.selector.x;
+    if (n->t != EXPR_IDENT)
+        PANIC("cannot assign to a field of a temporary");
+    return n->expr.ident.name;
+}
+
+static int temp_cmp(const void *a, const void *b)
+{
+    const temp_t *x = a;
+    const temp_t *y = b;
+    if (x->stmt != y->stmt)
+        return x->stmt - y->stmt;
+    return x->seq - y->seq;
+}
+
+static void insert_temps(lvn_t *l, node_t ***list)
+{
+    int n = da_len(&l->temps);
+    if (!n)
+        return;
+    temp_t *temps = da_get(&l->temps, 0);
+    qsort(temps, n, sizeof(*temps), temp_cmp);
+    da_t stmts;
+    da_init_node(&stmts);
+    int i = 0;
+    int t = 0;
+    for (node_t **s = *list; s && *s; ++s, ++i) {
+        while (t < n && temps[t].stmt == i)
+            da_append_node(&stmts, temps[t++].decl);
+        da_append_node(&stmts, *s);
+    }
+    da_append_node(&stmts, NULL);
+    *list = stmts.data;
+}
+
+/* Number the runs in a block's or a case clause's statements, which temps
+ * may be inserted into. */
+static void lvn_stmts(node_t ***list)
+{
+    lvn_t l;
+    init(&l);
+    for (node_t **stmts = *list; stmts && *stmts;
+            ++stmts, ++l.stmt) {
+        node_t *s = *stmts;
+        node_t *decl;
+        int vn;
+        switch (s->t) {
+        case STMT_ASSIGN:
+            vn = visit(&l, s->stmt.assign.rhs, 0);
+            if (s->stmt.assign.lhs->t == EXPR_SELECTOR)
+                set_var(&l, root_name(s->stmt.assign.lhs), fresh(&l));
+            else if (ast_assign_op(s->stmt.assign.tok))
+                set_var(&l, s->stmt.assign.lhs->expr.ident.name, fresh(&l));
+            else
+                bind(&l, s->stmt.assign.lhs->expr.ident.name, vn,
+                        s->stmt.assign.rhs);
+            break;
+        case STMT_DECL:
+            decl = s->stmt.decl.decl;
+            if (decl->t != DECL_VAR)
+                break;
+            if (decl->decl.var.value)
+                vn = visit(&l, decl->decl.var.value, 0);
+            else
+                vn = fresh(&l);
+            bind(&l, decl->decl.var.name->expr.ident.name, vn,
+                    decl->decl.var.value);
+            break;
+        case STMT_EXPR:
+            visit(&l, s->stmt.expr.x, 0);
+            break;
+        case STMT_RETURN:
+            if (s->stmt.return_.expr)
+                visit(&l, s->stmt.return_.expr, 0);
+            reset(&l);
+            break;
+        case STMT_IF:
+            visit(&l, s->stmt.if_.cond, 0);
+            lvn_nested(s);
+            reset(&l);
+            break;
+        case STMT_SWITCH:
+            visit(&l, s->stmt.switch_.tag, 0);
+            lvn_nested(s);
+            reset(&l);
+            break;
+        case STMT_BLOCK:
+        case STMT_FOR:
+            lvn_nested(s);
+            reset(&l);
+            break;
+        case STMT_BRANCH:
+            reset(&l);
+            break;
+        default:
+            break;
+        }
+    }
+    insert_temps(&l, list);
+    da_deinit(&l.exprs);
+    da_deinit(&l.vars);
+    da_deinit(&l.values);
+    da_deinit(&l.temps);
+}
+
+/* Statements nested in n begin runs of their own. */
+static void lvn_nested(node_t *n)
+{
+    switch (n->t) {
+    case STMT_BLOCK:
+        lvn_stmts(&n->stmt.block.stmts);
+        break;
+    case STMT_IF:
+        lvn_nested(n->stmt.if_.body);
+        if (n->stmt.if_.else_)
+            lvn_nested(n->stmt.if_.else_);
+        break;
+    case STMT_FOR:
+        lvn_nested(n->stmt.for_.body);
+        break;
+    case STMT_SWITCH:
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses)
+            lvn_stmts(&(*clauses)->stmt.case_.stmts);
+        break;
+    default:
+        break;
+    }
+}
+
+extern void opt_cse(file_t *f)
+{
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body
+                && ast_depth(*decls) <= MAX_NESTING)
+            lvn_stmts(&(*decls)->decl.func.body->stmt.block.stmts);
+    }
+}
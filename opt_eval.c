@@ -0,0 +1,624 @@
+/*
+ * Compile-time evaluation of pure calls.
+ *
+ * A call to a function opt_callgraph found pure, whose arguments are all
+ * constants, is run by a small AST interpreter and replaced by the constant
+ * it returns. Besides literals, a local declared once with a constant
+ * initializer and never assigned is a constant. Imported functions run from
+ * the bodies their interface files carry, when they're small enough to be
+ * carried.
+ *
+ * Each call's outcome is remembered by function and arguments, so the same
+ * call is only run once per file, whether it succeeded or not.
+ *
+ * The interpreter gives up, leaving the call to run at runtime, when the
+ * calls in a file take more than MAX_STEPS steps between them, calls nest
+ * deeper than MAX_DEPTH or what they run nests deeper than MAX_NESTING, and
+ * when the compiled code's result wouldn't be defined: dividing by zero,
+ * overflowing a division, reading an uninitialized variable or falling off
+ * the end with break or continue. Arithmetic wraps at 32 bits as it does in
+ * the compiled code.
+ */
+
+#include "log.h"
+#include "opt.h"
+#include "token.h"
+
+#include <limits.h> // INT_MIN
+
+#include <da/da_util.h>
+
+#define MAX_STEPS 1000000
+#define MAX_DEPTH 1000
+#define MAX_NESTING 10000
+#define MEMO_BUCKETS 1024
+
+typedef struct _binding {
+    const char *name;
+    int value;
+    int known;
+    struct _binding *next;
+} binding_t;
+
+/* The outcome of a call already run. */
+typedef struct _memo {
+    const node_t *func;
+    int *args;
+    int num_args;
+    int ok;
+    int value;
+    struct _memo *next;
+} memo_t;
+
+typedef enum {
+    RUN_NEXT,
+    RUN_BREAK,
+    RUN_CONTINUE,
+    RUN_RETURN,
+    RUN_FAIL,
+} run_t;
+
+typedef struct {
+    const file_t *file;
+    binding_t *bindings;
+    binding_t *frame; // the caller's bindings, which the callee can't see
+    memo_t *memo[MEMO_BUCKETS];
+    int steps; // for the whole file, so a slow call can't cost it each time
+    int depth; // of calls
+    int nesting; // of eval and run, which recurse
+    int ret;
+} interp_t;
+
+/* A local of the function being folded. */
+typedef struct {
+    const char *name;
+    const node_t *value;
+    int decls;
+    int assigned;
+} local_t;
+
+DA_DEF_HELPERS(node, node_t *);
+DA_DEF_HELPERS(local, local_t);
+
+static int eval(interp_t *in, const node_t *n, int *v);
+
+static const node_t *find_pure(interp_t *in, const node_t *call)
+{
+    const node_t *func = ast_find_func(in->file, call->expr.call.func->expr.ident.name);
+    return func && (func->decl.func.flags & FUNC_PURE) ? func : NULL;
+}
+
+/* The body to run func with: its own, or the one its interface file
+ * carried if it's imported. */
+static node_t *body_of(const node_t *func)
+{
+    return func->decl.func.body ? func->decl.func.body : func->decl.func.inline_body;
+}
+
+static void bind(interp_t *in, const char *name, int value, int known)
+{
+    binding_t b = {.name = name, .value = value, .known = known, .next = in->bindings};
+    in->bindings = copy(&b);
+}
+
+static void unbind(interp_t *in, binding_t *mark)
+{
+    while (in->bindings != mark) {
+        binding_t *b = in->bindings;
+        in->bindings = b->next;
+        free(b);
+    }
+}
+
+static binding_t *lookup(interp_t *in, const char *name)
+{
+    for (binding_t *b = in->bindings; b != in->frame; b = b->next) {
+        if (!strcmp(b->name, name))
+            return b;
+    }
+    return NULL;
+}
+
+static int literal(const node_t *n, int *v)
+{
+    if (n->expr.basic.kind != token_INT || n->expr.basic.value > INT_MAX)
+        return 0;
+    *v = n->expr.basic.value;
+    return 1;
+}
+
+static int binary(int op, int x, int y, int *v)
+{
+    unsigned ux = x;
+    unsigned uy = y;
+
+    switch (op) {
+    case token_ADD:
+        *v = ux + uy;
+        return 1;
+    case token_SUB:
+        *v = ux - uy;
+        return 1;
+    case token_MUL:
+        *v = ux * uy;
+        return 1;
+    case token_QUO:
+    case token_REM:
+        if (!y || (x == INT_MIN && y == -1))
+            return 0;
+        *v = op == token_QUO ? x / y : x % y;
+        return 1;
+    case token_AND:
+        *v = x & y;
+        return 1;
+    case token_OR:
+        *v = x | y;
+        return 1;
+    case token_XOR:
+        *v = x ^ y;
+        return 1;
+    case token_AND_NOT:
+        *v = x & ~y;
+        return 1;
+    case token_SHL:
+        *v = ux << (y & 31);
+        return 1;
+    case token_SHR:
+        *v = x >> (y & 31);
+        return 1;
+    case token_EQL:
+        *v = x == y;
+        return 1;
+    case token_NEQ:
+        *v = x != y;
+        return 1;
+    case token_LSS:
+        *v = x < y;
+        return 1;
+    case token_LEQ:
+        *v = x <= y;
+        return 1;
+    case token_GTR:
+        *v = x > y;
+        return 1;
+    case token_GEQ:
+        *v = x >= y;
+        return 1;
+    case token_LAND:
+        *v = x && y;
+        return 1;
+    case token_LOR:
+        *v = x || y;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static run_t run(interp_t *in, const node_t *n);
+
+static memo_t **memo_bucket(interp_t *in, const node_t *func, const int *args, int num_args)
+{
+    unsigned h = (uintptr_t)func >> 4;
+
+    for (int i = 0; i < num_args; ++i)
+        h = h * 31 + args[i];
+    return &in->memo[h % MEMO_BUCKETS];
+}
+
+static memo_t *find_memo(memo_t *m, const node_t *func, const int *args, int num_args)
+{
+    for (; m; m = m->next) {
+        if (m->func == func && m->num_args == num_args
+                && !memcmp(m->args, args, num_args * sizeof(*args)))
+            return m;
+    }
+    return NULL;
+}
+
+static void free_memo(interp_t *in)
+{
+    for (int i = 0; i < MEMO_BUCKETS; ++i) {
+        while (in->memo[i]) {
+            memo_t *m = in->memo[i];
+            in->memo[i] = m->next;
+            free(m->args);
+            free(m);
+        }
+    }
+}
+
+/* Run func with its parameters bound to args. */
+static int apply(interp_t *in, const node_t *func, const int *args, int num_args, int *v)
+{
+    node_t **params = func->decl.func.params;
+    binding_t *frame = in->frame;
+    binding_t *mark = in->bindings;
+    run_t r;
+
+    in->frame = mark;
+    for (int i = 0; i < num_args; ++i) {
+        if (!params || !params[i]) {
+            unbind(in, mark);
+            in->frame = frame;
+            return 0;
+        }
+        bind(in, params[i]->expr.field.name->expr.ident.name, args[i], 1);
+    }
+    if (params && params[num_args]) {
+        unbind(in, mark);
+        in->frame = frame;
+        return 0;
+    }
+    in->depth++;
+    r = run(in, body_of(func));
+    in->depth--;
+    unbind(in, mark);
+    in->frame = frame;
+    switch (r) {
+    case RUN_RETURN:
+        *v = in->ret;
+        return 1;
+    case RUN_NEXT:
+        // falling off the end returns 0
+        *v = 0;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static int call(interp_t *in, const node_t *n, int *v)
+{
+    const node_t *func = find_pure(in, n);
+    memo_t **bucket;
+    memo_t *m;
+    int num_args = 0;
+
+    if (!func || in->depth == MAX_DEPTH)
+        return 0;
+    for (node_t **args = n->expr.call.args; args && *args; ++args)
+        num_args++;
+    int values[num_args + 1];
+    for (int i = 0; i < num_args; ++i) {
+        if (!eval(in, n->expr.call.args[i], &values[i]))
+            return 0;
+    }
+    bucket = memo_bucket(in, func, values, num_args);
+    if (!(m = find_memo(*bucket, func, values, num_args))) {
+        memo_t tmp = {.func = func, .num_args = num_args, .next = *bucket};
+        tmp.ok = apply(in, func, values, num_args, &tmp.value);
+        tmp.args = malloc((num_args + 1) * sizeof(*values));
+        memcpy(tmp.args, values, num_args * sizeof(*values));
+        m = *bucket = copy(&tmp);
+    }
+    if (m->ok)
+        *v = m->value;
+    return m->ok;
+}
+
+static int eval_node(interp_t *in, const node_t *n, int *v)
+{
+    binding_t *b;
+    int x;
+    int y;
+
+    switch (n->t) {
+    case EXPR_BASIC:
+        return literal(n, v);
+    case EXPR_BINARY:
+        return eval(in, n->expr.binary.x, &x) && eval(in, n->expr.binary.y, &y)
+            && binary(n->expr.binary.op, x, y, v);
+    case EXPR_CALL:
+        return call(in, n, v);
+    case EXPR_IDENT:
+        if (!(b = lookup(in, n->expr.ident.name)) || !b->known)
+            return 0;
+        *v = b->value;
+        return 1;
+    case EXPR_PAREN:
+        return eval(in, n->expr.paren.x, v);
+    case EXPR_UNARY:
+        if (!eval(in, n->expr.unary.expr, &x))
+            return 0;
+        switch (n->expr.unary.op) {
+        case token_SUB:
+            *v = 0u - (unsigned)x;
+            return 1;
+        case token_BITWISE_NOT:
+            *v = ~x;
+            return 1;
+        case token_NOT:
+            *v = !x;
+            return 1;
+        default:
+            return 0;
+        }
+    default:
+        return 0;
+    }
+}
+
+static int eval(interp_t *in, const node_t *n, int *v)
+{
+    int ok;
+
+    if (++in->steps > MAX_STEPS || in->nesting == MAX_NESTING)
+        return 0;
+    in->nesting++;
+    ok = eval_node(in, n, v);
+    in->nesting--;
+    return ok;
+}
+
+static run_t run(interp_t *in, const node_t *n);
+
+/* Run the clause the tag selects and the ones it falls through to. */
+static run_t run_switch(interp_t *in, const node_t *n)
+{
+    binding_t *mark = in->bindings;
+    node_t **clauses = n->stmt.switch_.clauses;
+    node_t **match = NULL;
+    node_t **def = NULL;
+    run_t r = RUN_NEXT;
+    int v;
+
+    if (!eval(in, n->stmt.switch_.tag, &v))
+        return RUN_FAIL;
+    for (node_t **c = clauses; *c && !match; ++c) {
+        if (!(*c)->stmt.case_.exprs)
+            def = c;
+        for (node_t **exprs = (*c)->stmt.case_.exprs; exprs && *exprs; ++exprs) {
+            if ((*exprs)->expr.basic.value == v)
+                match = c;
+        }
+    }
+    if (!match)
+        match = def;
+    for (node_t **c = match; c && *c; ++c) {
+        for (node_t **stmts = (*c)->stmt.case_.stmts; *stmts && r == RUN_NEXT; ++stmts)
+            r = run(in, *stmts);
+        unbind(in, mark);
+        if (r != RUN_NEXT || !ast_falls_through(*c))
+            break;
+    }
+    return r == RUN_BREAK ? RUN_NEXT : r;
+}
+
+static run_t run_node(interp_t *in, const node_t *n)
+{
+    binding_t *mark = in->bindings;
+    binding_t *b;
+    node_t tmp;
+    run_t r = RUN_NEXT;
+    int v = 0;
+
+    switch (n->t) {
+    case DECL_VAR:
+        if (n->decl.var.value && !eval(in, n->decl.var.value, &v))
+            return RUN_FAIL;
+        bind(in, n->decl.var.name->expr.ident.name, v, n->decl.var.value != NULL);
+        return RUN_NEXT;
+    case STMT_ASSIGN:
+        if (!(b = lookup(in, n->stmt.assign.lhs->expr.ident.name))
+                || !eval(in, ast_assign_value(n, &tmp), &v))
+            return RUN_FAIL;
+        b->value = v;
+        b->known = 1;
+        return RUN_NEXT;
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts && r == RUN_NEXT; ++stmts)
+            r = run(in, *stmts);
+        unbind(in, mark);
+        return r;
+    case STMT_BRANCH:
+        if (n->stmt.branch.tok == token_FALLTHROUGH)
+            return RUN_NEXT;
+        return n->stmt.branch.tok == token_BREAK ? RUN_BREAK : RUN_CONTINUE;
+    case STMT_DECL:
+        return run(in, n->stmt.decl.decl);
+    case STMT_EMPTY:
+        return RUN_NEXT;
+    case STMT_EXPR:
+        return eval(in, n->stmt.expr.x, &v) ? RUN_NEXT : RUN_FAIL;
+    case STMT_FOR:
+        if (n->stmt.for_.init)
+            r = run(in, n->stmt.for_.init);
+        while (r == RUN_NEXT) {
+            if (n->stmt.for_.cond) {
+                if (!eval(in, n->stmt.for_.cond, &v))
+                    r = RUN_FAIL;
+                else if (!v)
+                    break;
+            }
+            if (r == RUN_NEXT)
+                r = run(in, n->stmt.for_.body);
+            if (r == RUN_BREAK) {
+                r = RUN_NEXT;
+                break;
+            }
+            if ((r == RUN_NEXT || r == RUN_CONTINUE) && n->stmt.for_.post)
+                r = run(in, n->stmt.for_.post);
+            else if (r == RUN_CONTINUE)
+                r = RUN_NEXT;
+        }
+        unbind(in, mark);
+        return r;
+    case STMT_IF:
+        if (!eval(in, n->stmt.if_.cond, &v))
+            return RUN_FAIL;
+        if (v)
+            return run(in, n->stmt.if_.body);
+        return n->stmt.if_.else_ ? run(in, n->stmt.if_.else_) : RUN_NEXT;
+    case STMT_RETURN:
+        if (!n->stmt.return_.expr || !eval(in, n->stmt.return_.expr, &in->ret))
+            return RUN_FAIL;
+        return RUN_RETURN;
+    case STMT_SWITCH:
+        return run_switch(in, n);
+    default:
+        return RUN_FAIL;
+    }
+}
+
+static run_t run(interp_t *in, const node_t *n)
+{
+    run_t r;
+
+    if (++in->steps > MAX_STEPS || in->nesting == MAX_NESTING)
+        return RUN_FAIL;
+    in->nesting++;
+    r = run_node(in, n);
+    in->nesting--;
+    return r;
+}
+
+static node_t *new_basic(int pos, unsigned v)
+{
+    node_t tmp = {
+        .t = EXPR_BASIC,
+        .pos = pos,
+        .expr.basic = {.kind = token_INT, .value = v},
+    };
+    return copy(&tmp);
+}
+
+/* Replace n by the literal v, negated if it's negative. INT_MIN has no
+ * literal to negate, so it isn't replaced. */
+static void replace(node_t *n, int v)
+{
+    node_t *lit;
+
+    if (v == INT_MIN)
+        return;
+    lit = new_basic(n->pos, v < 0 ? -v : v);
+    if (v < 0) {
+        node_t tmp = {
+            .t = EXPR_UNARY,
+            .pos = n->pos,
+            .expr.unary = {.op = token_SUB, .expr = lit},
+        };
+        *n = tmp;
+    } else {
+        *n = *lit;
+        free(lit);
+    }
+}
+
+/* Evaluate the pure calls with constant arguments in n, innermost first so
+ * that their results make the calls around them constant too. A call is
+ * pushed once to have its arguments pushed, and again, NULL-marked, to be
+ * evaluated after them. */
+static void fold(interp_t *in, node_t *n)
+{
+    ast_stack_t s;
+    node_t **top;
+    int v;
+
+    ast_stack_init(&s, sizeof(n));
+    *(node_t **)ast_stack_push(&s) = n;
+    while ((top = ast_stack_pop(&s))) {
+        if (!(n = *top)) {
+            n = *(node_t **)ast_stack_pop(&s);
+            // arguments that aren't constants stop eval when it looks them up
+            if (find_pure(in, n) && eval(in, n, &v))
+                replace(n, v);
+            continue;
+        }
+        if (n->t == EXPR_CALL) {
+            *(node_t **)ast_stack_push(&s) = n;
+            ast_stack_push(&s);
+        }
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+}
+
+static local_t *find_local(da_t *locals, const char *name)
+{
+    for (int i = 0; i < da_len(locals); ++i) {
+        local_t *l = da_get(locals, i);
+        if (!strcmp(l->name, name))
+            return l;
+    }
+    da_append_local(locals, (local_t){.name = name});
+    return da_get(locals, da_len(locals) - 1);
+}
+
+static void scan_locals(da_t *locals, const node_t *n)
+{
+    local_t *l;
+
+    if (!n)
+        return;
+    switch (n->t) {
+    case DECL_VAR:
+        l = find_local(locals, n->decl.var.name->expr.ident.name);
+        l->value = n->decl.var.value;
+        l->decls++;
+        break;
+    case STMT_ASSIGN:
+        n = n->stmt.assign.lhs;
+        while (n->t == EXPR_SELECTOR || n->t == EXPR_PAREN)
+            n = n->t == EXPR_PAREN ? n->expr.paren.x : n->expr.selector.x;
+        if (n->t == EXPR_IDENT)
+            find_local(locals, n->expr.ident.name)->assigned = 1;
+        break;
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            scan_locals(locals, *stmts);
+        break;
+    case STMT_DECL:
+        scan_locals(locals, n->stmt.decl.decl);
+        break;
+    case STMT_FOR:
+        scan_locals(locals, n->stmt.for_.init);
+        scan_locals(locals, n->stmt.for_.post);
+        scan_locals(locals, n->stmt.for_.body);
+        break;
+    case STMT_IF:
+        scan_locals(locals, n->stmt.if_.body);
+        scan_locals(locals, n->stmt.if_.else_);
+        break;
+    case STMT_SWITCH:
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+            for (node_t **stmts = (*clauses)->stmt.case_.stmts; *stmts; ++stmts)
+                scan_locals(locals, *stmts);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Fold the calls in func with its constant locals bound, in the order
+ * they're declared so each can use the ones before it. */
+static void fold_func(interp_t *in, node_t *func)
+{
+    da_t locals;
+    int v;
+
+    da_init_local(&locals);
+    for (node_t **params = func->decl.func.params; params && *params; ++params)
+        find_local(&locals, (*params)->expr.field.name->expr.ident.name)->decls++;
+    scan_locals(&locals, func->decl.func.body);
+    for (int i = 0; i < da_len(&locals); ++i) {
+        local_t *l = da_get(&locals, i);
+        if (l->decls == 1 && !l->assigned && l->value && eval(in, l->value, &v))
+            bind(in, l->name, v, 1);
+    }
+    fold(in, func->decl.func.body);
+    unbind(in, NULL);
+    da_deinit(&locals);
+}
+
+extern void opt_eval(file_t *f)
+{
+    interp_t in = {.file = f};
+
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body)
+            fold_func(&in, *decls);
+    }
+    free_memo(&in);
+}
@@ -0,0 +1,482 @@
+/*
+ * Loop unrolling.
+ *
+ * A for loop can be unrolled when it counts: its condition compares a
+ * variable against a constant or a local, its post statement steps the
+ * variable by a constant towards that bound, and its body doesn't break,
+ * continue, or assign or declare either of them. If the loop starts from a
+ * constant and runs at most MAX_FULL_UNROLL times, it's replaced by that
+ * many copies of its body. Otherwise factor copies go in a loop that runs
+ * while that many iterations are left, and the original loop does the
+ * rest:
+ *
+ *     init;
+ *     for ; i < e - (factor - 1) * step; { body; post; ... body; post; }
+ *     for ; i < e; post { body }
+ *
+ * Arithmetic wraps, so with a local bound the first condition also checks
+ * that subtracting from it didn't. Inner loops are unrolled first, and a
+ * loop only while the copies of its body come to at most
+ * MAX_UNROLLED_NODES nodes.
+ *
+ * With counts from --profile-use, a loop whose back-edge was never taken
+ * is left alone, and one taken at least HOT_LOOP_COUNT times gets twice
+ * the copies. Copies share their original's profile site, so the counts
+ * still apply to them when the backend reads them.
+ */
+
+#include "log.h"
+#include "opt.h"
+#include "token.h"
+
+#include <limits.h> // INT_MAX
+
+#include <da/da_util.h>
+
+#define MAX_FULL_UNROLL 8
+#define MAX_UNROLLED_NODES 256
+#define HOT_LOOP_COUNT 10000
+
+/* A loop's induction variable, as its init, cond and post use it. */
+typedef struct {
+    const char *var;
+    int op; // of the condition, with var on the left
+    const node_t *bound;
+    int step;
+    int has_start;
+    int start;
+} induction_t;
+
+DA_DEF_HELPERS(node, node_t *);
+
+static profile_t *profile;
+
+static int is_ident(const node_t *n, const char *name)
+{
+    return n->t == EXPR_IDENT && !strcmp(n->expr.ident.name, name);
+}
+
+static node_t *new_basic(int pos, int value)
+{
+    node_t tmp = {
+        .t = EXPR_BASIC,
+        .pos = pos,
+        .expr.basic = {.kind = token_INT, .value = value},
+    };
+    return copy(&tmp);
+}
+
+static node_t *new_binary(int pos, int op, node_t *x, node_t *y)
+{
+    node_t tmp = {
+        .t = EXPR_BINARY,
+        .pos = pos,
+        .expr.binary = {.op = op, .x = x, .y = y},
+    };
+    return copy(&tmp);
+}
+
+static node_t *new_block(int pos, node_t **stmts)
+{
+    node_t tmp = {
+        .t = STMT_BLOCK,
+        .pos = pos,
+        .stmt.block.stmts = stmts,
+    };
+    return copy(&tmp);
+}
+
+static void push_slot(ast_stack_t *s, node_t **slot)
+{
+    *(node_t ***)ast_stack_push(s) = slot;
+}
+
+/* Point *list at a list of its own, its elements to be cloned in turn. */
+static void clone_list(ast_stack_t *s, node_t ***list)
+{
+    da_t out;
+
+    if (!*list)
+        return;
+    da_init_node(&out);
+    for (node_t **l = *list; *l; ++l)
+        da_append_node(&out, *l);
+    da_append_node(&out, NULL);
+    *list = out.data;
+    for (node_t **l = *list; *l; ++l)
+        push_slot(s, l);
+}
+
+/* A deep copy of n, so every copy of a loop body has nodes of its own to
+ * hang slots and labels on. Names are shared. The pointers still to be
+ * pointed at copies are kept on a stack rather than recursed into, so
+ * nesting costs heap instead of C stack. */
+static node_t *clone(const node_t *n)
+{
+    ast_stack_t s;
+    node_t ***top;
+    node_t *out = (node_t *)n;
+
+    ast_stack_init(&s, sizeof(node_t **));
+    push_slot(&s, &out);
+    while ((top = ast_stack_pop(&s))) {
+        node_t **slot = *top;
+        node_t *c;
+        if (!*slot)
+            continue;
+        c = copy(*slot);
+        if (profile)
+            profile_share(profile, c, *slot);
+        *slot = c;
+        switch (c->t) {
+        case EXPR_BINARY:
+            push_slot(&s, &c->expr.binary.x);
+            push_slot(&s, &c->expr.binary.y);
+            break;
+        case EXPR_CALL:
+            push_slot(&s, &c->expr.call.func);
+            clone_list(&s, &c->expr.call.args);
+            break;
+        case EXPR_FIELD:
+            push_slot(&s, &c->expr.field.name);
+            push_slot(&s, &c->expr.field.type);
+            break;
+        case EXPR_PAREN:
+            push_slot(&s, &c->expr.paren.x);
+            break;
+        case EXPR_SELECTOR:
+            push_slot(&s, &c->expr.selector.x);
+            push_slot(&s, &c->expr.selector.sel);
+            break;
+        case EXPR_STRUCT:
+            clone_list(&s, &c->expr.struct_.fields);
+            break;
+        case EXPR_UNARY:
+            push_slot(&s, &c->expr.unary.expr);
+            break;
+        case STMT_ASSIGN:
+            push_slot(&s, &c->stmt.assign.lhs);
+            push_slot(&s, &c->stmt.assign.rhs);
+            break;
+        case STMT_BLOCK:
+            clone_list(&s, &c->stmt.block.stmts);
+            break;
+        case STMT_CASE:
+            clone_list(&s, &c->stmt.case_.exprs);
+            clone_list(&s, &c->stmt.case_.stmts);
+            break;
+        case STMT_DECL:
+            push_slot(&s, &c->stmt.decl.decl);
+            break;
+        case STMT_EXPR:
+            push_slot(&s, &c->stmt.expr.x);
+            break;
+        case STMT_FOR:
+            push_slot(&s, &c->stmt.for_.init);
+            push_slot(&s, &c->stmt.for_.cond);
+            push_slot(&s, &c->stmt.for_.post);
+            push_slot(&s, &c->stmt.for_.body);
+            break;
+        case STMT_IF:
+            push_slot(&s, &c->stmt.if_.cond);
+            push_slot(&s, &c->stmt.if_.body);
+            push_slot(&s, &c->stmt.if_.else_);
+            break;
+        case STMT_RETURN:
+            push_slot(&s, &c->stmt.return_.expr);
+            break;
+        case STMT_SWITCH:
+            push_slot(&s, &c->stmt.switch_.tag);
+            clone_list(&s, &c->stmt.switch_.clauses);
+            break;
+        case DECL_VAR:
+            push_slot(&s, &c->decl.var.name);
+            push_slot(&s, &c->decl.var.type);
+            push_slot(&s, &c->decl.var.value);
+            break;
+        default:
+            break;
+        }
+    }
+    ast_stack_deinit(&s);
+    return out;
+}
+
+/* The constant step post adds to var, in *step. */
+static int find_step(const node_t *post, const char *var, int *step)
+{
+    const node_t *rhs;
+    int c;
+
+    if (post->t != STMT_ASSIGN || !is_ident(post->stmt.assign.lhs, var))
+        return 0;
+    rhs = post->stmt.assign.rhs;
+    switch (post->stmt.assign.tok) {
+    case token_ADD_ASSIGN:
+        return ast_const_value(rhs, step);
+    case token_SUB_ASSIGN:
+        if (!ast_const_value(rhs, &c) || c == INT_MIN)
+            return 0;
+        *step = -c;
+        return 1;
+    case token_ASSIGN:
+        if (rhs->t != EXPR_BINARY)
+            return 0;
+        if (rhs->expr.binary.op == token_ADD && is_ident(rhs->expr.binary.x, var))
+            return ast_const_value(rhs->expr.binary.y, step);
+        if (rhs->expr.binary.op == token_ADD && is_ident(rhs->expr.binary.y, var))
+            return ast_const_value(rhs->expr.binary.x, step);
+        if (rhs->expr.binary.op == token_SUB && is_ident(rhs->expr.binary.x, var)
+                && ast_const_value(rhs->expr.binary.y, &c) && c != INT_MIN) {
+            *step = -c;
+            return 1;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/* The value init starts var from, if it's a constant. */
+static int find_start(const node_t *init, const char *var, int *start)
+{
+    const node_t *decl;
+
+    if (!init)
+        return 0;
+    if (init->t == STMT_ASSIGN && init->stmt.assign.tok == token_ASSIGN
+            && is_ident(init->stmt.assign.lhs, var))
+        return ast_const_value(init->stmt.assign.rhs, start);
+    if (init->t != STMT_DECL)
+        return 0;
+    decl = init->stmt.decl.decl;
+    return decl->t == DECL_VAR && is_ident(decl->decl.var.name, var)
+        && decl->decl.var.value && ast_const_value(decl->decl.var.value, start);
+}
+
+static int find_induction(const node_t *n, induction_t *ind)
+{
+    const node_t *cond = n->stmt.for_.cond;
+    int v;
+
+    if (!cond || !n->stmt.for_.post || cond->t != EXPR_BINARY
+            || cond->expr.binary.x->t != EXPR_IDENT)
+        return 0;
+    *ind = (induction_t){
+        .var = cond->expr.binary.x->expr.ident.name,
+        .op = cond->expr.binary.op,
+        .bound = cond->expr.binary.y,
+    };
+    if (!ast_const_value(ind->bound, &v)
+            && (ind->bound->t != EXPR_IDENT || is_ident(ind->bound, ind->var)))
+        return 0;
+    if (!find_step(n->stmt.for_.post, ind->var, &ind->step))
+        return 0;
+    switch (ind->op) {
+    case token_LSS:
+    case token_LEQ:
+        if (ind->step <= 0)
+            return 0;
+        break;
+    case token_GTR:
+    case token_GEQ:
+        if (ind->step >= 0)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+    ind->has_start = find_start(n->stmt.for_.init, ind->var, &ind->start);
+    return 1;
+}
+
+/* Whether n names the variable or the bound. */
+static int is_loop_name(const node_t *n, const induction_t *ind)
+{
+    return n->t == EXPR_IDENT && (is_ident(n, ind->var)
+            || (ind->bound->t == EXPR_IDENT && is_ident(n, ind->bound->expr.ident.name)));
+}
+
+/* The number of nodes in body, or -1 if it breaks, continues, or assigns
+ * or declares the variable or the bound. */
+static int count_body(const node_t *body, const induction_t *ind)
+{
+    ast_stack_t s;
+    const node_t **top;
+    int count = 0;
+
+    ast_stack_init(&s, sizeof(node_t *));
+    *(const node_t **)ast_stack_push(&s) = body;
+    while (count >= 0 && (top = ast_stack_pop(&s))) {
+        const node_t *n = *top;
+        count++;
+        if (n->t == STMT_BRANCH
+                || (n->t == STMT_ASSIGN && is_loop_name(n->stmt.assign.lhs, ind))
+                || (n->t == DECL_VAR && is_loop_name(n->decl.var.name, ind)))
+            count = -1;
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+    return count;
+}
+
+static int holds(int op, int x, int y)
+{
+    switch (op) {
+    case token_LSS:
+        return x < y;
+    case token_LEQ:
+        return x <= y;
+    case token_GTR:
+        return x > y;
+    default:
+        return x >= y;
+    }
+}
+
+/* How many times the loop runs if it's known and at most limit, -1
+ * otherwise. */
+static int trip_count(const induction_t *ind, int limit)
+{
+    int bound;
+    int i;
+
+    if (!ind->has_start || !ast_const_value(ind->bound, &bound))
+        return -1;
+    i = ind->start;
+    for (int n = 0; n <= limit; ++n) {
+        if (!holds(ind->op, i, bound))
+            return n;
+        i = (unsigned)i + ind->step;
+    }
+    return -1;
+}
+
+/* Append count copies of body and post to stmts. */
+static void append_copies(da_t *stmts, const node_t *n, int count)
+{
+    for (int k = 0; k < count; ++k) {
+        da_append_node(stmts, clone(n->stmt.for_.body));
+        da_append_node(stmts, clone(n->stmt.for_.post));
+    }
+}
+
+/* The condition for factor more iterations: var op bound - (factor - 1) *
+ * step, and with a local bound, that the subtraction didn't wrap. NULL if
+ * it would with a constant one. */
+static node_t *unrolled_cond(const induction_t *ind, int pos, int factor)
+{
+    int64_t k = (int64_t)(factor - 1) * ind->step;
+    node_t *limit;
+    int bound;
+
+    if (k > INT_MAX || k < -INT_MAX)
+        return NULL;
+    if (ast_const_value(ind->bound, &bound)) {
+        if (bound - k > INT_MAX || bound - k < INT_MIN)
+            return NULL;
+        limit = new_basic(pos, bound - k);
+    } else {
+        limit = new_binary(pos, k > 0 ? token_SUB : token_ADD, clone(ind->bound),
+                new_basic(pos, k > 0 ? k : -k));
+    }
+    node_t tmp = {.t = EXPR_IDENT, .pos = pos, .expr.ident.name = (char *)ind->var};
+    node_t *cond = new_binary(pos, ind->op, copy(&tmp), limit);
+    if (limit->t == EXPR_BASIC)
+        return cond;
+    return new_binary(pos, token_LAND,
+            new_binary(pos, k > 0 ? token_LSS : token_GTR, clone(limit), clone(ind->bound)),
+            cond);
+}
+
+/* Replace loop n with the unrolled form if it has one. */
+static void unroll(node_t *n, int factor)
+{
+    induction_t ind;
+    da_t stmts;
+    int size;
+    int trips;
+    node_t *cond;
+
+    if (profile && profile->counts) {
+        unsigned long long count = profile_count(profile, n, 0);
+        if (!count)
+            return;
+        if (count >= HOT_LOOP_COUNT && factor <= MAX_UNROLLED_NODES / 2)
+            factor *= 2;
+    }
+    if (factor < 2 || !find_induction(n, &ind)
+            || (size = count_body(n->stmt.for_.body, &ind)) < 0)
+        return;
+    trips = trip_count(&ind, MAX_FULL_UNROLL);
+    da_init_node(&stmts);
+    if (n->stmt.for_.init)
+        da_append_node(&stmts, n->stmt.for_.init);
+    if (trips >= 0 && trips * size <= MAX_UNROLLED_NODES) {
+        append_copies(&stmts, n, trips);
+    } else if (trips < 0 && factor * size <= MAX_UNROLLED_NODES
+            && (cond = unrolled_cond(&ind, n->pos, factor))) {
+        da_t body;
+        node_t *rest = copy(n);
+        if (profile)
+            profile_share(profile, rest, n);
+        node_t tmp = {
+            .t = STMT_FOR,
+            .pos = n->pos,
+            .stmt.for_.cond = cond,
+        };
+        da_init_node(&body);
+        append_copies(&body, n, factor);
+        da_append_node(&body, NULL);
+        tmp.stmt.for_.body = new_block(n->pos, body.data);
+        rest->stmt.for_.init = NULL;
+        da_append_node(&stmts, copy(&tmp));
+        da_append_node(&stmts, rest);
+    } else {
+        da_deinit(&stmts);
+        return;
+    }
+    da_append_node(&stmts, NULL);
+    *n = (node_t){
+        .t = STMT_BLOCK,
+        .pos = n->pos,
+        .stmt.block.stmts = stmts.data,
+    };
+}
+
+static void walk(node_t *n, int factor)
+{
+    if (!n)
+        return;
+    switch (n->t) {
+    case STMT_BLOCK:
+        for (node_t **stmts = n->stmt.block.stmts; stmts && *stmts; ++stmts)
+            walk(*stmts, factor);
+        break;
+    case STMT_FOR:
+        walk(n->stmt.for_.body, factor);
+        unroll(n, factor);
+        break;
+    case STMT_IF:
+        walk(n->stmt.if_.body, factor);
+        walk(n->stmt.if_.else_, factor);
+        break;
+    case STMT_SWITCH:
+        for (node_t **clauses = n->stmt.switch_.clauses; *clauses; ++clauses) {
+            for (node_t **stmts = (*clauses)->stmt.case_.stmts; *stmts; ++stmts)
+                walk(*stmts, factor);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+extern void opt_unroll(file_t *f, int factor, profile_t *p)
+{
+    profile = p;
+    for (node_t **decls = f->decls; decls && *decls; ++decls) {
+        if ((*decls)->t == DECL_FUNC && (*decls)->decl.func.body)
+            walk((*decls)->decl.func.body, factor);
+    }
+}
@@ -3,12 +3,16 @@
 #include "parser.h"
 #include "scanner.h"
 #include "token.h"
+#include "trace.h"
 
 #include <stdio.h> // BUFSIZ
 
 #include <da/da.h>
 #include <da/da_util.h>
 
+// how deep statements may nest; the passes after the parser walk them by
+// recursing
+#define MAX_NESTING 1000
 
 typedef struct {
     const char *filename;
@@ -16,6 +20,7 @@ typedef struct {
     token_t tok;
     char lit[BUFSIZ];
     int pos;
+    int nesting; // of the statements being parsed
     scope_t *top_scope;
 } parser_t;
 
@@ -46,29 +51,61 @@ static void close_scope(parser_t *p)
     p->top_scope = p->top_scope->outer;
 }
 
+/* The line and column of pos, for messages. */
+static void position(parser_t *p, int pos, int *line, int *column)
+{
+    *line = 1;
+    *column = 1;
+    for (int i = 0; i < pos-1; ++i) {
+        if (p->scanner.src[i] == '\n') {
+            (*line)++;
+            *column = 1;
+        } else {
+            (*column)++;
+        }
+    }
+}
+
 static void next(parser_t *p)
 {
+    int line, column;
+
     p->pos = p->scanner.offset;
+    TRACE_BEGIN(TRACE_SCAN, NULL);
     p->tok = scanner_scan(&p->scanner, p->lit);
-    LOGV("%d:%d, tok %s", p->scanner.line, p->scanner.column, token_string(p->tok));
+    TRACE_END();
+    LOGV("%d: tok %s %s", p->pos, token_string(p->tok), p->lit);
+    if (p->tok == token_ILLEGAL) {
+        // p->pos is where the whitespace before the token began
+        position(p, p->scanner.offset - strlen(p->lit), &line, &column);
+        PANIC("%s:%d:%d: %s: %s", p->filename, line, column, p->scanner.error, p->lit);
+    }
 }
 
 static void error_expected(parser_t *p, int pos, const char *msg)
 {
-    int line = 1;
-    int column = 1;
-    for (int i = 0; i < pos-1; ++i) {
-        if (p->scanner.src[i] == '\n') {
-            line++;
-            column = 1;
-        } else {
-            column++;
-        }
-    }
+    int line, column;
+
+    position(p, pos, &line, &column);
     PANIC("%s:%d:%d: expected %s, got %s", p->filename, line, column, msg,
             token_string(p->tok));
 }
 
+static void error_at(parser_t *p, int pos, const char *msg)
+{
+    int line, column;
+
+    position(p, pos, &line, &column);
+    PANIC("%s:%d:%d: %s", p->filename, line, column, msg);
+}
+
+/* Enter a statement that holds others, at pos. */
+static void nest(parser_t *p, int pos)
+{
+    if (++p->nesting > MAX_NESTING)
+        error_at(p, pos, "statements nested too deeply");
+}
+
 static int accept(parser_t *p, token_t tok)
 {
     if (p->tok == tok) {
@@ -169,12 +206,14 @@ static node_t *parse_block_stmt(parser_t *p)
 {
     int pos = expect(p, token_LBRACE);
     da_t stmts;
+    nest(p, pos);
     da_init_node(&stmts);
     while (p->tok != token_RBRACE) {
         da_append_node(&stmts, parse_stmt(p));
     }
     da_append_node(&stmts, NULL);
     expect(p, token_RBRACE);
+    p->nesting--;
     node_t tmp = {
         .t=STMT_BLOCK,
         .pos = pos,
@@ -195,25 +234,12 @@ static node_t *parse_operand(parser_t *p)
                 .pos = p->pos,
                 .expr.basic = {
                     .kind = p->tok,
-                    .value = strdup(p->lit),
+                    .value = p->scanner.value,
                 },
             };
             next(p);
             return copy(&tmp);
         } while (0);
-    case token_LPAREN:
-        do {
-            int pos = expect(p, token_LPAREN);
-            node_t *x = parse_expr(p);
-            expect(p, token_RPAREN);
-            node_t tmp = {
-                .t = EXPR_PAREN,
-                .pos = pos,
-                .expr.paren.x = x,
-            };
-            return copy(&tmp);
-        } while (0);
-        break;
     default:
         error_expected(p, p->pos, "expression");
         break;
@@ -221,100 +247,226 @@ static node_t *parse_operand(parser_t *p)
     return NULL;
 }
 
-static node_t *parse_call(parser_t *p, node_t *func)
+static node_t *parse_selector(parser_t *p, node_t *x)
 {
-    int pos = expect(p, token_LPAREN);
-    da_t args;
-    da_init_node(&args);
-    while (p->tok != token_RPAREN) {
-        da_append_node(&args, parse_expr(p));
-        if (!accept(p, token_COMMA))
-            break;
-    }
-    if (da_len(&args))
-        da_append_node(&args, NULL);
-    expect(p, token_RPAREN);
+    int pos = expect(p, token_PERIOD);
     node_t tmp = {
-        .t = EXPR_CALL,
+        .t = EXPR_SELECTOR,
         .pos = pos,
-        .expr.call = {
-            .func = func,
-            .args = args.data,
+        .expr.selector = {
+            .x = x,
+            .sel = parse_ident(p),
         },
     };
     return copy(&tmp);
 }
 
-static node_t *parse_primary_expr(parser_t *p)
-{
-    node_t *x = parse_operand(p);
-    if (p->tok == token_LPAREN)
-        x = parse_call(p, x);
-    return x;
-}
+/*
+ * Expressions are parsed with explicit stacks instead of recursing on every
+ * operator and parenthesis, so generated code can nest them as deep as
+ * memory allows. A group is what's between a pair of parentheses, a call's
+ * argument list or the whole expression. The operators waiting for their
+ * right operand sit on a stack above where their group began.
+ */
+
+typedef struct {
+    int tok; // token_LPAREN, token_COMMA for a call's arguments or token_EOF
+    int pos;
+    int num_ops; // how many operators were waiting when the group began
+    node_t *func;
+    da_t args;
+} group_t;
+
+typedef struct {
+    int op;
+    int prec;
+    int pos;
+    node_t *x; // a binary operator's left operand, NULL for a prefix one
+} op_t;
 
-static node_t *parse_unary_expr(parser_t *p)
+static int is_unary_op(int tok)
 {
-    switch (p->tok) {
+    switch (tok) {
     case token_NOT:
     case token_ADD:
     case token_SUB:
     case token_BITWISE_NOT:
-        do {
-            node_t tmp = {
-                .t = EXPR_UNARY,
-                .pos = p->pos,
-                .expr.unary.op = p->tok,
-            };
-            next(p);
-            tmp.expr.unary.expr = parse_unary_expr(p);
-            return copy(&tmp);
-        } while (0);
+        return 1;
     default:
-        return parse_primary_expr(p);
+        return 0;
     }
 }
 
-static node_t *parse_binary_expr(parser_t *p, int prec1)
+/* Apply the operators above base that bind at least as tightly as prec to
+ * x, the operand after them. Prefix operators bind tightest of all. */
+static node_t *reduce(ast_stack_t *ops, int base, int prec, node_t *x)
 {
-    node_t *x = parse_unary_expr(p);
-    for (;;) {
-        int op = p->tok;
-        int oprec = token_precedence(op);
-        if (oprec < prec1)
-            return x;
-        int pos = expect(p, op);
-        node_t *y = parse_binary_expr(p, oprec+1);
+    op_t *o;
+
+    while (ops->len > base && (o = ast_stack_top(ops))->prec >= prec) {
         node_t tmp = {
             .t = EXPR_BINARY,
-            .pos = pos,
+            .pos = o->pos,
             .expr.binary = {
-                .op = op,
-                .x = x,
-                .y = y,
+                .op = o->op,
+                .x = o->x,
+                .y = x,
             },
         };
+        if (!o->x) {
+            tmp = (node_t){
+                .t = EXPR_UNARY,
+                .pos = o->pos,
+                .expr.unary = {
+                    .op = o->op,
+                    .expr = x,
+                },
+            };
+        }
         x = copy(&tmp);
+        ast_stack_pop(ops);
     }
     return x;
 }
 
+static node_t *finish_call(parser_t *p, ast_stack_t *groups)
+{
+    group_t *g = ast_stack_pop(groups);
+    if (da_len(&g->args))
+        da_append_node(&g->args, NULL);
+    expect(p, token_RPAREN);
+    node_t tmp = {
+        .t = EXPR_CALL,
+        .pos = g->pos,
+        .expr.call = {
+            .func = g->func,
+            .args = g->args.data,
+        },
+    };
+    return copy(&tmp);
+}
+
 static node_t *parse_expr(parser_t *p)
 {
-    return parse_binary_expr(p, token_lowest_prec+1);
+    ast_stack_t groups;
+    ast_stack_t ops;
+    group_t *g;
+    op_t *o;
+    node_t *x = NULL;
+    int want_operand = 1;
+    int can_call = 0;
+
+    ast_stack_init(&groups, sizeof(group_t));
+    ast_stack_init(&ops, sizeof(op_t));
+    ((group_t *)ast_stack_push(&groups))->tok = token_EOF;
+    for (;;) {
+        if (want_operand) {
+            while (is_unary_op(p->tok)) {
+                o = ast_stack_push(&ops);
+                o->op = p->tok;
+                o->prec = token_unary_prec;
+                o->pos = p->pos;
+                next(p);
+            }
+            if (p->tok == token_LPAREN) {
+                g = ast_stack_push(&groups);
+                g->tok = token_LPAREN;
+                g->num_ops = ops.len;
+                g->pos = expect(p, token_LPAREN);
+                continue;
+            }
+            x = parse_operand(p);
+            want_operand = 0;
+            can_call = 1;
+        }
+        // an operand can be called once and then have its fields selected
+        if (can_call && p->tok == token_LPAREN) {
+            g = ast_stack_push(&groups);
+            g->tok = token_COMMA;
+            g->num_ops = ops.len;
+            g->func = x;
+            da_init_node(&g->args);
+            g->pos = expect(p, token_LPAREN);
+            can_call = 0;
+            if (p->tok != token_RPAREN) {
+                want_operand = 1;
+                continue;
+            }
+            x = finish_call(p, &groups);
+        }
+        while (p->tok == token_PERIOD)
+            x = parse_selector(p, x);
+
+        g = ast_stack_top(&groups);
+        int op = p->tok;
+        int prec = token_precedence(op);
+        if (prec > token_lowest_prec) {
+            x = reduce(&ops, g->num_ops, prec, x);
+            o = ast_stack_push(&ops);
+            o->op = op;
+            o->prec = prec;
+            o->x = x;
+            o->pos = expect(p, op);
+            want_operand = 1;
+            continue;
+        }
+        x = reduce(&ops, g->num_ops, token_lowest_prec + 1, x);
+        if (g->tok == token_LPAREN) {
+            node_t tmp = {
+                .t = EXPR_PAREN,
+                .pos = g->pos,
+                .expr.paren.x = x,
+            };
+            ast_stack_pop(&groups);
+            expect(p, token_RPAREN);
+            x = copy(&tmp);
+            can_call = 1;
+        } else if (g->tok == token_COMMA) {
+            da_append_node(&g->args, x);
+            if (accept(p, token_COMMA) && p->tok != token_RPAREN) {
+                want_operand = 1;
+                continue;
+            }
+            x = finish_call(p, &groups);
+            can_call = 0;
+        } else {
+            break;
+        }
+    }
+    ast_stack_deinit(&groups);
+    ast_stack_deinit(&ops);
+    return x;
 }
 
+/* x++ and x-- are parsed as x += 1 and x -= 1. */
 static node_t *parse_simple_stmt(parser_t *p)
 {
     node_t *lhs = parse_expr(p);
-    if (accept(p, token_ASSIGN)) {
-        node_t *rhs = parse_expr(p);
+    int tok = p->tok;
+    if (tok == token_ASSIGN || ast_assign_op(tok) || tok == token_INC
+            || tok == token_DEC) {
+        int pos = expect(p, tok);
+        node_t *rhs;
+        if (tok == token_INC || tok == token_DEC) {
+            node_t one = {
+                .t = EXPR_BASIC,
+                .pos = pos,
+                .expr.basic = {
+                    .kind = token_INT,
+                    .value = 1,
+                },
+            };
+            rhs = copy(&one);
+            tok = tok == token_INC ? token_ADD_ASSIGN : token_SUB_ASSIGN;
+        } else {
+            rhs = parse_expr(p);
+        }
         node_t tmp = {
             .t = STMT_ASSIGN,
             .pos = lhs->pos,
             .stmt.assign = {
                 .lhs = lhs,
-                .tok = token_ASSIGN,
+                .tok = tok,
                 .rhs = rhs,
             },
         };
@@ -362,7 +514,10 @@ static node_t *parse_if_stmt(parser_t *p)
     node_t *else_ = NULL;
     if (accept(p, token_ELSE)) {
         if (p->tok == token_IF) {
+            // an else if chain nests as deep as if it were in braces
+            nest(p, p->pos);
             else_ = parse_if_stmt(p);
+            p->nesting--;
         } else {
             else_ = parse_block_stmt(p);
         }
@@ -408,6 +563,210 @@ static node_t *parse_for_stmt(parser_t *p)
     return copy(&tmp);
 }
 
+typedef struct {
+    node_t *n;
+    int done; // its operands have been folded onto the value stack
+} fold_t;
+
+/* Fold a case value's operator, wrapping like the compiled code. Division
+ * and shifts aren't constant here, as the backends differ on their edge
+ * cases. */
+static int fold_op(int op, uint32_t *x, uint32_t y)
+{
+    switch (op) {
+    case token_ADD:
+        *x += y;
+        return 1;
+    case token_SUB:
+        *x -= y;
+        return 1;
+    case token_MUL:
+        *x *= y;
+        return 1;
+    case token_AND:
+        *x &= y;
+        return 1;
+    case token_OR:
+        *x |= y;
+        return 1;
+    case token_XOR:
+        *x ^= y;
+        return 1;
+    case token_AND_NOT:
+        *x &= ~y;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* A case value: int literals under parentheses, any of + - ~ and the binary
+ * + - * & | ^ &^, so that INT_MIN can be written -2147483647 - 1. It is
+ * folded to the int the tag is compared with. */
+static node_t *parse_case_value(parser_t *p)
+{
+    node_t *x = parse_expr(p);
+    node_t *n;
+    fold_t *top;
+    ast_stack_t todo;
+    ast_stack_t values;
+    uint32_t *operand;
+    uint32_t value;
+
+    ast_stack_init(&todo, sizeof(fold_t));
+    ast_stack_init(&values, sizeof(uint32_t));
+    ((fold_t *)ast_stack_push(&todo))->n = x;
+    while ((top = ast_stack_top(&todo))) {
+        n = top->n;
+        if (n->t == EXPR_PAREN) {
+            top->n = n->expr.paren.x;
+        } else if (n->t == EXPR_BASIC && n->expr.basic.kind == token_INT) {
+            ast_stack_pop(&todo);
+            *(uint32_t *)ast_stack_push(&values) = n->expr.basic.value;
+        } else if (n->t == EXPR_UNARY && !top->done) {
+            top->done = 1;
+            ((fold_t *)ast_stack_push(&todo))->n = n->expr.unary.expr;
+        } else if (n->t == EXPR_UNARY) {
+            ast_stack_pop(&todo);
+            operand = ast_stack_top(&values);
+            if (n->expr.unary.op == token_SUB)
+                *operand = -*operand;
+            else if (n->expr.unary.op == token_BITWISE_NOT)
+                *operand = ~*operand;
+            else if (n->expr.unary.op != token_ADD)
+                error_at(p, x->pos, "case value must be an integer constant");
+        } else if (n->t == EXPR_BINARY && !top->done) {
+            top->done = 1;
+            ((fold_t *)ast_stack_push(&todo))->n = n->expr.binary.y;
+            ((fold_t *)ast_stack_push(&todo))->n = n->expr.binary.x;
+        } else if (n->t == EXPR_BINARY) {
+            ast_stack_pop(&todo);
+            value = *(uint32_t *)ast_stack_pop(&values);
+            if (!fold_op(n->expr.binary.op, ast_stack_top(&values), value))
+                error_at(p, x->pos, "case value must be an integer constant");
+        } else {
+            error_at(p, x->pos, "case value must be an integer constant");
+        }
+    }
+    value = *(uint32_t *)ast_stack_pop(&values);
+    ast_stack_deinit(&todo);
+    ast_stack_deinit(&values);
+    node_t tmp = {
+        .t = EXPR_BASIC,
+        .pos = x->pos,
+        .expr.basic = {
+            .kind = token_INT,
+            .value = (int32_t)value,
+        },
+    };
+    return copy(&tmp);
+}
+
+/* case x, y: or default:, then statements up to the next clause. A
+ * fallthrough may only end a clause. */
+static node_t *parse_case_clause(parser_t *p)
+{
+    int pos = p->pos;
+    node_t **exprs = NULL;
+    da_t stmts;
+
+    if (!accept(p, token_DEFAULT)) {
+        da_t values;
+        expect(p, token_CASE);
+        da_init_node(&values);
+        do
+            da_append_node(&values, parse_case_value(p));
+        while (accept(p, token_COMMA));
+        da_append_node(&values, NULL);
+        exprs = values.data;
+    }
+    expect(p, token_COLON);
+    da_init_node(&stmts);
+    while (p->tok != token_CASE && p->tok != token_DEFAULT && p->tok != token_RBRACE) {
+        if (p->tok == token_FALLTHROUGH) {
+            da_append_node(&stmts, parse_branch_stmt(p, token_FALLTHROUGH));
+            if (p->tok != token_CASE && p->tok != token_DEFAULT && p->tok != token_RBRACE)
+                error_at(p, p->pos, "fallthrough must be the last statement of a case");
+            break;
+        }
+        da_append_node(&stmts, parse_stmt(p));
+    }
+    da_append_node(&stmts, NULL);
+    node_t tmp = {
+        .t = STMT_CASE,
+        .pos = pos,
+        .stmt.case_ = {
+            .exprs = exprs,
+            .stmts = stmts.data,
+        },
+    };
+    return copy(&tmp);
+}
+
+static int compare_values(const void *a, const void *b)
+{
+    int64_t x = (*(node_t **)a)->expr.basic.value;
+    int64_t y = (*(node_t **)b)->expr.basic.value;
+    return (x > y) - (x < y);
+}
+
+/* At most one default, no value twice, and nothing to fall into from the
+ * last clause. */
+static void check_switch(parser_t *p, node_t **clauses)
+{
+    node_t *default_ = NULL;
+    node_t *last = NULL;
+    da_t values;
+
+    da_init_node(&values);
+    for (node_t **c = clauses; *c; ++c) {
+        if (!(*c)->stmt.case_.exprs) {
+            if (default_)
+                error_at(p, (*c)->pos, "multiple defaults in switch");
+            default_ = *c;
+        }
+        for (node_t **x = (*c)->stmt.case_.exprs; x && *x; ++x)
+            da_append_node(&values, *x);
+        last = *c;
+    }
+    if (da_len(&values))
+        qsort(values.data, da_len(&values), sizeof(node_t *), compare_values);
+    for (int i = 1; i < da_len(&values); ++i) {
+        node_t *x = *(node_t **)da_get(&values, i);
+        if (!compare_values(da_get(&values, i - 1), &x))
+            error_at(p, x->pos, "duplicate case in switch");
+    }
+    da_deinit(&values);
+    if (last && ast_falls_through(last))
+        error_at(p, last->pos, "cannot fallthrough final case in switch");
+}
+
+static node_t *parse_switch_stmt(parser_t *p)
+{
+    int pos = expect(p, token_SWITCH);
+    node_t *tag = parse_expr(p);
+    da_t clauses;
+
+    nest(p, pos);
+    expect(p, token_LBRACE);
+    da_init_node(&clauses);
+    while (p->tok != token_RBRACE)
+        da_append_node(&clauses, parse_case_clause(p));
+    da_append_node(&clauses, NULL);
+    expect(p, token_RBRACE);
+    p->nesting--;
+    check_switch(p, clauses.data);
+    node_t tmp = {
+        .t = STMT_SWITCH,
+        .pos = pos,
+        .stmt.switch_ = {
+            .tag = tag,
+            .clauses = clauses.data,
+        },
+    };
+    return copy(&tmp);
+}
+
 static node_t *parse_stmt(parser_t *p)
 {
     switch (p->tok) {
@@ -439,6 +798,11 @@ static node_t *parse_stmt(parser_t *p)
         return parse_if_stmt(p);
     case token_FOR:
         return parse_for_stmt(p);
+    case token_SWITCH:
+        return parse_switch_stmt(p);
+    case token_FALLTHROUGH:
+        error_at(p, p->pos, "fallthrough statement out of place");
+        return NULL;
     case token_SEMICOLON:
         do {
             node_t tmp = { .t = STMT_EMPTY, .pos = p->pos, };
@@ -491,6 +855,7 @@ static node_t *parse_func_decl(parser_t *p)
         recv = ident;
         ident = parse_ident(p);
     }
+    TRACE_BEGIN(TRACE_PARSE, ident->expr.ident.name);
     node_t **params = parse_params(p);
     node_t *type = parse_ident(p);
     node_t *body = NULL;
@@ -498,6 +863,7 @@ static node_t *parse_func_decl(parser_t *p)
         body = parse_block_stmt(p);
     else
         expect(p, token_SEMICOLON);
+    TRACE_END();
     node_t tmp = {
         .t = DECL_FUNC,
         .pos = pos,
@@ -527,9 +893,34 @@ static node_t *parse_decl(parser_t *p)
     }
 }
 
+/* package name; and import name; come before any declaration, the package
+ * clause first. */
+static node_t **parse_imports(parser_t *p)
+{
+    da_t imports;
+
+    if (p->tok != token_IMPORT)
+        return NULL;
+    da_init_node(&imports);
+    while (accept(p, token_IMPORT)) {
+        da_append_node(&imports, parse_ident(p));
+        expect(p, token_SEMICOLON);
+    }
+    da_append_node(&imports, NULL);
+    return imports.data;
+}
+
 static file_t *_parse_file(parser_t *p)
 {
+    node_t *package = NULL;
+    node_t **imports;
     da_t decls;
+
+    if (accept(p, token_PACKAGE)) {
+        package = parse_ident(p);
+        expect(p, token_SEMICOLON);
+    }
+    imports = parse_imports(p);
     da_init_node(&decls);
     open_scope(p);
     while (p->tok != token_EOF) {
@@ -537,7 +928,14 @@ static file_t *_parse_file(parser_t *p)
     }
     da_append_node(&decls, NULL);
     close_scope(p);
-    file_t file = {.decls = decls.data};
+    file_t file = {
+        .filename = p->filename,
+        .src = p->scanner.src,
+        .src_len = p->scanner.src_len,
+        .package = package,
+        .imports = imports,
+        .decls = decls.data,
+    };
     return copy(&file);
 }
 
@@ -0,0 +1,136 @@
+#include "profile.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h> // qsort, bsearch
+
+static void add_site(profile_t *p, const node_t *n, int num_counters)
+{
+    if (p->num_sites == p->cap_sites) {
+        p->cap_sites = p->cap_sites ? 2 * p->cap_sites : 64;
+        p->sites = realloc(p->sites, p->cap_sites * sizeof(*p->sites));
+    }
+    p->sites[p->num_sites++] = (profile_site_t){
+        .node = n,
+        .counter = p->num_counters,
+    };
+    p->num_counters += num_counters;
+}
+
+/* Number the sites in n, in source order: two counters for an if (then
+ * and else), one for a loop's back-edge and one for a call. */
+static void walk(profile_t *p, const node_t *n)
+{
+    ast_stack_t s;
+    const node_t **top;
+
+    ast_stack_init(&s, sizeof(n));
+    *(const node_t **)ast_stack_push(&s) = n;
+    while ((top = ast_stack_pop(&s))) {
+        n = *top;
+        switch (n->t) {
+        case EXPR_CALL:
+        case STMT_FOR:
+            add_site(p, n, 1);
+            break;
+        case STMT_IF:
+            add_site(p, n, 2);
+            break;
+        default:
+            break;
+        }
+        ast_push_children(&s, n);
+    }
+    ast_stack_deinit(&s);
+}
+
+static int site_cmp(const void *l, const void *r)
+{
+    const node_t *x = ((const profile_site_t *)l)->node;
+    const node_t *y = ((const profile_site_t *)r)->node;
+    return x < y ? -1 : x > y;
+}
+
+extern void profile_init(profile_t *p, const file_t *f)
+{
+    *p = (profile_t){};
+    for (node_t **decls = f->decls; decls && *decls; ++decls)
+        walk(p, *decls);
+    qsort(p->sites, p->num_sites, sizeof(*p->sites), site_cmp);
+}
+
+extern void profile_deinit(profile_t *p)
+{
+    free(p->sites);
+    free(p->counts);
+}
+
+/* The first counter of n, or -1 if n isn't a site. */
+extern int profile_counter(const profile_t *p, const node_t *n)
+{
+    profile_site_t key = {.node = n};
+    profile_site_t *site = p->num_sites
+        ? bsearch(&key, p->sites, p->num_sites, sizeof(*p->sites), site_cmp)
+        : NULL;
+    return site ? site->counter : -1;
+}
+
+/* Make copy, a clone of orig made after the sites were numbered, count
+ * with orig's counters, so counts follow code a pass duplicates. */
+extern void profile_share(profile_t *p, const node_t *copy, const node_t *orig)
+{
+    int counter = profile_counter(p, orig);
+    int i;
+
+    if (counter < 0)
+        return;
+    add_site(p, copy, 0);
+    // keep the sites sorted for bsearch
+    for (i = p->num_sites - 1; i > 0 && p->sites[i - 1].node > copy; --i)
+        p->sites[i] = p->sites[i - 1];
+    p->sites[i] = (profile_site_t){.node = copy, .counter = counter};
+}
+
+static unsigned long long read_le(const unsigned char *b, int n)
+{
+    unsigned long long v = 0;
+    for (int i = n - 1; i >= 0; --i)
+        v = v << 8 | b[i];
+    return v;
+}
+
+/* Read counts written by a program built with --profile-generate. Returns
+ * nonzero if the file can't be read or doesn't match this program. */
+extern int profile_load(profile_t *p, const char *path)
+{
+    unsigned char header[8];
+    unsigned char b[8];
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp)
+        return 1;
+    if (fread(header, 1, 8, fp) != 8 || memcmp(header, PROFILE_MAGIC, 4)
+            || read_le(header + 4, 4) != (unsigned)p->num_counters) {
+        fclose(fp);
+        return 1;
+    }
+    p->counts = calloc(p->num_counters + 1, sizeof(*p->counts));
+    for (int i = 0; i < p->num_counters; ++i) {
+        if (fread(b, 1, 8, fp) != 8) {
+            fclose(fp);
+            free(p->counts);
+            p->counts = NULL;
+            return 1;
+        }
+        p->counts[i] = read_le(b, 8);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* The i-th counter of n, or 0 without a profile. */
+extern unsigned long long profile_count(const profile_t *p, const node_t *n, int i)
+{
+    int counter = p->counts ? profile_counter(p, n) : -1;
+    return counter < 0 ? 0 : p->counts[counter + i];
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "ast.h"
+
+/*
+ * Execution counts for if arms, loop back-edges and call sites. Sites are
+ * numbered in the order they appear in the source, so a profile only
+ * applies to the same program compiled the same way.
+ *
+ * A profile file is the magic, the number of counters as a 32-bit integer
+ * and then each counter as a 64-bit integer, all little-endian.
+ */
+
+#define PROFILE_MAGIC "KCPF"
+
+typedef struct {
+    const node_t *node;
+    int counter;
+} profile_site_t;
+
+typedef struct {
+    profile_site_t *sites; // sorted by node
+    int num_sites;
+    int cap_sites;
+    int num_counters;
+    unsigned long long *counts; // from profile_load, or NULL
+} profile_t;
+
+extern void profile_init(profile_t *p, const file_t *f);
+extern void profile_deinit(profile_t *p);
+extern int profile_counter(const profile_t *p, const node_t *n);
+extern void profile_share(profile_t *p, const node_t *copy, const node_t *orig);
+extern int profile_load(profile_t *p, const char *path);
+extern unsigned long long profile_count(const profile_t *p, const node_t *n, int i);
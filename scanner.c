@@ -12,6 +12,7 @@ static void next(scanner_t *s)
 extern void scanner_init(scanner_t *s, char *src, int len)
 {
     s->ch = -1;
+    s->offset = 0;
     s->src = src;
     s->src_len = len;
     next(s);
@@ -38,13 +39,67 @@ static int scan_identifier(scanner_t *s, char *lit)
     return i;
 }
 
+static int digit_value(int ch)
+{
+    if ('0' <= ch && ch <= '9')
+        return ch - '0';
+    if ('a' <= ch && ch <= 'f')
+        return ch - 'a' + 10;
+    if ('A' <= ch && ch <= 'F')
+        return ch - 'A' + 10;
+    return 16;
+}
+
+/* Scan an integer literal, decimal or with a 0x, 0o or 0b prefix, into
+ * s->value; a leading 0 alone makes it octal too. A literal that doesn't
+ * fit in a 32-bit int or has a digit its base doesn't allow is ILLEGAL, so
+ * no backend ever has to truncate one; INT_MIN is spelled -2147483647 - 1. */
 static token_t scan_number(scanner_t *s, char *lit)
 {
-    while (is_digit(s->ch)) {
+    uint64_t value = 0;
+    int base = 10;
+    int digits = 0;
+    int overflow = 0;
+
+    s->error = NULL;
+    if (s->ch == '0') {
+        *lit++ = s->ch;
+        next(s);
+        base = 8;
+        digits = 1;
+        if (s->ch == 'x' || s->ch == 'X')
+            base = 16;
+        else if (s->ch == 'b' || s->ch == 'B')
+            base = 2;
+        if (base != 8 || s->ch == 'o' || s->ch == 'O') {
+            *lit++ = s->ch;
+            next(s);
+            digits = 0;
+        }
+    }
+    // letters are scanned too, so 09 and 12ab are one bad literal
+    while (is_letter(s->ch) || is_digit(s->ch)) {
+        int d = digit_value(s->ch);
+        if (d >= base) {
+            if (!s->error)
+                s->error = "invalid digit in integer literal";
+        } else if (value > (INT32_MAX - d) / base) {
+            overflow = 1;
+        } else {
+            value = value * base + d;
+        }
+        digits++;
         *lit++ = s->ch;
         next(s);
-    };
+    }
     *lit = '\0';
+    if (!digits)
+        s->error = "integer literal has no digits";
+    else if (overflow && !s->error)
+        s->error = "integer literal out of range";
+    if (s->error)
+        return token_ILLEGAL;
+    s->value = value;
     return token_INT;
 }
 
@@ -121,23 +176,26 @@ extern token_t scanner_scan(scanner_t *s, char *lit)
             tok = token_RPAREN;
             break;
         case '*':
-            tok = token_MUL;
+            tok = switch2(s, token_MUL, token_MUL_ASSIGN);
             break;
         case '+':
-            tok = token_ADD;
+            tok = switch3(s, token_ADD, token_ADD_ASSIGN, '+', token_INC);
             break;
         case '-':
-            tok = token_SUB;
+            tok = switch3(s, token_SUB, token_SUB_ASSIGN, '-', token_DEC);
             break;
         case '.':
             tok = token_PERIOD;
             break;
         case '/':
-            tok = token_QUO;
+            tok = switch2(s, token_QUO, token_QUO_ASSIGN);
             break;
         case ';':
             tok = token_SEMICOLON;
             break;
+        case ':':
+            tok = token_COLON;
+            break;
         case '{':
             tok = token_LBRACE;
             break;
@@ -151,7 +209,7 @@ extern token_t scanner_scan(scanner_t *s, char *lit)
             tok = switch2(s, token_REM, token_REM_ASSIGN);
             break;
         case '<':
-            tok = switch4(s, token_LSS, token_LEQ, '>', token_SHL, token_SHL_ASSIGN);
+            tok = switch4(s, token_LSS, token_LEQ, '<', token_SHL, token_SHL_ASSIGN);
             break;
         case '>':
             tok = switch4(s, token_GTR, token_GEQ, '>', token_SHR, token_SHR_ASSIGN);
@@ -163,7 +221,15 @@ extern token_t scanner_scan(scanner_t *s, char *lit)
             tok = switch2(s, token_NOT, token_NEQ);
             break;
         case '&':
-            tok = switch3(s, token_AND, token_AND_ASSIGN, '&', token_LAND);
+            if (s->ch == '^') {
+                next(s);
+                tok = switch2(s, token_AND_NOT, token_AND_NOT_ASSIGN);
+            } else {
+                tok = switch3(s, token_AND, token_AND_ASSIGN, '&', token_LAND);
+            }
+            break;
+        case '^':
+            tok = switch2(s, token_XOR, token_XOR_ASSIGN);
             break;
         case '|':
             tok = switch3(s, token_OR, token_OR_ASSIGN, '|', token_LOR);
@@ -3,11 +3,15 @@
 
 #include "token.h"
 
+#include <stdint.h>
+
 typedef struct {
     const char *src;
     int src_len;
     int offset;
     int ch;
+    int64_t value; // of the last token_INT
+    const char *error; // why the last token was token_ILLEGAL
 } scanner_t;
 
 extern void scanner_init(scanner_t *s, char *src, int len);
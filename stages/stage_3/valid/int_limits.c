@@ -0,0 +1,3 @@
+int main() {
+    return (2147483647 + (-2147483647 - 1)) * -1 + 0x7fffffff % 1000 + 017777777777 / 0x40000000;
+}
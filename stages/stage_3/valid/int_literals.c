@@ -0,0 +1,3 @@
+int main() {
+    return 0x1F + 0XaB - 017 + 017 + 07 + 0b101 + 0B11 + 0 + 00 + 0x7fffffff / 0x1000000;
+}
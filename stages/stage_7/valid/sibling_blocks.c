@@ -0,0 +1,17 @@
+int main() {
+    int a = 1;
+    {
+        int b = 2;
+        {
+            int c = b * 3;
+            a = a + c;
+        }
+        a = a + b;
+    }
+    {
+        int d = 4;
+        int e = a;
+        a = e + d;
+    }
+    return a;
+}
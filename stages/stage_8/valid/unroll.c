@@ -0,0 +1,21 @@
+int main() {
+    int s = 0;
+    int n = 23;
+    n = n + 0;
+    for (int i = 0; i < 5; i = i + 1) {
+        s = s + i;
+    }
+    for (int i = 0; i < 100; i += 3) {
+        s = s + i % 7;
+    }
+    for (int i = n; i >= 0; i--) {
+        for (int j = 0; j < i; j++) {
+            s = s + 1;
+        }
+    }
+    int k = 0;
+    for (k = 2; k <= n; k = k + 2) {
+        s = s - 1;
+    }
+    return (s + k) % 256;
+}
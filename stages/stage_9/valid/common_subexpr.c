@@ -0,0 +1,16 @@
+int twice(int n) {
+    return n + n;
+}
+
+int main() {
+    int a = 3;
+    int b = 4;
+    int x = (a*b) + (a*b);
+    int y = a*b + twice(a*b);
+    a = a + 1;
+    int z = a*b - (x - 1) * (x - 1);
+    if ((z - y) < 0 && (x - 1) / (y - z) == 0) {
+        return (a*b) + (z - y);
+    }
+    return (a*b) + (x - 1);
+}
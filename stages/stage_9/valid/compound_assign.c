@@ -0,0 +1,37 @@
+int f(int x) {
+    return x * 3 + 1;
+}
+
+int main() {
+    int s = 0;
+    for (int i = 0; i < 10; i++) {
+        s += i;
+        s -= 1;
+    }
+    int m = 1000;
+    m *= 3;
+    m /= 7;
+    m %= 100;
+    int b = 255;
+    b &= 60;
+    b |= 3;
+    b ^= 5;
+    b &= ~ 8;
+    int sh = 1;
+    sh <<= 4;
+    sh >>= 1;
+    int k = 3;
+    sh <<= k;
+    sh >>= k - 1;
+    int n = -64;
+    n >>= 2;
+    int v = 7;
+    v += f(v);
+    v -= f(2) * 2;
+    v ^= f(1) & 12;
+    v &= ~(f(0) + 1);
+    v--;
+    m--;
+    int w = (s ^ m) | (b << 2) & ~(n >> 1) & ~3;
+    return s + m + b + sh + n + v + w + (f(5) << k) + (m & ~f(3));
+}
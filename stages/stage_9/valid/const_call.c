@@ -0,0 +1,50 @@
+int putchar(int c);
+
+int square(int n) {
+    return n * n;
+}
+
+int collatz(int n) {
+    int steps = 0;
+    while (n != 1) {
+        if (n % 2 == 0) {
+            n = n / 2;
+        } else {
+            n = 3 * n + 1;
+        }
+        steps = steps + 1;
+    }
+    return steps;
+}
+
+int ack(int m, int n) {
+    if (m == 0) {
+        return n + 1;
+    }
+    if (n == 0) {
+        return ack(m - 1, 1);
+    }
+    return ack(m - 1, ack(m, n - 1));
+}
+
+int spin(int n) {
+    int x = 0;
+    for (int i = 0; i < n; i = i + 1) {
+        x = (int)((unsigned)x * 31 + i);
+    }
+    return x;
+}
+
+int shout(int c) {
+    putchar(c);
+    return c;
+}
+
+int main() {
+    int n = 27;
+    int k = square(3) + 1;
+    int total = collatz(n) + ack(2, k) + square(-k);
+    total = total + spin(3000000) % 7 + shout(33);
+    total = total - shout(10);
+    return total;
+}
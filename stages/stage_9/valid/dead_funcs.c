@@ -0,0 +1,29 @@
+int odd(int n);
+
+int even(int n) {
+    if (n == 0) {
+        return 1;
+    }
+    return odd(n - 1);
+}
+
+int odd(int n) {
+    if (n == 0) {
+        return 0;
+    }
+    return even(n - 1);
+}
+
+int unused(int n) {
+    return even(n) + 1;
+}
+
+int twice(int n) {
+    return n + n;
+}
+
+int main() {
+    int n = 7;
+    n = n * 3;
+    return twice(n) + even(n);
+}
@@ -0,0 +1,13 @@
+int mix(int n) {
+    return n / 4 + n % 4 + n / -8 + n / 7 + n % 7 + n / -641 + n % 1000
+        + n * 10 + 7 * n + n * -12;
+}
+
+int main() {
+    int sum = 0;
+    int d = 3;
+    for (int n = -1000; n < 1000; n = n + 1) {
+        sum = sum + mix(n) + n / d + n % d;
+    }
+    return sum + mix(-100000000) / 1000;
+}
@@ -0,0 +1,30 @@
+int putchar(int c);
+
+static int digit(int d) {
+    return putchar(48 + d);
+}
+
+int PrintNumber(int n) {
+    int count = 0;
+    if (n < 0) {
+        putchar(45);
+        return 1 + PrintNumber(-n);
+    }
+    if (n >= 10) {
+        count = PrintNumber(n / 10);
+    }
+    digit(n % 10);
+    return count + 1;
+}
+
+int Square(int x) {
+    return x * x;
+}
+
+int main() {
+    int n = PrintNumber(Square(12) + 7);
+    putchar(32);
+    n = n + PrintNumber(-Square(n));
+    putchar(10);
+    return n + Square(3);
+}
@@ -0,0 +1,7 @@
+int foo(int a, int b) {
+    return (a - b) * (b - a * 3);
+}
+
+int main() {
+    return foo(7, 2);
+}
@@ -0,0 +1,12 @@
+int sub8(int a, int b, int c, int d, int e, int f, int g, int h) {
+    return a - b + c - d + e - f + g - h * 2;
+}
+
+int sub7(int a, int b, int c, int d, int e, int f, int g) {
+    return sub8(a, b, c, d, e, f, g, 1) - g;
+}
+
+int main() {
+    int x = 3;
+    return sub8(x, sub7(1, 2, 3, 4, 5, 6, x * 7), 3, 4, 5, 6, 7, x + 1) + 100;
+}
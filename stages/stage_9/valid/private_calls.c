@@ -0,0 +1,29 @@
+struct Pair {
+    int a;
+    int b;
+};
+
+int mix(int a, int b, int c, int d, int e, int f, int g, int h) {
+    return a - 2 * b + 3 * c - 4 * d + 5 * e - 6 * f + 7 * g - 8 * h;
+}
+
+int sum(struct Pair p, int k) {
+    return p.a + p.b * k;
+}
+
+int id(int x) {
+    return x;
+}
+
+int main() {
+    int x = 17;
+    int y = 5;
+    struct Pair p;
+    x = x + 0;
+    y = y + 0;
+    p.a = x;
+    p.b = y;
+    int r = mix(x / y, x % y, x << 2, x >> 1, x * y, id(x) - 1, x - y, x + y);
+    return (r + mix(id(y), x / y, id(x) % 7, y << 3, x, y, x / 3, y % 4)
+        + sum(p, x / y)) & 255;
+}
@@ -0,0 +1,54 @@
+typedef struct {
+    int a;
+    int b;
+} Pair;
+
+typedef struct {
+    Pair p;
+    int c;
+} Triple;
+
+typedef struct {
+    Triple t;
+    Triple u;
+} Big;
+
+Pair swap(Pair p) {
+    Pair q;
+    q.a = p.b;
+    q.b = p.a;
+    return q;
+}
+
+Triple scale(Triple t, int k) {
+    t.p.a = t.p.a * k;
+    t.c = t.c * k;
+    return t;
+}
+
+Big join(Triple t, Triple u) {
+    Big b;
+    b.t = t;
+    b.u = scale(u, 2);
+    return b;
+}
+
+int sum(Big b) {
+    return b.t.p.a + b.t.p.b + b.t.c + b.u.p.a + b.u.p.b + b.u.c;
+}
+
+int last(Triple a, Triple b, Triple c, Pair d) {
+    return a.c - b.c + c.c * d.b;
+}
+
+int main() {
+    Pair p;
+    p.a = 3;
+    p.b = 4;
+    Triple t;
+    t.p = swap(p);
+    t.c = 5;
+    Big b = join(t, scale(t, 3));
+    b = join(b.u, b.t);
+    return sum(b) + join(t, t).u.c + last(t, b.t, b.u, swap(p)) + swap(p).a;
+}
@@ -0,0 +1,22 @@
+typedef struct {
+    int x;
+    int y;
+} Point;
+
+typedef struct {
+    Point min;
+    Point max;
+    int color;
+} Rect;
+
+int main() {
+    Rect r;
+    r.min.x = 1;
+    r.min.y = 2;
+    r.max = r.min;
+    r.max.x = r.max.x + 10;
+    r.color = 3;
+    Rect s = r;
+    s.max.y = s.min.y * 7 + r.color;
+    return s.max.x * s.max.y - r.max.y + s.color;
+}
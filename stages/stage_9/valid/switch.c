@@ -0,0 +1,83 @@
+int dense(int x) {
+    int r = 0;
+    switch (x) {
+    case 0:
+        r = 10;
+        break;
+    case 1:
+    case 2:
+        r = 20;
+        break;
+    case 3:
+        r = 30;
+        /* fallthrough */
+    case 5:
+        r = r + 5;
+        break;
+    case 6:
+        return 66;
+    default:
+        r = -1;
+        break;
+    }
+    return r;
+}
+
+int sparse(int x) {
+    switch (x * 2) {
+    case -100:
+        return 1;
+    case 7000:
+        return 2;
+    case 14:
+        return 3;
+    case 1000000:
+        return 4;
+    case 2:
+        return 5;
+    case 40:
+    case 42:
+    case 44:
+    case 46:
+    case 48:
+        return 6;
+    }
+    return 0;
+}
+
+int loop(int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        switch (i % 4) {
+        case 0:
+            continue;
+        case 1:
+            break;
+        case 2:
+            s = s + i;
+            break;
+        default:
+            if (i > 10) {
+                break;
+            }
+            s = s + 100;
+            break;
+        }
+        s = s + 1;
+    }
+    return s;
+}
+
+int main() {
+    int t = 0;
+    for (int i = -2; i < 9; i++) {
+        t = t * 3 + dense(i);
+        t = t % 100003;
+    }
+    for (int i = -60; i < 600000; i = i + 7) {
+        t = t + sparse(i);
+    }
+    t = t + sparse(-50) + sparse(3500) + sparse(500000) + sparse(1) + sparse(22);
+    t = t + loop(30);
+    return t % 256;
+}
@@ -0,0 +1,27 @@
+int limit(int x) {
+    switch (x) {
+    case -2147483647 - 1:
+        return 1;
+    case 2147483647:
+        return 2;
+    case 3 * 4 + 1:
+    case (0xff & ~0xf) | 1:
+        return 3;
+    case ~0 ^ 5:
+    case -(2 - 10):
+        return 4;
+    }
+    return 0;
+}
+
+int main() {
+    int min = -2147483647;
+    int t = limit(min - 1);
+    t = t * 5 + limit(min + 1);
+    t = t * 5 + limit((int)((unsigned)min - 2));
+    t = t * 5 + limit(13);
+    t = t * 5 + limit(241);
+    t = t * 5 + limit(-6);
+    t = t * 5 + limit(8);
+    return t % 256;
+}
@@ -15,6 +15,14 @@ test_failure () {
     ((fail++))
 }
 
+# a driver exits with this when its backend can't build the program
+skip_status=77
+
+test_skip () {
+    echo "SKIP"
+    ((skip++))
+}
+
 if [ "$1" == "" ]; then
     echo "USAGE: ./test_compiler.sh /path/to/compiler"
     exit 1
@@ -24,12 +32,14 @@ cmp=$1
 
 success_total=0
 failure_total=0
+skip_total=0
 
 num_stages=9
 
 for i in `seq 1 $num_stages`; do
     success=0
     fail=0
+    skip=0
     echo "===================================================="
     echo "STAGE $i"
     echo "===================Valid Programs==================="
@@ -44,12 +54,22 @@ for i in `seq 1 $num_stages`; do
         expected_exit_code=$?
 
         base="${tmpdir}/${prog%.*}" #name of executable (filename w/out extension)
-        $cmp $prog $base >/dev/null
-        actual_out=`./$base`
-        actual_exit_code=$?
+        # programs that import get the stage's packages to build first
+        packages=""
+        if grep -q '^import' $prog; then
+            packages=`ls stages/stage_$i/packages/*.kc`
+        fi
+        $cmp $prog $base $packages >/dev/null
+        status=$?
         test_name="${base##*valid/}"
         printf '%s' "$test_name"
         printf '%*.*s' 0 $((padlength - ${#test_name})) "$padding_dots"
+        if [ "$status" -eq $skip_status ]; then
+            test_skip
+            continue
+        fi
+        actual_out=`./$base`
+        actual_exit_code=$?
 
         if [[ $test_name == "undefined"* ]]; then
             # return value is undefined
@@ -74,31 +94,35 @@ for i in `seq 1 $num_stages`; do
         fi
         rm $base
     done
-    # echo "===================Invalid Programs================="
-    # for prog in `ls stage_$i/invalid/{,**/}*.c 2>/dev/null`; do
-    #     base="${prog%.*}" #name of executable (filename w/out extension)
-    #     test_name="${base##*invalid/}"
-
-    #     $cmp $prog >/dev/null 2>&1
-    #     failed=$? #failed, as we expect, if exit code != 0
-
-    #     printf '%s' "$test_name"
-    #     printf '%.*s' $((padlength - ${#test_name})) "$padding_dots"
-
-    #     if [[ -f $base || -f $base".s" ]] #make sure neither executable nor assembly was produced
-    #     then
-    #         test_failure
-    #         rm $base 2>/dev/null
-    #         rm $base".s" 2>/dev/null
-    #     else
-    #         test_success
-    #     fi
-    # done
+    echo "===================Invalid Programs================="
+    for prog in `ls stages/stage_$i/invalid/{,**/}*.kc 2>/dev/null`; do
+        base="${tmpdir}/${prog%.*}" #name of executable (filename w/out extension)
+        test_name="${base##*invalid/}"
+        mkdir -p "$(dirname ${base})"
+
+        $cmp $prog $base >/dev/null 2>&1
+        failed=$? #failed, as we expect, if exit code != 0
+
+        printf '%s' "$test_name"
+        printf '%*.*s' 0 $((padlength - ${#test_name})) "$padding_dots"
+
+        if [ "$failed" -eq $skip_status ]; then
+            test_skip
+        elif [ "$failed" -eq 0 ] || [[ -f $base ]] #make sure no executable was produced
+        then
+            test_failure
+            rm $base 2>/dev/null
+        else
+            test_success
+        fi
+    done
     echo "===================Stage $i Summary================="
-    printf "%d successes, %d failures\n" $success $fail
+    printf "%d successes, %d failures, %d skipped\n" $success $fail $skip
     ((success_total=success_total+success))
     ((failure_total=failure_total + fail))
+    ((skip_total=skip_total + skip))
 done
 
 echo "===================TOTAL SUMMARY===================="
-printf "%d successes, %d failures\n" $success_total $failure_total
+printf "%d successes, %d failures, %d skipped\n" $success_total $failure_total $skip_total
+[ "$failure_total" -eq 0 ]
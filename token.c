@@ -163,20 +163,32 @@ extern token_t token_lookup(const char *ident)
 {
     if (streq(ident, "break"))
         return token_BREAK;
+    if (streq(ident, "case"))
+        return token_CASE;
     if (streq(ident, "continue"))
         return token_CONTINUE;
+    if (streq(ident, "default"))
+        return token_DEFAULT;
     if (streq(ident, "else"))
         return token_ELSE;
+    if (streq(ident, "fallthrough"))
+        return token_FALLTHROUGH;
     if (streq(ident, "for"))
         return token_FOR;
     if (streq(ident, "func"))
         return token_FUNC;
     if (streq(ident, "if"))
         return token_IF;
+    if (streq(ident, "import"))
+        return token_IMPORT;
+    if (streq(ident, "package"))
+        return token_PACKAGE;
     if (streq(ident, "return"))
         return token_RETURN;
     if (streq(ident, "struct"))
         return token_STRUCT;
+    if (streq(ident, "switch"))
+        return token_SWITCH;
     if (streq(ident, "type"))
         return token_TYPE;
     if (streq(ident, "var"))
@@ -0,0 +1,145 @@
+#include "trace.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h> // atexit
+#include <time.h> // clock_gettime
+
+#define MAX_DEPTH 64
+
+static const char *phase_names[TRACE_NUM_PHASES] = {
+    [TRACE_READ] = "read",
+    [TRACE_SCAN] = "scan",
+    [TRACE_PARSE] = "parse",
+    [TRACE_OPT] = "opt",
+    [TRACE_EMIT] = "emit",
+    [TRACE_WRITE] = "write",
+    [TRACE_RUN] = "run",
+};
+
+typedef struct {
+    int phase;
+    int named; // whether it has an event to end
+} bracket_t;
+
+int trace_enabled = 0;
+
+static int print_phases;
+static FILE *trace_fp;
+static int num_events;
+static double start;
+static double last; // when the innermost bracket last began or resumed
+static double totals[TRACE_NUM_PHASES];
+static bracket_t stack[MAX_DEPTH];
+static int depth;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Charge the time since last to the innermost bracket's phase. */
+static double charge(void)
+{
+    double t = now();
+
+    if (depth)
+        totals[stack[depth - 1].phase] += t - last;
+    last = t;
+    return t;
+}
+
+static void event(const char *ph, int phase, const char *name, double t)
+{
+    fprintf(trace_fp, "%s\n{\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":1",
+            num_events++ ? "," : "", ph, (t - start) * 1e6);
+    if (name) {
+        fprintf(trace_fp, ",\"cat\":\"%s\",\"name\":\"", phase_names[phase]);
+        for (const char *s = name; *s; ++s) {
+            if (*s == '"' || *s == '\\')
+                fprintf(trace_fp, "\\%c", *s);
+            else if ((unsigned char)*s < ' ')
+                fprintf(trace_fp, "\\u%04x", *s);
+            else
+                fputc(*s, trace_fp);
+        }
+        fputc('"', trace_fp);
+    }
+    fputc('}', trace_fp);
+}
+
+extern void trace_begin(int phase, const char *name)
+{
+    double t = charge();
+
+    if (depth == MAX_DEPTH)
+        PANIC("trace brackets nested too deeply");
+    stack[depth++] = (bracket_t){.phase = phase, .named = name && trace_fp};
+    if (name && trace_fp)
+        event("B", phase, name, t);
+}
+
+extern void trace_end(void)
+{
+    double t = charge();
+
+    if (!depth)
+        PANIC("trace_end without trace_begin");
+    if (stack[--depth].named)
+        event("E", 0, NULL, t);
+}
+
+/* The phase of the innermost bracket, or -1 outside them all. */
+extern int trace_phase(void)
+{
+    return depth ? stack[depth - 1].phase : -1;
+}
+
+extern const char *trace_phase_name(int phase)
+{
+    return phase_names[phase];
+}
+
+/* Close what exit left open, so --run and --vm programs that exit from
+ * inside a bracket are accounted for, then write the reports. */
+static void finish(void)
+{
+    double total = 0;
+
+    while (depth)
+        trace_end();
+    trace_enabled = 0;
+    if (trace_fp) {
+        fprintf(trace_fp, "\n]}\n");
+        fclose(trace_fp);
+    }
+    if (!print_phases)
+        return;
+    for (int i = 0; i < TRACE_NUM_PHASES; ++i)
+        total += totals[i];
+    fprintf(stderr, "%-8s %10s %7s\n", "phase", "ms", "%");
+    for (int i = 0; i < TRACE_NUM_PHASES; ++i) {
+        if (totals[i] > 0)
+            fprintf(stderr, "%-8s %10.3f %6.1f%%\n", phase_names[i],
+                    1e3 * totals[i], 100 * totals[i] / total);
+    }
+    fprintf(stderr, "%-8s %10.3f\n", "total", 1e3 * total);
+}
+
+/* Start tracking brackets, printing phase times if time_phases is set and
+ * writing trace events if trace_file isn't NULL. Reports are written at
+ * exit. */
+extern void trace_start(int time_phases, const char *trace_file)
+{
+    if (trace_file) {
+        if (!(trace_fp = fopen(trace_file, "w")))
+            PANIC("can't open trace file: %s", trace_file);
+        fprintf(trace_fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    }
+    print_phases = time_phases;
+    start = last = now();
+    trace_enabled = 1;
+    atexit(finish);
+}
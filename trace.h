@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * Where the compiler spends its time. Code brackets work with TRACE_BEGIN
+ * and TRACE_END, which cost one test of trace_enabled when neither
+ * --time-phases nor --trace asked for them.
+ *
+ * Each phase's time is exclusive: while a nested bracket is open, time
+ * counts towards its phase instead, so the scanner's time doesn't count
+ * towards parse. Brackets with a name also become Chrome trace events,
+ * viewable in chrome://tracing or Perfetto.
+ */
+
+enum {
+    TRACE_READ,
+    TRACE_SCAN,
+    TRACE_PARSE,
+    TRACE_OPT,
+    TRACE_EMIT,
+    TRACE_WRITE,
+    TRACE_RUN,
+    TRACE_NUM_PHASES,
+};
+
+extern int trace_enabled;
+
+extern void trace_start(int time_phases, const char *trace_file);
+extern void trace_begin(int phase, const char *name);
+extern void trace_end(void);
+extern int trace_phase(void);
+extern const char *trace_phase_name(int phase);
+
+#define TRACE_BEGIN(phase, name) \
+    do { \
+        if (trace_enabled) \
+            trace_begin(phase, name); \
+    } while (0)
+
+#define TRACE_END() \
+    do { \
+        if (trace_enabled) \
+            trace_end(); \
+    } while (0)
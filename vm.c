@@ -0,0 +1,228 @@
+#include "bc.h"
+#include "log.h"
+
+#include <limits.h> // INT_MIN
+#include <stdio.h> // putchar
+#include <string.h> // strcmp
+
+/*
+ * Interpreter for the register bytecode. Before running, the code is
+ * translated to direct-threaded form: every opcode word is replaced with the
+ * address of its handler, and each handler jumps straight to the next one.
+ *
+ * Programs can only reach the host through the builtins below, and the
+ * register stack and call depth are bounded, so a misbehaving program stops
+ * with an error instead of taking the process with it.
+ */
+
+#define VM_STACK_REGS (1 << 20)
+#define VM_MAX_DEPTH (1 << 16)
+
+#define countof(a) ((int)(sizeof(a) / sizeof(*(a))))
+
+typedef union {
+    const void *op;
+    int arg;
+} word_t;
+
+typedef struct {
+    const word_t *pc;
+    int *regs;
+    int dst;
+} frame_t;
+
+typedef int (*builtin_t)(const int *args, int n);
+
+static int vm_putchar(const int *args, int n)
+{
+    return putchar(n ? args[0] : 0);
+}
+
+static int vm_getchar(const int *args, int n)
+{
+    return getchar();
+}
+
+static const struct {
+    const char *name;
+    builtin_t fn;
+} builtins[] = {
+    {"getchar", vm_getchar},
+    {"putchar", vm_putchar},
+};
+
+static builtin_t find_builtin(const char *name)
+{
+    for (int i = 0; i < countof(builtins); ++i) {
+        if (!strcmp(builtins[i].name, name))
+            return builtins[i].fn;
+    }
+    PANIC("unsupported extern: %s", name);
+    return NULL;
+}
+
+static int divide(int x, int y, int rem)
+{
+    if (!y)
+        PANIC("division by zero");
+    if (x == INT_MIN && y == -1)
+        return rem ? 0 : INT_MIN;
+    return rem ? x % y : x / y;
+}
+
+#define R(i) r[pc[i].arg]
+#define K(i) pc[i].arg
+#define NEXT(n) do { pc += (n); goto *pc->op; } while (0)
+#define JUMP(t) do { pc = code + (t); goto *pc->op; } while (0)
+#define ARITH(op) (int)((unsigned)R(2) op (unsigned)R(3))
+
+/* Interpret p's main, passing it argc if it takes a parameter. Registers
+ * only hold ints, so unlike the JIT the VM has no argv to pass. */
+extern int vm_run(const bc_t *p, int argc)
+{
+    static const void *labels[NUM_BC_OPS] = {
+        [BC_MOVI] = &&op_MOVI,
+        [BC_MOV] = &&op_MOV,
+        [BC_ADD] = &&op_ADD,
+        [BC_SUB] = &&op_SUB,
+        [BC_MUL] = &&op_MUL,
+        [BC_DIV] = &&op_DIV,
+        [BC_REM] = &&op_REM,
+        [BC_AND] = &&op_AND,
+        [BC_OR] = &&op_OR,
+        [BC_XOR] = &&op_XOR,
+        [BC_SHL] = &&op_SHL,
+        [BC_SHR] = &&op_SHR,
+        [BC_EQ] = &&op_EQ,
+        [BC_NE] = &&op_NE,
+        [BC_LT] = &&op_LT,
+        [BC_LE] = &&op_LE,
+        [BC_GT] = &&op_GT,
+        [BC_GE] = &&op_GE,
+        [BC_LAND] = &&op_LAND,
+        [BC_LOR] = &&op_LOR,
+        [BC_NEG] = &&op_NEG,
+        [BC_NOT] = &&op_NOT,
+        [BC_LNOT] = &&op_LNOT,
+        [BC_JMP] = &&op_JMP,
+        [BC_JZ] = &&op_JZ,
+        [BC_JNZ] = &&op_JNZ,
+        [BC_CALL] = &&op_CALL,
+        [BC_CALLX] = &&op_CALLX,
+        [BC_RET] = &&op_RET,
+        [BC_ADDI] = &&op_ADDI,
+        [BC_MULI] = &&op_MULI,
+        [BC_JEQ] = &&op_JEQ,
+        [BC_JNE] = &&op_JNE,
+        [BC_JLT] = &&op_JLT,
+        [BC_JLE] = &&op_JLE,
+        [BC_JGT] = &&op_JGT,
+        [BC_JGE] = &&op_JGE,
+        [BC_JEQI] = &&op_JEQI,
+        [BC_JNEI] = &&op_JNEI,
+        [BC_JLTI] = &&op_JLTI,
+        [BC_JLEI] = &&op_JLEI,
+        [BC_JGTI] = &&op_JGTI,
+        [BC_JGEI] = &&op_JGEI,
+    };
+    word_t *code = malloc(sizeof(*code) * (p->len + 1));
+    builtin_t *externs = malloc(sizeof(*externs) * (p->num_externs + 1));
+    int *stack = calloc(VM_STACK_REGS, sizeof(*stack));
+    frame_t *frames = malloc(sizeof(*frames) * VM_MAX_DEPTH);
+    int main_index = bc_find_func(p, "main");
+    const word_t *pc;
+    int *r = stack;
+    int depth = 0;
+    int ret = 0;
+
+    if (main_index < 0)
+        PANIC("no main function");
+    if (p->funcs[main_index].num_regs > VM_STACK_REGS)
+        PANIC("stack overflow");
+    for (int i = 0; i < p->len; i += bc_length(p->code[i])) {
+        code[i].op = labels[p->code[i]];
+        for (int j = 1; j < bc_length(p->code[i]); ++j)
+            code[i + j].arg = p->code[i + j];
+    }
+    for (int i = 0; i < p->num_externs; ++i)
+        externs[i] = find_builtin(p->externs[i]);
+    if (p->funcs[main_index].num_params)
+        r[0] = argc;
+
+    pc = code + p->funcs[main_index].entry;
+    goto *pc->op;
+
+op_MOVI: R(1) = K(2); NEXT(3);
+op_MOV: R(1) = R(2); NEXT(3);
+
+op_ADD: R(1) = ARITH(+); NEXT(4);
+op_SUB: R(1) = ARITH(-); NEXT(4);
+op_MUL: R(1) = ARITH(*); NEXT(4);
+op_DIV: R(1) = divide(R(2), R(3), 0); NEXT(4);
+op_REM: R(1) = divide(R(2), R(3), 1); NEXT(4);
+op_AND: R(1) = R(2) & R(3); NEXT(4);
+op_OR: R(1) = R(2) | R(3); NEXT(4);
+op_XOR: R(1) = R(2) ^ R(3); NEXT(4);
+op_SHL: R(1) = (int)((unsigned)R(2) << (R(3) & 31)); NEXT(4);
+op_SHR: R(1) = R(2) >> (R(3) & 31); NEXT(4);
+op_EQ: R(1) = R(2) == R(3); NEXT(4);
+op_NE: R(1) = R(2) != R(3); NEXT(4);
+op_LT: R(1) = R(2) < R(3); NEXT(4);
+op_LE: R(1) = R(2) <= R(3); NEXT(4);
+op_GT: R(1) = R(2) > R(3); NEXT(4);
+op_GE: R(1) = R(2) >= R(3); NEXT(4);
+op_LAND: R(1) = R(2) && R(3); NEXT(4);
+op_LOR: R(1) = R(2) || R(3); NEXT(4);
+
+op_NEG: R(1) = -(unsigned)R(2); NEXT(3);
+op_NOT: R(1) = ~R(2); NEXT(3);
+op_LNOT: R(1) = !R(2); NEXT(3);
+
+op_JMP: JUMP(K(1));
+op_JZ: if (!R(1)) JUMP(K(2)); NEXT(3);
+op_JNZ: if (R(1)) JUMP(K(2)); NEXT(3);
+
+op_CALL:
+    do {
+        const bc_func_t *f = &p->funcs[K(2)];
+        int *regs = r + K(3);
+        if (depth == VM_MAX_DEPTH || regs + f->num_regs > stack + VM_STACK_REGS)
+            PANIC("stack overflow");
+        frames[depth++] = (frame_t){.pc = pc + 5, .regs = r, .dst = K(1)};
+        r = regs;
+        JUMP(f->entry);
+    } while (0);
+op_CALLX: R(1) = externs[K(2)](&R(3), K(4)); NEXT(5);
+op_RET:
+    if (depth) {
+        frame_t *f = &frames[--depth];
+        f->regs[f->dst] = R(1);
+        r = f->regs;
+        pc = f->pc;
+        goto *pc->op;
+    }
+    ret = R(1);
+    goto done;
+
+op_ADDI: R(1) = (int)((unsigned)R(2) + (unsigned)K(3)); NEXT(4);
+op_MULI: R(1) = (int)((unsigned)R(2) * (unsigned)K(3)); NEXT(4);
+op_JEQ: if (R(1) == R(2)) JUMP(K(3)); NEXT(4);
+op_JNE: if (R(1) != R(2)) JUMP(K(3)); NEXT(4);
+op_JLT: if (R(1) < R(2)) JUMP(K(3)); NEXT(4);
+op_JLE: if (R(1) <= R(2)) JUMP(K(3)); NEXT(4);
+op_JGT: if (R(1) > R(2)) JUMP(K(3)); NEXT(4);
+op_JGE: if (R(1) >= R(2)) JUMP(K(3)); NEXT(4);
+op_JEQI: if (R(1) == K(2)) JUMP(K(3)); NEXT(4);
+op_JNEI: if (R(1) != K(2)) JUMP(K(3)); NEXT(4);
+op_JLTI: if (R(1) < K(2)) JUMP(K(3)); NEXT(4);
+op_JLEI: if (R(1) <= K(2)) JUMP(K(3)); NEXT(4);
+op_JGTI: if (R(1) > K(2)) JUMP(K(3)); NEXT(4);
+op_JGEI: if (R(1) >= K(2)) JUMP(K(3)); NEXT(4);
+
+done:
+    free(code);
+    free(externs);
+    free(stack);
+    free(frames);
+    return ret;
+}
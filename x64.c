@@ -0,0 +1,844 @@
+#include "x64.h"
+#include "log.h"
+
+#include <stdint.h> // uintptr_t
+#include <stdlib.h> // malloc, realloc
+#include <string.h> // memcpy, strcmp, strlen
+
+#ifdef __APPLE__
+static const char *pre = "_";
+static const char *plt = "";
+#else
+static const char *pre = "";
+static const char *plt = "@PLT";
+#endif
+
+static const char *reg_names[][16] = {
+    [1] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+    },
+    [4] = {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+    },
+    [8] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    },
+};
+
+static const char *mnemonics[] = {
+    [X64_CLTD] = "cltd",
+    [X64_RET] = "ret",
+    [X64_IDIV] = "idiv",
+    [X64_IMUL1] = "imul",
+    [X64_NEG] = "neg",
+    [X64_NOT] = "not",
+    [X64_POP] = "pop",
+    [X64_PUSH] = "push",
+    [X64_SETE] = "sete",
+    [X64_SETNE] = "setne",
+    [X64_SETL] = "setl",
+    [X64_SETLE] = "setle",
+    [X64_SETG] = "setg",
+    [X64_SETGE] = "setge",
+    [X64_ADD] = "add",
+    [X64_AND] = "and",
+    [X64_CMP] = "cmp",
+    [X64_IMUL] = "imul",
+    [X64_LEA] = "lea",
+    [X64_MOV] = "mov",
+    [X64_MOVSLQ] = "movslq",
+    [X64_OR] = "or",
+    [X64_SAR] = "sar",
+    [X64_SHL] = "shl",
+    [X64_SHR] = "shr",
+    [X64_SUB] = "sub",
+    [X64_XOR] = "xor",
+    [X64_IMUL3] = "imul",
+    [X64_CALL] = "call",
+    [X64_JMP] = "jmp",
+    [X64_JE] = "je",
+    [X64_JNE] = "jne",
+    [X64_JL] = "jl",
+    [X64_JA] = "ja",
+};
+
+/* Condition codes of jcc and setcc. */
+static const int conds[] = {
+    [X64_SETE] = 0x4,
+    [X64_SETNE] = 0x5,
+    [X64_SETL] = 0xc,
+    [X64_SETLE] = 0xe,
+    [X64_SETG] = 0xf,
+    [X64_SETGE] = 0xd,
+    [X64_JE] = 0x4,
+    [X64_JNE] = 0x5,
+    [X64_JL] = 0xc,
+    [X64_JA] = 0x7,
+};
+
+/* ModRM reg field of instructions encoded with an opcode extension. */
+static const int exts[] = {
+    [X64_ADD] = 0,
+    [X64_OR] = 1,
+    [X64_AND] = 4,
+    [X64_SUB] = 5,
+    [X64_XOR] = 6,
+    [X64_CMP] = 7,
+    [X64_SHL] = 4,
+    [X64_SHR] = 5,
+    [X64_SAR] = 7,
+    [X64_NOT] = 2,
+    [X64_NEG] = 3,
+    [X64_IMUL1] = 5,
+    [X64_IDIV] = 7,
+};
+
+static const char suffixes[] = {[1] = 'b', [4] = 'l', [8] = 'q'};
+
+extern x64_operand_t x64_reg(x64_reg_t reg, int size)
+{
+    return (x64_operand_t){.kind = X64_REG, .size = size, .reg = reg};
+}
+
+extern x64_operand_t x64_imm(int value)
+{
+    return (x64_operand_t){.kind = X64_IMM, .disp = value};
+}
+
+extern x64_operand_t x64_mem(x64_reg_t base, int disp, int size)
+{
+    return (x64_operand_t){
+        .kind = X64_MEM,
+        .size = size,
+        .reg = base,
+        .index = -1,
+        .scale = 1,
+        .disp = disp,
+    };
+}
+
+extern x64_operand_t x64_sib(x64_reg_t base, x64_reg_t index, int scale, int size)
+{
+    x64_operand_t x = x64_mem(base, 0, size);
+    x.index = index;
+    x.scale = scale;
+    return x;
+}
+
+extern x64_operand_t x64_rip(x64_label_t label, int disp, int size)
+{
+    return (x64_operand_t){
+        .kind = X64_RIP,
+        .size = size,
+        .index = -1,
+        .disp = disp,
+        .label = label,
+    };
+}
+
+extern void x64_init(x64_t *a, FILE *fp)
+{
+    *a = (x64_t){.fp = fp};
+    if (fp)
+        a->out = malloc(X64_OUT_SIZE);
+}
+
+extern void x64_deinit(x64_t *a)
+{
+    free(a->out);
+    free(a->code);
+    free(a->data);
+    free(a->labels);
+    free(a->buckets);
+    free(a->funcs);
+    free(a->fixups);
+}
+
+static void *grow(void *p, int *cap, int n, size_t size)
+{
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 64;
+    return realloc(p, *cap * size);
+}
+
+/*
+ * Text output
+ *
+ * Text is appended to a fixed buffer that is written out when it fills up
+ * and at x64_end, so printing an instruction is a few copies rather than a
+ * stdio call per piece.
+ */
+
+static void flush(x64_t *a)
+{
+    if (a->out_len)
+        fwrite(a->out, 1, a->out_len, a->fp);
+    a->out_len = 0;
+}
+
+static void out_mem(x64_t *a, const char *s, int n)
+{
+    if (a->out_len + n > X64_OUT_SIZE) {
+        flush(a);
+        if (n > X64_OUT_SIZE) {
+            fwrite(s, 1, n, a->fp);
+            return;
+        }
+    }
+    memcpy(a->out + a->out_len, s, n);
+    a->out_len += n;
+}
+
+static void out_str(x64_t *a, const char *s)
+{
+    out_mem(a, s, strlen(s));
+}
+
+static void out_char(x64_t *a, char c)
+{
+    if (a->out_len == X64_OUT_SIZE)
+        flush(a);
+    a->out[a->out_len++] = c;
+}
+
+static void out_int(x64_t *a, int n)
+{
+    char b[16];
+    char *p = b + sizeof(b);
+    unsigned u = n < 0 ? -(unsigned)n : (unsigned)n;
+
+    do
+        *--p = '0' + u % 10;
+    while (u /= 10);
+    if (n < 0)
+        *--p = '-';
+    out_mem(a, p, b + sizeof(b) - p);
+}
+
+/* The same text as printf's %p. */
+static void out_ptr(x64_t *a, const void *ptr)
+{
+    char b[2 + 2 * sizeof(uintptr_t)];
+    char *p = b + sizeof(b);
+    uintptr_t u = (uintptr_t)ptr;
+
+    if (!ptr) {
+        out_str(a, "(nil)");
+        return;
+    }
+    do
+        *--p = "0123456789abcdef"[u % 16];
+    while (u /= 16);
+    *--p = 'x';
+    *--p = '0';
+    out_mem(a, p, b + sizeof(b) - p);
+}
+
+static void out_reg(x64_t *a, int reg, int size)
+{
+    out_char(a, '%');
+    out_str(a, reg_names[size][reg]);
+}
+
+static void print_label(x64_t *a, x64_label_t label)
+{
+    if (label.id) {
+        out_str(a, label.name);
+        out_ptr(a, label.id);
+    } else {
+        out_str(a, pre);
+        out_str(a, label.name);
+    }
+}
+
+static void print_operand(x64_t *a, x64_operand_t x)
+{
+    switch (x.kind) {
+    case X64_REG:
+        out_reg(a, x.reg, x.size);
+        break;
+    case X64_IMM:
+        out_char(a, '$');
+        out_int(a, x.disp);
+        break;
+    case X64_MEM:
+        if (x.disp)
+            out_int(a, x.disp);
+        out_char(a, '(');
+        out_reg(a, x.reg, 8);
+        if (x.index >= 0) {
+            out_char(a, ',');
+            out_reg(a, x.index, 8);
+            out_char(a, ',');
+            out_int(a, x.scale);
+        }
+        out_char(a, ')');
+        break;
+    case X64_RIP:
+        print_label(a, x.label);
+        if (x.disp > 0)
+            out_char(a, '+');
+        if (x.disp)
+            out_int(a, x.disp);
+        out_str(a, "(%rip)");
+        break;
+    case X64_NONE:
+        break;
+    }
+}
+
+static void print(x64_t *a, x64_op_t op, int size, int n, x64_operand_t *xs)
+{
+    out_char(a, '\t');
+    out_str(a, mnemonics[op]);
+    if (size)
+        out_char(a, suffixes[size]);
+    for (int i = 0; i < n; ++i) {
+        out_str(a, i ? ", " : " ");
+        print_operand(a, xs[i]);
+    }
+    out_char(a, '\n');
+}
+
+/*
+ * Encoding
+ */
+
+static void put(x64_t *a, int byte)
+{
+    a->code = grow(a->code, &a->cap, a->len, 1);
+    a->code[a->len++] = byte;
+}
+
+static void put32(x64_t *a, int v)
+{
+    for (int i = 0; i < 4; ++i)
+        put(a, (unsigned)v >> (8 * i));
+}
+
+static void patch(x64_t *a, int offset, int size, int v)
+{
+    for (int i = 0; i < size; ++i)
+        a->code[offset + i] = (unsigned)v >> (8 * i);
+}
+
+static int is_imm8(int v)
+{
+    return v >= -128 && v <= 127;
+}
+
+/* Whether a byte register needs a REX prefix to not mean %ah and friends. */
+static int is_rex_byte(int size, int reg)
+{
+    return size == 1 && reg >= 4 && reg < 8;
+}
+
+static int hash(x64_label_t label)
+{
+    unsigned h = 2166136261u;
+    for (const char *s = label.name; *s; ++s)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    h ^= (uintptr_t)label.id >> 3;
+    return h * 2654435761u;
+}
+
+static int is_same(x64_label_t l, x64_label_t r)
+{
+    return l.id == r.id && !strcmp(l.name, r.name);
+}
+
+/* Index of the bucket holding label, or of the empty bucket where it goes. */
+static int bucket(x64_t *a, x64_label_t label)
+{
+    int mask = a->num_buckets - 1;
+    int i = hash(label) & mask;
+    while (a->buckets[i] && !is_same(a->labels[a->buckets[i] - 1].label, label))
+        i = (i + 1) & mask;
+    return i;
+}
+
+static x64_sym_t *find(x64_t *a, x64_label_t label)
+{
+    if (!a->num_buckets)
+        return NULL;
+    int i = bucket(a, label);
+    return a->buckets[i] ? &a->labels[a->buckets[i] - 1] : NULL;
+}
+
+static void define(x64_t *a, x64_label_t label, x64_section_t section,
+        int offset)
+{
+    if (find(a, label))
+        PANIC("label defined twice: %s", label.name);
+    if (2 * (a->num_labels + 1) > a->num_buckets) {
+        free(a->buckets);
+        a->num_buckets = a->num_buckets ? 2 * a->num_buckets : 256;
+        a->buckets = calloc(a->num_buckets, sizeof(*a->buckets));
+        for (int i = 0; i < a->num_labels; ++i)
+            a->buckets[bucket(a, a->labels[i].label)] = i + 1;
+    }
+    a->labels = grow(a->labels, &a->cap_labels, a->num_labels, sizeof(*a->labels));
+    a->labels[a->num_labels++] = (x64_sym_t){
+        .offset = offset,
+        .section = section,
+        .label = label,
+    };
+    a->buckets[bucket(a, label)] = a->num_labels;
+}
+
+static void fixup(x64_t *a, int size, x64_label_t label, int addend,
+        int is_extern)
+{
+    a->fixups = grow(a->fixups, &a->cap_fixups, a->num_fixups, sizeof(*a->fixups));
+    a->fixups[a->num_fixups++] = (x64_fixup_t){
+        .offset = a->len,
+        .size = size,
+        .addend = addend,
+        .label = label,
+        .is_extern = is_extern,
+    };
+    for (int i = 0; i < size; ++i)
+        put(a, 0);
+}
+
+/*
+ * Encode [REX] opcode ModRM [SIB] [disp] where r is the ModRM reg field, either
+ * a register or an opcode extension, and rm is the register or memory operand.
+ */
+static void encode(x64_t *a, int size, int opcode, int r, x64_operand_t rm)
+{
+    int rex = 0;
+    int base = rm.reg & 7;
+
+    if (size == 8)
+        rex |= 0x48;
+    if (r & 8)
+        rex |= 0x44;
+    if (rm.kind == X64_MEM && rm.index >= 0 && (rm.index & 8))
+        rex |= 0x42;
+    if (rm.kind != X64_RIP && (rm.reg & 8))
+        rex |= 0x41;
+    if (is_rex_byte(size, r) || (rm.kind == X64_REG && is_rex_byte(size, rm.reg)))
+        rex |= 0x40;
+    if (rex)
+        put(a, rex);
+    if (opcode > 0xff)
+        put(a, opcode >> 8);
+    put(a, opcode & 0xff);
+
+    if (rm.kind == X64_REG) {
+        put(a, 0xc0 | (r & 7) << 3 | base);
+        return;
+    }
+    if (rm.kind == X64_RIP) {
+        put(a, (r & 7) << 3 | 5);
+        fixup(a, 4, rm.label, rm.disp - 4, 0);
+        return;
+    }
+
+    int mod = 2;
+    if (rm.disp == 0 && base != X64_RBP)
+        mod = 0;
+    else if (is_imm8(rm.disp))
+        mod = 1;
+    if (rm.index >= 0 || base == X64_RSP) {
+        int scale = __builtin_ctz(rm.scale);
+        int index = rm.index >= 0 ? rm.index & 7 : X64_RSP;
+        put(a, mod << 6 | (r & 7) << 3 | 4);
+        put(a, scale << 6 | index << 3 | base);
+    } else {
+        put(a, mod << 6 | (r & 7) << 3 | base);
+    }
+    if (mod == 1)
+        put(a, rm.disp);
+    else if (mod == 2)
+        put32(a, rm.disp);
+}
+
+/* Make the fixups of the instruction that was just encoded relative to its
+ * end, which immediates may follow. */
+static void finish(x64_t *a, int first)
+{
+    for (int i = first; i < a->num_fixups; ++i) {
+        x64_fixup_t *f = &a->fixups[i];
+        f->addend -= a->len - (f->offset + f->size);
+    }
+}
+
+/*
+ * Instructions
+ */
+
+static int op_size(x64_operand_t src, x64_operand_t dst)
+{
+    return dst.kind == X64_NONE || dst.kind == X64_IMM ? src.size : dst.size;
+}
+
+extern void x64_op0(x64_t *a, x64_op_t op)
+{
+    if (a->fp) {
+        print(a, op, 0, 0, NULL);
+        return;
+    }
+    switch (op) {
+    case X64_CLTD:
+        put(a, 0x99);
+        break;
+    case X64_RET:
+        put(a, 0xc3);
+        break;
+    default:
+        PANIC("bad operands for %s", mnemonics[op]);
+        break;
+    }
+}
+
+extern void x64_op1(x64_t *a, x64_op_t op, x64_operand_t x)
+{
+    int size = x.size;
+    int first = a->num_fixups;
+
+    if (op == X64_PUSH || op == X64_POP)
+        size = 8;
+    if (a->fp && op == X64_JMP) {
+        // an indirect jump, through a register or memory
+        out_str(a, "\tjmp *");
+        print_operand(a, x);
+        out_char(a, '\n');
+        return;
+    }
+    if (a->fp) {
+        print(a, op, conds[op] ? 0 : size, 1, &x);
+        return;
+    }
+    switch (op) {
+    case X64_PUSH:
+    case X64_POP:
+        if (x.kind == X64_REG) {
+            if (x.reg & 8)
+                put(a, 0x41);
+            put(a, (op == X64_PUSH ? 0x50 : 0x58) + (x.reg & 7));
+        } else if (x.kind == X64_IMM && op == X64_PUSH) {
+            put(a, 0x68);
+            put32(a, x.disp);
+        } else {
+            encode(a, 4, op == X64_PUSH ? 0xff : 0x8f, op == X64_PUSH ? 6 : 0, x);
+        }
+        break;
+    case X64_IDIV:
+    case X64_IMUL1:
+    case X64_NEG:
+    case X64_NOT:
+        encode(a, size, size == 1 ? 0xf6 : 0xf7, exts[op], x);
+        break;
+    case X64_JMP:
+        encode(a, 4, 0xff, 4, x);
+        break;
+    case X64_SETE:
+    case X64_SETNE:
+    case X64_SETL:
+    case X64_SETLE:
+    case X64_SETG:
+    case X64_SETGE:
+        encode(a, 1, 0x0f90 + conds[op], 0, x);
+        break;
+    default:
+        PANIC("bad operands for %s", mnemonics[op]);
+        break;
+    }
+    finish(a, first);
+}
+
+extern void x64_op2(x64_t *a, x64_op_t op, x64_operand_t src, x64_operand_t dst)
+{
+    int size = op_size(src, dst);
+    int byte = size == 1;
+    int first = a->num_fixups;
+
+    if (a->fp) {
+        x64_operand_t xs[] = {src, dst};
+        // movslq spells out both sizes
+        print(a, op, op == X64_MOVSLQ ? 0 : size, 2, xs);
+        return;
+    }
+    switch (op) {
+    case X64_ADD:
+    case X64_AND:
+    case X64_CMP:
+    case X64_OR:
+    case X64_SUB:
+    case X64_XOR:
+        if (src.kind == X64_IMM) {
+            if (byte) {
+                encode(a, size, 0x80, exts[op], dst);
+                put(a, src.disp);
+            } else if (is_imm8(src.disp)) {
+                encode(a, size, 0x83, exts[op], dst);
+                put(a, src.disp);
+            } else {
+                encode(a, size, 0x81, exts[op], dst);
+                put32(a, src.disp);
+            }
+        } else if (src.kind == X64_REG) {
+            encode(a, size, 8 * exts[op] + (byte ? 0x00 : 0x01), src.reg, dst);
+        } else {
+            encode(a, size, 8 * exts[op] + (byte ? 0x02 : 0x03), dst.reg, src);
+        }
+        break;
+    case X64_MOV:
+        if (src.kind == X64_IMM && dst.kind == X64_REG && size == 4) {
+            if (dst.reg & 8)
+                put(a, 0x41);
+            put(a, 0xb8 + (dst.reg & 7));
+            put32(a, src.disp);
+        } else if (src.kind == X64_IMM) {
+            encode(a, size, byte ? 0xc6 : 0xc7, 0, dst);
+            if (byte)
+                put(a, src.disp);
+            else
+                put32(a, src.disp);
+        } else if (src.kind == X64_REG) {
+            encode(a, size, byte ? 0x88 : 0x89, src.reg, dst);
+        } else {
+            encode(a, size, byte ? 0x8a : 0x8b, dst.reg, src);
+        }
+        break;
+    case X64_LEA:
+        encode(a, size, 0x8d, dst.reg, src);
+        break;
+    case X64_MOVSLQ:
+        encode(a, 8, 0x63, dst.reg, src);
+        break;
+    case X64_IMUL:
+        if (src.kind == X64_IMM) {
+            x64_op3(a, X64_IMUL3, src, dst, dst);
+            return;
+        }
+        encode(a, size, 0x0faf, dst.reg, src);
+        break;
+    case X64_SAR:
+    case X64_SHL:
+    case X64_SHR:
+        if (src.kind == X64_REG) {
+            encode(a, size, byte ? 0xd2 : 0xd3, exts[op], dst);
+        } else if (src.disp == 1) {
+            encode(a, size, byte ? 0xd0 : 0xd1, exts[op], dst);
+        } else {
+            encode(a, size, byte ? 0xc0 : 0xc1, exts[op], dst);
+            put(a, src.disp);
+        }
+        break;
+    default:
+        PANIC("bad operands for %s", mnemonics[op]);
+        break;
+    }
+    finish(a, first);
+}
+
+extern void x64_op3(x64_t *a, x64_op_t op, x64_operand_t imm, x64_operand_t src,
+        x64_operand_t dst)
+{
+    if (a->fp) {
+        x64_operand_t xs[] = {imm, src, dst};
+        print(a, op, dst.size, 3, xs);
+        return;
+    }
+    int first = a->num_fixups;
+    if (op != X64_IMUL3)
+        PANIC("bad operands for %s", mnemonics[op]);
+    if (is_imm8(imm.disp)) {
+        encode(a, dst.size, 0x6b, dst.reg, src);
+        put(a, imm.disp);
+    } else {
+        encode(a, dst.size, 0x69, dst.reg, src);
+        put32(a, imm.disp);
+    }
+    finish(a, first);
+}
+
+extern void x64_jump(x64_t *a, x64_op_t op, x64_label_t label)
+{
+    x64_sym_t *target;
+
+    if (a->fp) {
+        out_char(a, '\t');
+        out_str(a, mnemonics[op]);
+        out_char(a, ' ');
+        print_label(a, label);
+        out_char(a, '\n');
+        return;
+    }
+    // backward jumps take the short form when they can
+    if ((target = find(a, label)) && target->section == X64_TEXT
+            && is_imm8(target->offset - (a->len + 2))) {
+        put(a, op == X64_JMP ? 0xeb : 0x70 + conds[op]);
+        put(a, target->offset - (a->len + 1));
+        return;
+    }
+    if (op == X64_JMP) {
+        put(a, 0xe9);
+    } else {
+        put(a, 0x0f);
+        put(a, 0x80 + conds[op]);
+    }
+    fixup(a, 4, label, -4, 0);
+}
+
+extern void x64_call(x64_t *a, const char *name, int is_extern)
+{
+    x64_label_t label = {.name = name};
+
+    if (a->fp) {
+        out_str(a, "\tcall ");
+        print_label(a, label);
+        if (is_extern)
+            out_str(a, plt);
+        out_char(a, '\n');
+        return;
+    }
+    put(a, 0xe8);
+    fixup(a, 4, label, -4, is_extern);
+}
+
+extern void x64_label(x64_t *a, x64_label_t label)
+{
+    if (a->fp) {
+        print_label(a, label);
+        out_str(a, ":\n");
+        return;
+    }
+    define(a, label, X64_TEXT, a->len);
+}
+
+/* Define a function symbol here. */
+static void define_func(x64_t *a, const char *name, int local)
+{
+    x64_label_t label = {.name = name};
+
+    if (a->fp) {
+        if (!local) {
+            out_str(a, ".globl ");
+            out_str(a, pre);
+            out_str(a, name);
+            out_char(a, '\n');
+        }
+    } else {
+        a->funcs = grow(a->funcs, &a->cap_funcs, a->num_funcs, sizeof(*a->funcs));
+        a->funcs[a->num_funcs++] = (x64_sym_t){
+            .offset = a->len,
+            .label = label,
+            .local = local,
+        };
+    }
+    x64_label(a, label);
+}
+
+extern void x64_global(x64_t *a, const char *name)
+{
+    define_func(a, name, 0);
+}
+
+extern void x64_local(x64_t *a, const char *name)
+{
+    define_func(a, name, 1);
+}
+
+/* Define label in .data, 8-byte aligned, holding the given bytes or zeros
+ * if there are none. */
+extern void x64_data(x64_t *a, x64_label_t label, const void *bytes, int size)
+{
+    if (a->fp) {
+        out_str(a, "\t.data\n\t.balign 8\n");
+        print_label(a, label);
+        out_str(a, ":\n");
+        if (!bytes) {
+            out_str(a, "\t.zero ");
+            out_int(a, size);
+            out_char(a, '\n');
+        } else {
+            const unsigned char *b = bytes;
+            for (int i = 0; i < size; ++i) {
+                if (i % 16)
+                    out_str(a, ", ");
+                else
+                    out_str(a, i ? "\n\t.byte " : "\t.byte ");
+                out_int(a, b[i]);
+            }
+            out_char(a, '\n');
+        }
+        out_str(a, "\t.text\n");
+        return;
+    }
+    a->data_len = (a->data_len + 7) / 8 * 8;
+    a->data = grow(a->data, &a->data_cap, a->data_len + size + 8, 1);
+    define(a, label, X64_DATA, a->data_len);
+    for (int i = 0; i < size; ++i)
+        a->data[a->data_len++] = bytes ? ((const unsigned char *)bytes)[i] : 0;
+}
+
+/* Define label in .text, 4-byte aligned, as a jump table: one 32-bit
+ * offset from the table to each target. Offsets within .text are resolved
+ * by x64_end, so the table needs no relocations and can sit right after
+ * the jump that reads it. */
+extern void x64_table(x64_t *a, x64_label_t label, const x64_label_t *targets, int n)
+{
+    if (a->fp) {
+        out_str(a, "\t.balign 4\n");
+        print_label(a, label);
+        out_str(a, ":\n");
+        for (int i = 0; i < n; ++i) {
+            out_str(a, "\t.long ");
+            print_label(a, targets[i]);
+            out_str(a, " - ");
+            print_label(a, label);
+            out_char(a, '\n');
+        }
+        return;
+    }
+    while (a->len % 4)
+        put(a, 0x90);
+    define(a, label, X64_TEXT, a->len);
+    for (int i = 0; i < n; ++i)
+        fixup(a, 4, targets[i], 4 * i, 0);
+}
+
+extern void x64_begin(x64_t *a)
+{
+    if (a->fp)
+        out_str(a, "\t.text\n");
+}
+
+/* Resolve references from .text to labels in .text. References to .data
+ * and calls to anything not in this file are left in the fixup list to be
+ * relocated. */
+extern void x64_end(x64_t *a)
+{
+    int n = 0;
+
+    if (a->fp) {
+#ifndef __APPLE__
+        out_str(a, "\t.section .note.GNU-stack,\"\",@progbits\n");
+#endif
+        flush(a);
+        return;
+    }
+    for (int i = 0; i < a->num_fixups; ++i) {
+        x64_fixup_t *f = &a->fixups[i];
+        x64_sym_t *target = f->is_extern ? NULL : find(a, f->label);
+        if (target && target->section == X64_TEXT) {
+            patch(a, f->offset, f->size, target->offset + f->addend - f->offset);
+        } else if (target) {
+            f->addend += target->offset;
+            f->section = X64_DATA;
+            a->fixups[n++] = *f;
+        } else if (!f->label.id)
+            a->fixups[n++] = *f;
+        else
+            PANIC("undefined label: %s%p", f->label.name, f->label.id);
+    }
+    a->num_fixups = n;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * A tiny x86-64 assembler. Instructions are either printed as AT&T syntax
+ * or encoded straight into machine code, depending on whether the
+ * assembler was given a file to write text to.
+ */
+
+typedef enum {
+    X64_RAX, X64_RCX, X64_RDX, X64_RBX, X64_RSP, X64_RBP, X64_RSI, X64_RDI,
+    X64_R8, X64_R9, X64_R10, X64_R11, X64_R12, X64_R13, X64_R14, X64_R15,
+} x64_reg_t;
+
+typedef enum {
+    X64_NONE,
+    X64_REG,
+    X64_IMM,
+    X64_MEM,
+    X64_RIP,
+} x64_kind_t;
+
+/* Labels are a name and an optional identity, so AST nodes can name their
+ * labels without formatting strings. */
+typedef struct {
+    const char *name;
+    const void *id;
+} x64_label_t;
+
+typedef struct {
+    x64_kind_t kind;
+    int size;   // operand size in bytes: 1, 4 or 8
+    int reg;    // X64_REG: the register, X64_MEM: the base
+    int index;  // X64_MEM: index register or -1
+    int scale;  // X64_MEM: 1, 2, 4 or 8
+    int disp;   // X64_IMM: the value, X64_MEM and X64_RIP: the displacement
+    x64_label_t label; // X64_RIP: what the displacement is relative to
+} x64_operand_t;
+
+typedef enum {
+    // no operands
+    X64_CLTD,
+    X64_RET,
+
+    // one operand
+    X64_IDIV,
+    X64_IMUL1,
+    X64_NEG,
+    X64_NOT,
+    X64_POP,
+    X64_PUSH,
+    X64_SETE,
+    X64_SETNE,
+    X64_SETL,
+    X64_SETLE,
+    X64_SETG,
+    X64_SETGE,
+
+    // two operands, source first
+    X64_ADD,
+    X64_AND,
+    X64_CMP,
+    X64_IMUL,
+    X64_LEA,
+    X64_MOV,
+    X64_MOVSLQ,
+    X64_OR,
+    X64_SAR,
+    X64_SHL,
+    X64_SHR,
+    X64_SUB,
+    X64_XOR,
+
+    // three operands
+    X64_IMUL3,
+
+    // label operand
+    X64_CALL,
+    X64_JMP,
+    X64_JE,
+    X64_JNE,
+    X64_JL,
+    X64_JA,
+} x64_op_t;
+
+typedef enum {
+    X64_TEXT,
+    X64_DATA,
+} x64_section_t;
+
+typedef struct {
+    int offset;
+    x64_section_t section;
+    x64_label_t label;
+    int local; // a function only this object can see
+} x64_sym_t;
+
+/*
+ * A PC-relative field in .text: its value is the label's address plus the
+ * addend minus the field's address. After x64_end, only fixups against
+ * externs (X64_TEXT with no definition) and .data (X64_DATA, with the
+ * label's offset folded into the addend) are left for the linker.
+ */
+typedef struct {
+    int offset; // of the field
+    int size;   // of the field: 1 or 4
+    int addend;
+    x64_label_t label;
+    int is_extern;
+    x64_section_t section;
+} x64_fixup_t;
+
+#define X64_OUT_SIZE (1 << 16)
+
+typedef struct {
+    FILE *fp; // text output, or NULL to encode
+    char *out; // text not yet written to fp
+    int out_len;
+
+    unsigned char *code;
+    int len;
+    int cap;
+
+    unsigned char *data;
+    int data_len;
+    int data_cap;
+
+    x64_sym_t *labels;
+    int num_labels;
+    int cap_labels;
+    int *buckets;
+    int num_buckets;
+
+    x64_sym_t *funcs; // in the order they're defined
+    int num_funcs;
+    int cap_funcs;
+
+    x64_fixup_t *fixups;
+    int num_fixups;
+    int cap_fixups;
+} x64_t;
+
+extern x64_operand_t x64_reg(x64_reg_t reg, int size);
+extern x64_operand_t x64_imm(int value);
+extern x64_operand_t x64_mem(x64_reg_t base, int disp, int size);
+extern x64_operand_t x64_sib(x64_reg_t base, x64_reg_t index, int scale, int size);
+extern x64_operand_t x64_rip(x64_label_t label, int disp, int size);
+
+extern void x64_init(x64_t *a, FILE *fp);
+extern void x64_deinit(x64_t *a);
+
+extern void x64_op0(x64_t *a, x64_op_t op);
+extern void x64_op1(x64_t *a, x64_op_t op, x64_operand_t x);
+extern void x64_op2(x64_t *a, x64_op_t op, x64_operand_t src, x64_operand_t dst);
+extern void x64_op3(x64_t *a, x64_op_t op, x64_operand_t imm, x64_operand_t src,
+        x64_operand_t dst);
+extern void x64_jump(x64_t *a, x64_op_t op, x64_label_t label);
+extern void x64_call(x64_t *a, const char *name, int is_extern);
+
+extern void x64_label(x64_t *a, x64_label_t label);
+extern void x64_global(x64_t *a, const char *name);
+extern void x64_local(x64_t *a, const char *name);
+extern void x64_data(x64_t *a, x64_label_t label, const void *bytes, int size);
+extern void x64_table(x64_t *a, x64_label_t label, const x64_label_t *targets, int n);
+extern void x64_begin(x64_t *a);
+extern void x64_end(x64_t *a);